@@ -0,0 +1,61 @@
+// vim: noet ts=4 sw=4
+#pragma once
+#include <stdlib.h>
+
+/**
+ * @file
+ * A bump allocator for things that all die at the same time. Tokens, the
+ * strings they point at and the AST are built once per runtime and thrown
+ * away together, so there's no point in freeing them one at a time.
+ */
+
+/* Forward declarations. */
+struct _lair_runtime;
+
+/** How big a chunk is, unless an allocation needs more. */
+#define LAIR_ARENA_CHUNK_SIZE (64 * 1024)
+
+/**
+ * @brief	One block of memory handed out by an arena.
+ */
+struct _lair_arena_chunk {
+	struct _lair_arena_chunk *next; /**	The chunk allocated before this one. */
+	size_t size; /**	How many bytes this chunk can hand out. */
+	size_t used; /**	How many bytes have been handed out. */
+};
+
+/**
+ * @brief	An arena. Everything allocated from it is freed with it.
+ */
+struct _lair_arena {
+	struct _lair_arena_chunk *chunks; /**	The chunk we're allocating from, followed by the full ones. */
+	size_t allocated; /**	Bytes handed out, over all chunks. */
+};
+
+/**
+ * Creates a new, empty arena. Chunks are only allocated once they're needed.
+ */
+struct _lair_arena *_lair_arena_new();
+
+/**
+ * Allocates zeroed memory that lives as long as the arena.
+ * @param[in]	r		The current Lair runtime.
+ * @param[in]	arena	The arena to allocate from.
+ * @param[in]	size	How many bytes to allocate.
+ */
+void *_lair_arena_alloc(struct _lair_runtime *r, struct _lair_arena *arena, const size_t size);
+
+/**
+ * Copies `len` bytes of a string into the arena and NUL-terminates them.
+ * @param[in]	r		The current Lair runtime.
+ * @param[in]	arena	The arena to allocate from.
+ * @param[in]	str		The string to copy. Doesn't need to be NUL-terminated.
+ * @param[in]	len		The length of the string, in bytes.
+ */
+char *_lair_arena_strndup(struct _lair_runtime *r, struct _lair_arena *arena, const char *str, const size_t len);
+
+/**
+ * Frees an arena and everything that was allocated from it.
+ * @param[in]	arena	The arena to free.
+ */
+void _lair_arena_free(struct _lair_arena *arena);
@@ -0,0 +1,103 @@
+// vim: noet ts=4 sw=4
+#pragma once
+#include <stdint.h>
+#include <stdlib.h>
+
+/**
+ * @file
+ * Compiled programs, saved to disk so the next run of the same source can
+ * skip tokenizing, parsing and compiling. A cache file is named after a hash
+ * of the source and holds the program with every pointer turned into an
+ * offset. Loading one `mmap`s it and runs the code straight out of the
+ * mapping; the only allocations are the constant pool and the prototypes,
+ * which have to point at this runtime's symbols and builtins.
+ *
+ * A cache file that doesn't match (a different source, a different version
+ * of the format, or one that doesn't make sense) is ignored and gets written
+ * over.
+ */
+
+/* Forward declarations. */
+struct _lair_env;
+struct _lair_program;
+struct _lair_runtime;
+
+/** Bump this whenever the compiler's output or the file format changes. */
+#define LAIR_CACHE_VERSION 3
+
+/** Stands in for an offset into the string table when there isn't a string. */
+#define LR_CACHE_NONE UINT32_MAX
+
+/**
+ * @brief	The start of a cache file. Everything else comes after it, in the
+ * order of the counts here: code, constants, prototypes, locals, globals and
+ * then the strings.
+ */
+struct _lair_cache_header {
+	char magic[4]; /**	"LAIR". */
+	uint32_t version; /**	LAIR_CACHE_VERSION. */
+	uint32_t byte_order; /**	0x01020304, as the machine that wrote it saw it. */
+	uint32_t nops; /**	OP_MAX when it was written, in case the opcodes moved. */
+	uint64_t source_hash; /**	The hash of the source it was compiled from. */
+	uint64_t source_len; /**	The length of that source. */
+	uint32_t main; /**	Index of the prototype holding the top-level code. */
+	uint32_t ncode; /**	How many instructions there are. */
+	uint32_t nconstants; /**	How many constants there are. */
+	uint32_t nprotos; /**	How many prototypes there are. */
+	uint32_t nlocals; /**	How many local names there are. */
+	uint32_t nglobals; /**	How many global names there are. */
+	uint32_t strings_len; /**	How many bytes of strings there are. */
+	uint32_t unused; /**	Keeps what comes after aligned. */
+};
+
+/**
+ * @brief	A constant, as it's saved.
+ */
+struct _lair_cache_constant {
+	uint32_t type; /**	Its LAIR_TOKEN. */
+	int32_t proto; /**	The prototype a function reference refers to, or -1. */
+	int32_t num; /**	Its value, for numbers and booleans. */
+	uint32_t name; /**	Where its symbol's name is in the strings, or LR_CACHE_NONE. */
+	uint32_t str; /**	Where its string is in the strings, or LR_CACHE_NONE. */
+};
+
+/**
+ * @brief	A prototype, as it's saved.
+ */
+struct _lair_cache_proto {
+	uint32_t name; /**	Where its name is in the strings. */
+	int32_t argc; /**	The number of parameters. */
+	int32_t nregs; /**	How many registers a frame needs. */
+	int32_t nlocals; /**	How many of those hold named locals. */
+	uint32_t locals; /**	Where its locals' names start in the locals. */
+	uint32_t entry; /**	Its first instruction. */
+	uint32_t builtin; /**	Set if it's a builtin, which is looked up by name when loading. */
+};
+
+/**
+ * Loads a compiled program from the cache, if there's one there for this
+ * source. Returns NULL if there isn't.
+ * @param[in]	r		The current Lair runtime. `r->options.cache_dir` says where the cache is.
+ * @param[in]	env		The standard environment, used to find builtins.
+ * @param[in]	source	The source of the program.
+ * @param[in]	len		The length of the source, in bytes.
+ */
+struct _lair_program *_lair_cache_load(
+		struct _lair_runtime *r,
+		const struct _lair_env *env,
+		const char *source,
+		const size_t len);
+
+/**
+ * Saves a compiled program to the cache. Failing to is not an error; the
+ * next run just compiles it again.
+ * @param[in]	r		The current Lair runtime. `r->options.cache_dir` says where the cache is.
+ * @param[in]	program	The program.
+ * @param[in]	source	The source it was compiled from.
+ * @param[in]	len		The length of the source, in bytes.
+ */
+void _lair_cache_store(
+		struct _lair_runtime *r,
+		const struct _lair_program *program,
+		const char *source,
+		const size_t len);
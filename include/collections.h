@@ -0,0 +1,150 @@
+// vim: noet ts=4 sw=4
+#pragma once
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "value.h"
+
+/**
+ * @file
+ * Persistent vectors and hash maps. Nothing here is ever changed once it's
+ * been made: updating a collection makes a new one that shares everything
+ * but the path to the change with the old one, so both stay valid and an
+ * update only copies O(log32 n) nodes.
+ *
+ * Vectors are 32-way tries with the last (up to) 32 items kept in a separate
+ * tail, so pushing usually only copies the tail. Maps are hash array mapped
+ * tries: each node has a bitmap of which of its 32 slots are in use and only
+ * stores those.
+ *
+ * All of the nodes are managed by the garbage collector. Building a new
+ * version takes several allocations, none of which are reachable from the VM
+ * until it's done, so the collector is paused while that happens.
+ */
+
+/* Forward declarations. */
+struct _lair_runtime;
+
+/** How many bits of an index or hash each level of a trie uses. */
+#define LAIR_TRIE_BITS 5
+/** How many slots a trie node has. */
+#define LAIR_TRIE_WIDTH (1 << LAIR_TRIE_BITS)
+
+/**
+ * @brief	A node in a vector's trie or a map's HAMT. Only exists at runtime,
+ * and never where a program can see it.
+ */
+struct _lair_node {
+	uint32_t bitmap; /**	For map nodes, which of the 32 slots are in use. */
+	uint32_t size; /**	How many values are in `slots`. */
+	unsigned char collision; /**	Set for map nodes holding keys whose whole hash is the same. */
+	_lair_val slots[]; /**	Children or items. Map nodes hold key/value pairs, where a nil key means the value is a child node. */
+};
+
+/**
+ * @brief	A persistent vector.
+ */
+struct _lair_vector {
+	size_t count; /**	How many items are in the vector. */
+	unsigned int shift; /**	How far to shift an index to find its slot in the root. */
+	_lair_val root; /**	The trie holding everything but the tail. LR_NIL if it's empty. */
+	_lair_val tail; /**	The last few items. LR_NIL if there aren't any. */
+};
+
+/**
+ * @brief	A persistent hash map.
+ */
+struct _lair_map {
+	size_t count; /**	How many keys are in the map. */
+	_lair_val root; /**	The root of the HAMT. LR_NIL if the map is empty. */
+};
+
+/**
+ * Hashes a value. Equal values (see `_lair_values_equal`) hash the same.
+ * Might flatten a rope, so `v` has to be reachable from the VM.
+ * @param[in]	r	The current Lair runtime.
+ * @param[in]	v	The value to hash.
+ */
+uint32_t _lair_hash_value(struct _lair_runtime *r, const _lair_val v);
+
+/**
+ * Whether two values are the same, as far as map keys go. Numbers, strings
+ * and functions are compared by what they are, and collections by what's in
+ * them, so two vectors with the same items are the same key.
+ * @param[in]	r	The current Lair runtime.
+ * @param[in]	a	A value.
+ * @param[in]	b	Another value.
+ */
+int _lair_values_equal(struct _lair_runtime *r, const _lair_val a, const _lair_val b);
+
+/**
+ * Makes a new, empty vector.
+ * @param[in]	r	The current Lair runtime.
+ */
+_lair_val _lair_vector_new(struct _lair_runtime *r);
+
+/**
+ * Gets the item at `i` out of a vector. `i` has to be in range.
+ * @param[in]	vec	The vector.
+ * @param[in]	i	The index.
+ */
+_lair_val _lair_vector_get(const struct _lair_vector *vec, const size_t i);
+
+/**
+ * Makes a new vector with `item` on the end.
+ * @param[in]	r		The current Lair runtime.
+ * @param[in]	vec		The vector to add to. Has to be reachable from the VM.
+ * @param[in]	item	The item to add.
+ */
+_lair_val _lair_vector_push(struct _lair_runtime *r, const _lair_val vec, const _lair_val item);
+
+/**
+ * Makes a new vector with the item at `i` replaced. `i` can be one past the
+ * end, which is the same as a push.
+ * @param[in]	r		The current Lair runtime.
+ * @param[in]	vec		The vector to change. Has to be reachable from the VM.
+ * @param[in]	i		The index.
+ * @param[in]	item	The new item.
+ */
+_lair_val _lair_vector_set(struct _lair_runtime *r, const _lair_val vec, const size_t i, const _lair_val item);
+
+/**
+ * Makes a new, empty map.
+ * @param[in]	r	The current Lair runtime.
+ */
+_lair_val _lair_map_new(struct _lair_runtime *r);
+
+/**
+ * Looks a key up in a map.
+ * Returns a pointer to the value, or NULL if the key isn't there.
+ * @param[in]	r	The current Lair runtime.
+ * @param[in]	map	The map. Has to be reachable from the VM.
+ * @param[in]	key	The key to look for. Has to be reachable from the VM.
+ */
+const _lair_val *_lair_map_get(struct _lair_runtime *r, const _lair_val map, const _lair_val key);
+
+/**
+ * Makes a new map with `key` set to `value`.
+ * @param[in]	r		The current Lair runtime.
+ * @param[in]	map		The map to change. Has to be reachable from the VM.
+ * @param[in]	key		The key.
+ * @param[in]	value	The value.
+ */
+_lair_val _lair_map_put(struct _lair_runtime *r, const _lair_val map, const _lair_val key, const _lair_val value);
+
+/**
+ * Makes a new map without `key` in it. If it wasn't there to begin with, you
+ * get the same map back.
+ * @param[in]	r	The current Lair runtime.
+ * @param[in]	map	The map to change. Has to be reachable from the VM.
+ * @param[in]	key	The key to remove.
+ */
+_lair_val _lair_map_del(struct _lair_runtime *r, const _lair_val map, const _lair_val key);
+
+/**
+ * Calls `per_pair` on every key and value in a map, in no particular order.
+ * @param[in]	map			The map.
+ * @param[in]	per_pair	Callback function that will be called with each key, value and `ctx`.
+ * @param[in]	ctx			Passed through to `per_pair`.
+ */
+void _lair_map_each(const struct _lair_map *map, void (*per_pair)(const _lair_val key, const _lair_val value, void *ctx), void *ctx);
@@ -0,0 +1,143 @@
+// vim: noet ts=4 sw=4
+#pragma once
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "symbol.h"
+
+/**
+ * @file
+ * Lowers the parsed AST into a flat bytecode program for the VM. Instructions
+ * are 32 bits wide and laid out like so:
+ *
+ *     | C (8) | B (8) | A (8) | OP (8) |
+ *
+ * `B` and `C` can be read together as a single 16 bit `Bx` operand, which is
+ * how constants and jump offsets are addressed, and `A`, `B` and `C` together
+ * as a 24 bit `Ax` operand.
+ */
+
+/* Forward declarations. */
+struct _lair_ast;
+struct _lair_env;
+struct _lair_function;
+struct _lair_runtime;
+struct vector;
+
+/**
+ * @brief	The instructions the VM knows how to run.
+ */
+typedef enum {
+	OP_LOADK, /**	R[A] = K[Bx] */
+	OP_GETLOCAL, /**	R[A] = R[B], where R[B] is a local. Fails if it isn't bound. */
+	OP_SETLOCAL, /**	Binds the local R[A] to R[B]. Fails if it's already bound. */
+	OP_GETGLOBAL, /**	R[A] = G[Bx]. Fails if it isn't bound. */
+	OP_SETGLOBAL, /**	Binds G[Bx] to R[A]. Fails if it's already bound. */
+	OP_CALL, /**	R[A] = R[A](R[A + 1], ..., R[A + C]) */
+	OP_TAILCALL, /**	return R[A](R[A + 1], ..., R[A + C]), reusing the current frame. */
+	OP_CALLK, /**	R[A] = P[Bx](R[A + 1], ...), for callees known at compile time. */
+	OP_TAILCALLK, /**	return P[Bx](R[A + 1], ...), reusing the current frame. */
+	OP_JMPF, /**	If R[A] is not canonical true, pc += sBx. */
+	OP_RET, /**	Returns R[A] to the caller. */
+	OP_RETNIL, /**	Returns NULL to the caller. */
+	OP_FORKK, /**	OP_CALLK, but the call may be made on another thread. See parallel.h. */
+	OP_JOIN, /**	Waits for the calls forked into R[A] and up. */
+	/* The compiler never emits these. When we're profiling, the VM runs a
+	 * copy of the code with every call and return swapped for one of these,
+	 * which do the same thing and tell the profiler about it.
+	 */
+	OP_PCALL, /**	OP_CALL, profiled. */
+	OP_PTAILCALL, /**	OP_TAILCALL, profiled. */
+	OP_PCALLK, /**	OP_CALLK, profiled. */
+	OP_PTAILCALLK, /**	OP_TAILCALLK, profiled. */
+	OP_PRET, /**	OP_RET, profiled. */
+	OP_PRETNIL, /**	OP_RETNIL, profiled. */
+	OP_MAX /**	Not an instruction. The number of opcodes. */
+} LAIR_OPCODE;
+
+#define LR_OP(i)	((LAIR_OPCODE)((i) & 0xFF))
+#define LR_A(i)		((int)(((i) >> 8) & 0xFF))
+#define LR_B(i)		((int)(((i) >> 16) & 0xFF))
+#define LR_C(i)		((int)(((i) >> 24) & 0xFF))
+#define LR_BX(i)	((int)(((i) >> 16) & 0xFFFF))
+#define LR_SBX(i)	(LR_BX(i) - LR_SBX_BIAS)
+#define LR_AX(i)	((int)((i) >> 8))
+
+#define LR_SBX_BIAS	0x7FFF
+#define LR_MAX_REGS	0xFF
+#define LR_MAX_BX	0xFFFF
+
+#define LR_ABC(op, a, b, c)	((uint32_t)(op) | ((uint32_t)(a) << 8) | ((uint32_t)(b) << 16) | ((uint32_t)(c) << 24))
+#define LR_ABX(op, a, bx)	((uint32_t)(op) | ((uint32_t)(a) << 8) | ((uint32_t)(bx) << 16))
+#define LR_AXI(op, ax)		((uint32_t)(op) | ((uint32_t)(ax) << 8))
+
+/**
+ * @brief	A compiled Den function, or a builtin one the program calls.
+ * A frame's registers start with the parameters, then the rest of the
+ * locals, then temporaries.
+ */
+struct _lair_proto {
+	const char *name; /**	The name of the function. Belongs to the symbol table. */
+	_lair_sym sym; /**	The interned name of the function. */
+	int argc; /**	The number of parameters the function takes. */
+	int nregs; /**	How many registers a frame for this function needs. */
+	int nlocals; /**	How many of those registers hold named locals, parameters included. */
+	size_t locals; /**	Where the names of the locals start in the program's `locals`. */
+	size_t entry; /**	Offset of the first instruction in the program's code. */
+	const struct _lair_function *builtin; /**	Set if this is a builtin, in which case there is no code. */
+};
+
+/**
+ * @brief	The output of the compiler. Everything the VM needs to run a script.
+ */
+struct _lair_program {
+	struct vector *code; /**	The instruction stream. Vector of uint32_t. */
+	struct vector *constants; /**	The constant pool. Vector of struct _lair_type. */
+	struct vector *protos; /**	Every function in the program. Vector of struct _lair_proto. */
+	struct vector *locals; /**	The name of every local in every function. Vector of _lair_sym. */
+	struct vector *globals; /**	The name of every global, indexed by slot. Vector of _lair_sym. */
+	size_t main; /**	Index of the prototype holding the top-level code. */
+	void *mapping; /**	The cache file this was loaded from, if it was. The code and strings live in it. */
+	size_t mapping_len; /**	How big that file is. */
+};
+
+/**
+ * Compiles an AST into a program.
+ * @param[in]	r		The current Lair runtime.
+ * @param[in]	root	The root node of the AST.
+ * @param[in]	env		The standard environment, used to find builtins.
+ */
+struct _lair_program *_lair_compile(
+		struct _lair_runtime *r,
+		const struct _lair_ast *root,
+		const struct _lair_env *env);
+
+/**
+ * Works out which functions in a program are pure: nothing they call, or
+ * anything those call, can do I/O, and they never call a function they only
+ * find out about at runtime.
+ * @param[in]	program	The program.
+ * @param[out]	pure	Set for each prototype that's pure, and cleared for the rest.
+ * @param[in]	globals	Unset if reading a global should make a function impure too.
+ */
+void _lair_find_pure(const struct _lair_program *program, unsigned char *pure, const int globals);
+
+/**
+ * The name of an opcode, without the `OP_`.
+ * @param[in]	op	The opcode.
+ */
+const char *_lair_op_name(const LAIR_OPCODE op);
+
+/**
+ * Helper function that dumps a compiled program to STDOUT in a human friendly
+ * format.
+ * @param[in]	r		The current Lair runtime.
+ * @param[in]	program	The program to print.
+ */
+void lair_print_program(const struct _lair_runtime *r, const struct _lair_program *program);
+
+/**
+ * Frees a program generated by `_lair_compile` or loaded from the cache.
+ * @param[in]	program	The program to free.
+ */
+void _lair_free_program(struct _lair_program *program);
@@ -1,5 +1,6 @@
 // vim: noet ts=4 sw=4
 #pragma once
+#include <stdio.h>
 
 struct _lair_runtime;
 
@@ -19,6 +20,11 @@ void throw_exception(
 		const ERROR_TYPE err_type,
 		const char *msg);
 
+/* Only for the command line. Nothing in the runtime exits the process; it
+ * throws instead, and lair_execute returns non-zero.
+ */
 void error_and_die(const ERROR_TYPE err_type, const char *msg);
 
 void print_error(const ERROR_TYPE err_type, const char *msg);
+
+void fprint_error(FILE *out, const ERROR_TYPE err_type, const char *msg);
@@ -1,10 +1,10 @@
 // vim: noet ts=4 sw=4
 #pragma once
 #include "lair.h"
+#include "map.h"
+#include "value.h"
 
-#define LAIR_FUNCTION_SIG struct _lair_runtime *r, const int argc, const struct _lair_type *argv[]
-#define ADD_TO_STD_ENV(RUNTIME, FUNC_NAME, ARGS, PTR) rc = _lair_add_builtin_function(RUNTIME, std_env, FUNC_NAME, ARGS, PTR);\
-	if (rc != 0) { error_and_die(ERR_RUNTIME, "Could not build standard env."); }
+#define LAIR_FUNCTION_SIG struct _lair_runtime *r, const int argc, const _lair_val argv[]
 /**
  * @file
  * Where the magic happens.
@@ -13,46 +13,67 @@
 /* Forward declarations. */
 struct _lair_ast;
 struct _lair_type;
-struct _tst_map_node;
 
 /**
- * @brief An object representing an environment in Lair.
+ * @brief An object representing an environment in Lair. The builtins aren't
+ * in here; they're in `_lair_builtins`, which every runtime shares. An
+ * environment only holds what's been added on top of them.
  */
 struct _lair_env {
 	struct _lair_env *parent; /**	The parent of this environment. */
-	struct _tst_map_node *c_functions; /**	C functions defined in the env. map of str -> _lair_function objects. */
-	struct _tst_map_node *functions; /**	Functions defined in the program itself. map of str -> _lair_ast objects. */
-	struct _tst_map_node *not_variables; /**	Things-that-aren't-variables in this env. They are used for binding atoms to values. */
-	const struct _lair_ast *current_function; /**	If we are operating inside of a function, this is the pointer to that node. */
-	int currently_returning; /**	Fuck a state machine. */
+	struct _sym_map c_functions; /**	C functions defined in the env. map of symbol -> _lair_function objects. */
 };
 
 /**
  * @brief Object representinga function.
  */
 struct _lair_function {
-	const int argc; /**	The number of arguments in the argv array. This is also the number of arguments the function takes. */
-	struct _lair_type **argv; /**	The arguments themselves. */
-	const struct _lair_type *(*function_ptr)(LAIR_FUNCTION_SIG); /**	A C function that will be called when this is evaluated. */
+	const char *name; /**	The name it's called by. */
+	const int argc; /**	The number of arguments the function takes. */
+	_lair_val (*function_ptr)(LAIR_FUNCTION_SIG); /**	A C function that will be called when this is evaluated. */
+	const unsigned char io; /**	Set if it reads or writes anything outside the program, or calls functions it's handed, so calls that reach it can't be memoized. */
 };
 
 /**
- * Runs a lair AST. (Is that right? Am I fooling anyone?)
+ * Every builtin, sorted by name. Nothing ever changes this, so runtimes don't
+ * need copies of their own.
+ */
+extern const struct _lair_function _lair_builtins[];
+
+/** How many builtins there are. */
+extern const size_t _lair_nbuiltins;
+
+/**
+ * Finds a builtin by name. Returns NULL if there isn't one.
+ * @param[in]	name	The name.
+ */
+const struct _lair_function *_lair_find_builtin(const char *name);
+
+/**
+ * Finds the C function a symbol names, looking through the environment and its
+ * parents and then the builtins. Returns NULL if there isn't one.
  * @param[in]	r		The current Lair runtime.
- * @param[in]	root	The root node of the AST.
+ * @param[in]	env		The environment to start in.
+ * @param[in]	sym		The name.
  */
-int _lair_eval(struct _lair_runtime *r, const struct _lair_ast *root);
+const struct _lair_function *_lair_env_get(
+		const struct _lair_runtime *r,
+		const struct _lair_env *env,
+		const _lair_sym sym);
 
 /**
- * Generates and returns a map with the standard lib in it.
+ * Runs the runtime's compiled program on the VM, then frees it and the
+ * standard environment.
+ * @param[in]	r		The current Lair runtime, with `program` and `std_env` set.
  */
-struct _lair_env *_lair_standard_env();
+int _lair_eval(struct _lair_runtime *r);
 
 /**
- * Generates an empty environment suitable for creating scope.
- * @param[in]	parent	The parent scope.
+ * Returns an empty environment on top of the builtins, for a program's own
+ * C functions.
+ * @param[in]	r		The current Lair runtime.
  */
-struct _lair_env *_lair_env_with_parent(struct _lair_env *parent);
+struct _lair_env *_lair_standard_env(struct _lair_runtime *r);
 
 /**
  * Adds a function to an environment.
@@ -68,28 +89,17 @@ int _lair_add_builtin_function(
 		struct _lair_env *env,
 		const char *name,
 		const int argc,
-		const struct _lair_type *(*func_ptr)(LAIR_FUNCTION_SIG));
-
-/**
- * Evaluates an ast node inside of the passed environment.
- * @param[in]	r	The current Lair runtime.
- * @param[in]	ast	The AST node to evaluate.
- * @param[in]	env	The environment to operate under.
- */
-const struct _lair_type *_lair_env_eval(
-		struct _lair_runtime *r,
-		const struct _lair_ast *ast,
-		struct _lair_env *env);
+		_lair_val (*func_ptr)(LAIR_FUNCTION_SIG));
 
 /**
  * Returns the one and only 'true' lair value.
  */
-const struct _lair_type *_lair_canonical_true();
+_lair_val _lair_canonical_true();
 
 /**
  * Returns the one and only 'false' lair value.
  */
-const struct _lair_type *_lair_canonical_false();
+_lair_val _lair_canonical_false();
 
 /**
  * Frees the stuff in an environment, and the env itself.
@@ -1,8 +1,144 @@
 // vim: noet ts=4 sw=4
 #pragma once
+#include <stdint.h>
+#include <stdlib.h>
 
+#include "value.h"
+
+/**
+ * @file
+ * A mark-and-sweep garbage collector for values created while a program runs.
+ * Only boxed values are ever managed by it: numbers and booleans are carried
+ * around in the value itself, and boxed values that come out of the constant
+ * pool belong to the program. Anything a builtin boxes is managed.
+ *
+ * Some values point at others, like ropes do at their halves and collections
+ * do at their nodes. Those get traced from a stack of values waiting to be
+ * looked at, not by recursing, so long chains of them can't blow up the C
+ * stack.
+ */
+
+/* Forward declarations. */
+struct _lair_runtime;
+struct _lair_type;
 struct vector;
+
+/** How many bytes we let the program allocate before the first collection. */
+#define LAIR_GC_INITIAL_THRESHOLD (1024 * 1024)
+
+/**
+ * @brief	Header that lives in front of every managed value.
+ */
 struct _lair_gc_node {
-	/* OTHER STUFF HERE */
-	struct vector *parents;
+	struct _lair_gc_node *next; /**	The next object in the heap. */
+	size_t size; /**	How big this allocation is, header included. */
+	unsigned char marked; /**	Set during marking if the object is reachable. */
+	unsigned char category; /**	What the memory's for. A LAIR_MEM_CATEGORY. */
+	uint32_t site; /**	The prototype of the function that made it, or LR_NO_SITE. */
+};
+
+/**
+ * @brief	Values C code is holding on to. See `_lair_gc_hold`.
+ */
+struct _lair_gc_held {
+	struct _lair_gc_held *prev; /**	What was held before these. */
+	size_t count; /**	How many values there are. */
+	_lair_val values[]; /**	The values. */
+};
+
+/**
+ * @brief	The heap. One per runtime.
+ */
+struct _lair_gc {
+	struct _lair_gc_node *objects; /**	Every object the collector owns. */
+	size_t allocated; /**	Bytes currently owned by the collector. */
+	size_t threshold; /**	When `allocated` goes past this we collect. */
+	size_t collections; /**	How many times we've collected. */
+	size_t allocs; /**	How many values have ever been allocated. */
+	size_t total_bytes; /**	How many bytes have ever been allocated, headers included. */
+	struct vector *gray; /**	Values that have been marked but whose insides haven't. Vector of _lair_val. */
+	unsigned int paused; /**	Collections don't happen while this is above zero. */
+	struct _lair_gc_held *held; /**	The values held most recently. */
 };
+
+/**
+ * Creates a new, empty heap.
+ */
+struct _lair_gc *_lair_gc_new();
+
+/**
+ * Allocates a new managed value. This might trigger a collection, so anything
+ * the caller is holding on to needs to be reachable from the VM.
+ * @param[in]	r		The current Lair runtime.
+ * @param[in]	type	The type of the value.
+ * @param[in]	extra	Number of zeroed bytes to allocate after the value. Mostly
+ *						used to keep a string in the same allocation as its value.
+ */
+struct _lair_type *_lair_gc_alloc(struct _lair_runtime *r, const LAIR_TOKEN type, const size_t extra);
+
+/**
+ * Allocates a new managed string value with room for `len` bytes plus a NUL.
+ * @param[in]	r	The current Lair runtime.
+ * @param[in]	len	The length of the string.
+ */
+struct _lair_type *_lair_gc_string(struct _lair_runtime *r, const size_t len);
+
+/**
+ * Makes a number value. Only allocates on the rare platform where the number
+ * doesn't fit in a tagged word.
+ * @param[in]	r	The current Lair runtime.
+ * @param[in]	num	The number.
+ */
+_lair_val _lair_gc_num(struct _lair_runtime *r, const int num);
+
+/**
+ * Frees everything that isn't reachable from the VM's registers or the
+ * environments of its live frames.
+ * @param[in]	r	The current Lair runtime.
+ */
+void _lair_gc_collect(struct _lair_runtime *r);
+
+/**
+ * Stops collections from happening until `_lair_gc_resume` is called. For
+ * code that builds values out of several allocations, which are only held in
+ * C variables until they're done. Calls nest.
+ * @param[in]	r	The current Lair runtime.
+ */
+void _lair_gc_pause(struct _lair_runtime *r);
+
+/**
+ * Undoes a `_lair_gc_pause`.
+ * @param[in]	r	The current Lair runtime.
+ */
+void _lair_gc_resume(struct _lair_runtime *r);
+
+/**
+ * Makes room for values that C code needs to hold on to while it calls Den
+ * functions, which might collect. The values are roots until
+ * `_lair_gc_release`, and start out NULL. If the program dies first, they go
+ * when the heap does.
+ * @param[in]	r		The current Lair runtime.
+ * @param[in]	count	How many values there are.
+ */
+_lair_val *_lair_gc_hold(struct _lair_runtime *r, const size_t count);
+
+/**
+ * Lets go of the values held most recently.
+ * @param[in]	r		The current Lair runtime.
+ */
+void _lair_gc_release(struct _lair_runtime *r);
+
+/**
+ * Takes every object in another heap into this runtime's, along with what
+ * they were charged to. The other heap is left empty, though anything it's
+ * holding stays held there.
+ * @param[in]	r		The current Lair runtime.
+ * @param[in]	from	The runtime whose heap to take. Its VM has to be gone.
+ */
+void _lair_gc_adopt(struct _lair_runtime *r, struct _lair_runtime *from);
+
+/**
+ * Frees the heap and every object in it.
+ * @param[in]	gc	The heap to free.
+ */
+void _lair_gc_free(struct _lair_gc *gc);
@@ -2,9 +2,21 @@
 #pragma once
 
 #include <setjmp.h>
+#include <stdio.h>
 
 #include "error.h"
 
+struct _lair_arena;
+struct _lair_env;
+struct _lair_gc;
+struct _lair_memory;
+struct _lair_parallel;
+struct _lair_profile;
+struct _lair_program;
+struct _lair_stats;
+struct _lair_symbols;
+struct _lair_vm;
+
 /** @file
  * @brief Main functions intended for outside usage.
  */
@@ -16,13 +28,50 @@
  */
 char *lair_load_file(const char *file_path, size_t *buf_size);
 
+/**
+ * @brief	Ways to change how a program is run. A zeroed one gets you the
+ * defaults.
+ */
+struct lair_options {
+	int profile; /**	Time every call and count what it allocates, and report on it when the program's done. */
+	const char *profile_path; /**	Write the profile here as JSON. If NULL it goes to STDERR as a table. */
+	int sample; /**	Sample the call stack on a timer instead, and write out the folded stacks when the program's done. */
+	int sample_hz; /**	How many samples to take per second of CPU time. 0 for the default. */
+	const char *sample_path; /**	Write the folded stacks here. If NULL they go to STDERR. */
+	int stats; /**	Count what the interpreter does, and report on it when the program's done. */
+	const char *stats_path; /**	Write the counts here. If NULL they go to STDERR. */
+	int memory; /**	Report where the memory went when the program's done, and whenever we get SIGUSR1. */
+	const char *memory_path; /**	Write that report here. If NULL it goes to STDERR. SIGUSR1's always go to STDERR. */
+	int memo; /**	Remember what pure functions return, and don't call them again with the same arguments. */
+	size_t memo_size; /**	How many results to remember. 0 for the default. */
+	int parallel; /**	Let calls to pure functions in the same argument list run alongside each other on up to this many threads, counting the one running the program. 0 or 1 to run everything on that one. */
+	size_t parallel_cost; /**	Calls that take less than this many microseconds on average aren't worth running somewhere else. 0 for the default. */
+	const char *cache_dir; /**	Keep compiled programs in this directory, and run them from there when the source hasn't changed. NULL to always compile. */
+	FILE *out; /**	Where the program's output and its errors go. NULL for STDOUT. */
+};
+
 /**
  * Executes a program.
+ *
+ * Every call gets a runtime of its own, and nothing but the workers that run
+ * forked calls is shared between runtimes, so any number of threads can call
+ * this (or `lair_execute_with_options`) at once. Errors in the program are printed and
+ * make this return non-zero; they never end the process. The only exceptions
+ * are `--sample` and `--memory`, which need a process-wide signal: one runtime
+ * at a time gets them, and the rest fail or go without.
  * @param[in]	program	The program to be executed.
  * @param[in]	len	The length of the program, in bytes.
  */
 int lair_execute(const char *program, const size_t len);
 
+/**
+ * Executes a program with some options.
+ * @param[in]	program	The program to be executed.
+ * @param[in]	len	The length of the program, in bytes.
+ * @param[in]	options	How to run it. NULL for the defaults.
+ */
+int lair_execute_with_options(const char *program, const size_t len, const struct lair_options *options);
+
 /**
  * Unloads a loaded file.
  * @param[in]	loaded	The loaded buffer.
@@ -37,4 +86,16 @@ struct _lair_runtime {
 	ERROR_TYPE exception_type;
 	char *exception_msg;
 	jmp_buf exception_buffer;
+	struct _lair_vm *vm; /**	The VM currently running, if any. */
+	struct _lair_arena *arena; /**	The tokens and the AST of the program being run. */
+	struct _lair_gc *gc; /**	The heap values created at runtime live in. */
+	struct _lair_symbols *symbols; /**	Every identifier the runtime has seen. */
+	struct _lair_memory *memory; /**	Where the memory's gone. */
+	struct _lair_env *std_env; /**	C functions added on top of the builtins, while the program's running. */
+	struct _lair_program *program; /**	The compiled program, while it's running. */
+	struct lair_options options; /**	How the program is being run. */
+	struct _lair_profile *profile; /**	The profile of the program, if we're making one. */
+	struct _lair_stats *stats; /**	What the interpreter's been doing, if we're counting. */
+	struct _lair_memo *memo; /**	What pure functions have returned, if we're remembering. */
+	struct _lair_parallel *parallel; /**	What's known about running the program on other threads, if we are. Shared with the runtimes running its forks. */
 };
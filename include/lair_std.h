@@ -16,31 +16,85 @@ struct _lair_type;
  * The '+' operator. Adds two things together, must be of the same type, and
  * probably not functions. Adding functions together sounds weird.
  */
-const struct _lair_type *_lair_builtin_operator_plus(LAIR_FUNCTION_SIG);
+_lair_val _lair_builtin_operator_plus(LAIR_FUNCTION_SIG);
 
 /**
  * The '-' operator. Subtracts two things, must be of the same type, and
  * probably not functions. Adding functions together sounds weird. Doesn't
  * work on strings.
  */
-const struct _lair_type *_lair_builtin_operator_minus(LAIR_FUNCTION_SIG);
+_lair_val _lair_builtin_operator_minus(LAIR_FUNCTION_SIG);
 
 /**
  * The '=' operator. Tries to compare two things together.
  */
-const struct _lair_type *_lair_builtin_operator_eq(LAIR_FUNCTION_SIG);
+_lair_val _lair_builtin_operator_eq(LAIR_FUNCTION_SIG);
 
 /**
  * Prints a _lair_type to STDOUT.
  */
-const struct _lair_type *_lair_builtin_print(LAIR_FUNCTION_SIG);
+_lair_val _lair_builtin_print(LAIR_FUNCTION_SIG);
 
 /**
  * Prints a _lair_type to STDOUT and appends a newline character.
  */
-const struct _lair_type *_lair_builtin_println(LAIR_FUNCTION_SIG);
+_lair_val _lair_builtin_println(LAIR_FUNCTION_SIG);
 
 /**
  * Converts a type to a string.
  */
-const struct _lair_type *_lair_builtin_str(LAIR_FUNCTION_SIG);
+_lair_val _lair_builtin_str(LAIR_FUNCTION_SIG);
+
+/**
+ * Makes a new, empty vector.
+ */
+_lair_val _lair_builtin_vector(LAIR_FUNCTION_SIG);
+
+/**
+ * Makes a new, empty map.
+ */
+_lair_val _lair_builtin_dict(LAIR_FUNCTION_SIG);
+
+/**
+ * Returns a copy of a vector with something added to the end.
+ */
+_lair_val _lair_builtin_push(LAIR_FUNCTION_SIG);
+
+/**
+ * Returns a copy of a vector or map with the thing at an index or key replaced.
+ */
+_lair_val _lair_builtin_put(LAIR_FUNCTION_SIG);
+
+/**
+ * Gets the thing at an index or key in a vector or map.
+ */
+_lair_val _lair_builtin_get(LAIR_FUNCTION_SIG);
+
+/**
+ * Whether a vector or map has something at an index or key.
+ */
+_lair_val _lair_builtin_has(LAIR_FUNCTION_SIG);
+
+/**
+ * Returns a copy of a map without a key in it.
+ */
+_lair_val _lair_builtin_del(LAIR_FUNCTION_SIG);
+
+/**
+ * How many things are in a vector or map, or bytes in a string.
+ */
+_lair_val _lair_builtin_count(LAIR_FUNCTION_SIG);
+
+/**
+ * Calls a function on everything in a vector, or on the numbers up to a
+ * number, and returns a vector of the results. Uses the worker threads if
+ * there are any.
+ */
+_lair_val _lair_builtin_pmap(LAIR_FUNCTION_SIG);
+
+/**
+ * Combines everything in a vector, or the numbers up to a number, with an
+ * associative function, starting from a value. Uses the worker threads if
+ * there are any.
+ */
+_lair_val _lair_builtin_preduce(LAIR_FUNCTION_SIG);
@@ -1,6 +1,9 @@
 // vim: noet ts=4 sw=4
 #pragma once
+#include <stdint.h>
 #include <stdlib.h>
+
+#include "symbol.h"
 /**
  * @file
  * Holds a nice little map implementation. It's not a hash map, it's a ternary
@@ -8,6 +11,10 @@
  * random cases) than your good old hash map.
  *
  * IT'S MY PROJECT I'LL USE THE DATA STRUCTURES I WANT TO, DAMN IT!
+ *
+ * Fine. There are hash maps down at the bottom too: `_str_map` does what the
+ * tree does with a flat table, and `_sym_map` is keyed by interned symbols.
+ * Pick whichever suits the map.
  */
 
 /**
@@ -40,14 +47,142 @@ int _tst_map_insert(struct _tst_map_node **root, const char *key, const size_t k
 const void *_tst_map_get(struct _tst_map_node *root, const char *key, const size_t klen);
 
 /**
- * Deletes something out of the tree.
+ * Deletes something out of the tree. The nodes stay, only the value goes.
  * Returns 0 on successful deletion.
  */
 int _tst_map_delete(struct _tst_map_node *root, const char *key, const size_t klen);
 
+/**
+ * Calls `per_value` on every value in the tree, in no particular order.
+ * @param[in]	root	The root node.
+ * @param[in]	per_value	Callback function that will be called with each value and `ctx`.
+ * @param[in]	ctx		Passed through to `per_value`.
+ */
+void _tst_map_each(struct _tst_map_node *root, void (*per_value)(const void *value, void *ctx), void *ctx);
+
 /**
  * Frees the entire tree.
  * @param[in]	root	The root node.
  * @param[in]	per_value_cleanup	Optional callback function that will be called right before the vale is freed.
  */
 void _tst_map_destroy(struct _tst_map_node *root, void (*per_value_cleanup)(void *data));
+
+/**
+ * @brief A map keyed by interned symbols instead of strings. It's a small
+ * open-addressed hash table, and since symbols are dense the symbol is its own
+ * hash. Values are stored inline, so a zeroed `struct _sym_map` is an empty
+ * map and nothing is allocated until the first insert.
+ */
+struct _sym_map {
+	_lair_sym *keys; /**	The key in each slot. LR_NO_SYM if the slot is empty. */
+	unsigned char *values; /**	`capacity` values, `vsize` bytes apiece. */
+	size_t vsize; /**	The size of each value. Set by the first insert. */
+	size_t capacity; /**	How many slots there are. Always a power of two. */
+	size_t count; /**	How many slots are in use. */
+};
+
+/**
+ * Inserts a copy of `value` under `key`. Every value in a map has to be the
+ * same size.
+ * Returns 0 on success, 1 if the key is already in the map.
+ * @param[in]	map		The map to insert into.
+ * @param[in]	key		The symbol to file the value under.
+ * @param[in]	value	The data you want to insert.
+ * @param[in]	vsize	The size of the value you want to insert.
+ */
+int _sym_map_insert(struct _sym_map *map, const _lair_sym key, const void *value, const size_t vsize);
+
+/**
+ * Gets something out of the map. The value can be modified in place, but the
+ * pointer is only good until the next insert.
+ * Returns NULL on failure.
+ */
+void *_sym_map_get(const struct _sym_map *map, const _lair_sym key);
+
+/**
+ * Calls `per_value` on every value in the map, in no particular order.
+ * @param[in]	map		The map.
+ * @param[in]	per_value	Callback function that will be called with each value and `ctx`.
+ * @param[in]	ctx		Passed through to `per_value`.
+ */
+void _sym_map_each(const struct _sym_map *map, void (*per_value)(const void *value, void *ctx), void *ctx);
+
+/**
+ * Frees everything in the map and leaves it empty. Doesn't free the map
+ * itself, since it usually lives inside something else.
+ * @param[in]	map		The map.
+ * @param[in]	per_value_cleanup	Optional callback function that will be called on each value.
+ */
+void _sym_map_clear(struct _sym_map *map, void (*per_value_cleanup)(void *data));
+
+/** Keys up to this long are kept in the table instead of being copied out. */
+#define STR_MAP_INLINE_KEY 16
+
+/**
+ * @brief	One slot in a `_str_map`.
+ */
+struct _str_map_entry {
+	uint32_t hash; /**	The key's hash. 0 if the slot is empty, 1 if it was deleted. */
+	uint32_t klen; /**	The length of the key. */
+	union {
+		char bytes[STR_MAP_INLINE_KEY]; /**	Short keys live right here. */
+		char *ptr; /**	Longer ones get a copy of their own. */
+	} key; /**	A copy of the key. Not NUL-terminated. */
+};
+
+/**
+ * @brief A map keyed by strings, like the tree above, but it's an
+ * open-addressed hash table with linear probing. Each slot keeps the key's
+ * hash, so probing only looks at a key when the hashes match, and growing
+ * never rehashes anything. Values are stored inline like `_sym_map`, and a
+ * zeroed `struct _str_map` is an empty map.
+ */
+struct _str_map {
+	struct _str_map_entry *entries; /**	`capacity` slots. */
+	unsigned char *values; /**	`capacity` values, `vsize` bytes apiece. */
+	size_t vsize; /**	The size of each value. Set by the first insert. */
+	size_t capacity; /**	How many slots there are. Always a power of two. */
+	size_t count; /**	How many keys are in the map. */
+	size_t used; /**	How many slots aren't empty, deleted ones included. */
+};
+
+/**
+ * Inserts copies of `key` and `value`. Every value in a map has to be the
+ * same size.
+ * Returns 0 on success, 1 if the key is already in the map.
+ * @param[in]	map		The map to insert into.
+ * @param[in]	key		The key. Doesn't need to be NUL-terminated.
+ * @param[in]	klen	The length of the key, in bytes.
+ * @param[in]	value	The data you want to insert.
+ * @param[in]	vsize	The size of the value you want to insert.
+ */
+int _str_map_insert(struct _str_map *map, const char *key, const size_t klen, const void *value, const size_t vsize);
+
+/**
+ * Gets something out of the map. The pointer is only good until the next
+ * insert.
+ * Returns NULL on failure.
+ */
+void *_str_map_get(const struct _str_map *map, const char *key, const size_t klen);
+
+/**
+ * Deletes something out of the map.
+ * Returns 0 on successful deletion.
+ */
+int _str_map_delete(struct _str_map *map, const char *key, const size_t klen);
+
+/**
+ * Calls `per_value` on every value in the map, in no particular order.
+ * @param[in]	map		The map.
+ * @param[in]	per_value	Callback function that will be called with each value and `ctx`.
+ * @param[in]	ctx		Passed through to `per_value`.
+ */
+void _str_map_each(const struct _str_map *map, void (*per_value)(const void *value, void *ctx), void *ctx);
+
+/**
+ * Frees everything in the map and leaves it empty. Doesn't free the map
+ * itself.
+ * @param[in]	map		The map.
+ * @param[in]	per_value_cleanup	Optional callback function that will be called on each value.
+ */
+void _str_map_clear(struct _str_map *map, void (*per_value_cleanup)(void *data));
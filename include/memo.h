@@ -0,0 +1,130 @@
+// vim: noet ts=4 sw=4
+#pragma once
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "value.h"
+
+/**
+ * @file
+ * Remembers what pure Den functions returned, so calling one again with the
+ * same arguments doesn't run it again. A function is pure if nothing it calls,
+ * or anything they call, can do I/O, and it never calls a function it only
+ * finds out about at runtime. That's worked out from the program's code before
+ * it runs.
+ *
+ * Only calls whose arguments are all numbers or booleans are remembered, since
+ * those are the only values that are equal exactly when their words are. The
+ * table holds a fixed number of results and forgets the one used least
+ * recently when it needs room.
+ *
+ * When it's off, `r->memo` is NULL and the VM skips all of this.
+ */
+
+/* Forward declarations. */
+struct _lair_program;
+struct _lair_runtime;
+
+/** Functions that take more arguments than this aren't memoized. */
+#define LR_MEMO_MAX_ARGS 4
+
+/** How many results to keep if nobody says otherwise. */
+#define LR_MEMO_DEFAULT_SIZE 65536
+
+/**
+ * @brief	A call: which function, and what it was called with.
+ */
+struct _lair_memo_key {
+	uint64_t hash; /**	A hash of the rest. */
+	uint32_t proto; /**	The function's prototype. */
+	_lair_val args[LR_MEMO_MAX_ARGS]; /**	Its arguments. Unused ones are LR_NIL. */
+};
+
+/**
+ * @brief	A call and what it returned.
+ */
+struct _lair_memo_entry {
+	struct _lair_memo_key key; /**	The call. */
+	_lair_val result; /**	What it returned. The garbage collector treats this as a root. */
+	uint32_t next; /**	The next entry in the same bucket. 0 if there isn't one. */
+	uint32_t newer; /**	The entry used next most recently. 0 if this is the newest. */
+	uint32_t older; /**	The entry used next least recently. 0 if this is the oldest. */
+};
+
+/**
+ * @brief	What `_lair_memo_call` found.
+ */
+typedef enum {
+	LR_MEMO_SKIP, /**	The call can't be remembered. Make it as usual. */
+	LR_MEMO_HIT, /**	It's been made before, and here's what it returned. */
+	LR_MEMO_MISS /**	It hasn't. Make it, and hand the result to `_lair_memo_return`. */
+} LAIR_MEMO_RESULT;
+
+/**
+ * @brief	The memo table for one run of a program.
+ */
+struct _lair_memo {
+	unsigned char *memoizable; /**	0 for each prototype whose calls can't be remembered, or one more than the number of arguments it takes. */
+	size_t nprotos; /**	How many prototypes there are. */
+	struct _lair_memo_entry *entries; /**	The results. Entry 0 is never used, so 0 can mean none. */
+	size_t nentries; /**	How many entries are in use, counting entry 0. */
+	size_t capacity; /**	How many entries there's room for now. */
+	size_t size; /**	The most entries there can be, counting entry 0. */
+	uint32_t *buckets; /**	The first entry with each hash. */
+	size_t mask; /**	The number of buckets, minus one. */
+	uint32_t newest; /**	The entry used most recently. */
+	uint32_t oldest; /**	The entry used least recently, which is the next to go. */
+	struct _lair_memo_key *pending; /**	Calls in progress that missed, innermost last. */
+	size_t npending; /**	How many there are. */
+	size_t pending_size; /**	How many there's room for. */
+	size_t hits; /**	Calls that were found. */
+	size_t misses; /**	Calls that weren't. */
+	size_t evictions; /**	Results forgotten to make room. */
+};
+
+/**
+ * Works out which functions in a program can be memoized, and makes a table
+ * for them.
+ * @param[in]	r		The current Lair runtime.
+ * @param[in]	program	The program that's about to run.
+ * @param[in]	size	How many results to keep. 0 for the default.
+ */
+struct _lair_memo *_lair_memo_new(struct _lair_runtime *r, const struct _lair_program *program, const size_t size);
+
+/**
+ * Looks up a call to a memoizable function.
+ *
+ * On a miss the call is added to the pending ones if `remember` is set, and
+ * `memo->npending` says where it went; give that to `_lair_memo_return` along
+ * with the result. A tail call from a call that's already pending doesn't
+ * need remembering, since what it returns is what the pending call returns.
+ * @param[in]	r			The current Lair runtime.
+ * @param[in]	memo		The memo table.
+ * @param[in]	proto		The function's prototype.
+ * @param[in]	args		Its arguments.
+ * @param[out]	result		Where to put the result on a hit.
+ * @param[in]	remember	Set to remember the call on a miss.
+ */
+LAIR_MEMO_RESULT _lair_memo_call(
+		struct _lair_runtime *r,
+		struct _lair_memo *memo,
+		const size_t proto,
+		const _lair_val *args,
+		_lair_val *result,
+		const int remember);
+
+/**
+ * Notes what a pending call returned. It and every call pending after it are
+ * done.
+ * @param[in]	r		The current Lair runtime.
+ * @param[in]	memo	The memo table.
+ * @param[in]	pending	Where the call is in the pending ones, as `memo->npending` said.
+ * @param[in]	result	What it returned.
+ */
+void _lair_memo_return(struct _lair_runtime *r, struct _lair_memo *memo, const size_t pending, const _lair_val result);
+
+/**
+ * Frees a memo table.
+ * @param[in]	memo	The memo table to free.
+ */
+void _lair_memo_free(struct _lair_memo *memo);
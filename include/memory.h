@@ -0,0 +1,156 @@
+// vim: noet ts=4 sw=4
+#pragma once
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "parse.h"
+
+/**
+ * @file
+ * Keeps track of where the runtime's memory goes. Every allocator in the
+ * runtime (the arena, the VM's stacks, the compiled program and the garbage
+ * collector) tells this what it allocated and freed, and what it was for.
+ * Values made by the garbage collector are also charged to the Den function
+ * that was running when they were made.
+ *
+ * It's only a few additions per allocation, so it's always on. The report can
+ * be written out while the program's running, from a signal handler, so it
+ * doesn't allocate or use stdio.
+ */
+
+/* Forward declarations. */
+struct _lair_program;
+struct _lair_runtime;
+
+/** Values that weren't made by any function in particular. */
+#define LR_NO_SITE UINT32_MAX
+
+/**
+ * @brief	What some memory is for.
+ */
+typedef enum {
+	LR_MEM_ARENA, /**	Tokens and the AST. */
+	LR_MEM_PROGRAM, /**	The compiled program: its code, constants and prototypes. */
+	LR_MEM_VM, /**	The VM's registers, call stack, constants and globals, and values C code is holding on to. */
+	LR_MEM_NUMBERS, /**	Numbers too big to fit in a value. */
+	LR_MEM_STRINGS, /**	Strings made at runtime. */
+	LR_MEM_ROPES, /**	Strings that haven't been flattened yet. */
+	LR_MEM_VECTORS, /**	Vector headers. */
+	LR_MEM_MAPS, /**	Map headers. */
+	LR_MEM_NODES, /**	The insides of vectors and maps. */
+	LR_MEM_OTHER, /**	Any other value. */
+	LR_MEM_MEMO, /**	Remembered results of pure functions. */
+	LR_MEM_MAX /**	Not a category. The number of categories. */
+} LAIR_MEM_CATEGORY;
+
+/**
+ * @brief	Everything we know about where the memory went.
+ */
+struct _lair_memory {
+	size_t live[LR_MEM_MAX]; /**	Bytes in use now, per category. */
+	size_t peak[LR_MEM_MAX]; /**	The most bytes that were ever in use at once, per category. */
+	size_t total[LR_MEM_MAX]; /**	Bytes ever allocated, per category. */
+	size_t count[LR_MEM_MAX]; /**	Allocations ever made, per category. */
+	size_t live_total; /**	Bytes in use now, over all categories. */
+	size_t peak_total; /**	The most bytes that were ever in use at once, over all categories. */
+
+	const char **site_names; /**	The name of every function in the program, indexed by prototype. */
+	size_t *site_live; /**	Bytes of values each function made that are still around. */
+	size_t *site_total; /**	Bytes of values each function ever made. */
+	size_t nsites; /**	How many functions there are. */
+};
+
+/**
+ * Starts keeping track.
+ */
+struct _lair_memory *_lair_memory_new();
+
+/**
+ * Sets up the per-function counts for a program that's about to run.
+ * @param[in]	r		The current Lair runtime.
+ * @param[in]	program	The program.
+ */
+void _lair_memory_sites(struct _lair_runtime *r, const struct _lair_program *program);
+
+/**
+ * Notes that some memory was allocated.
+ * @param[in]	m		Where to note it.
+ * @param[in]	cat		What it's for.
+ * @param[in]	bytes	How much there was.
+ */
+static inline void _lair_mem_alloc(struct _lair_memory *m, const LAIR_MEM_CATEGORY cat, const size_t bytes) {
+	m->count[cat]++;
+	m->total[cat] += bytes;
+	m->live[cat] += bytes;
+	if (m->live[cat] > m->peak[cat])
+		m->peak[cat] = m->live[cat];
+	m->live_total += bytes;
+	if (m->live_total > m->peak_total)
+		m->peak_total = m->live_total;
+}
+
+/**
+ * Notes that some memory was freed.
+ * @param[in]	m		Where to note it.
+ * @param[in]	cat		What it was for.
+ * @param[in]	bytes	How much there was.
+ */
+static inline void _lair_mem_free(struct _lair_memory *m, const LAIR_MEM_CATEGORY cat, const size_t bytes) {
+	m->live[cat] -= bytes;
+	m->live_total -= bytes;
+}
+
+/**
+ * Adds what another runtime allocated to this one's, for when this one takes
+ * over its memory. Both have to be running the same program.
+ * @param[in]	m		Where to add it.
+ * @param[in]	from	What to add.
+ */
+void _lair_memory_adopt(struct _lair_memory *m, const struct _lair_memory *from);
+
+/**
+ * Which category a value of some type belongs to.
+ * @param[in]	type	The type of the value.
+ */
+static inline LAIR_MEM_CATEGORY _lair_mem_category_of(const LAIR_TOKEN type) {
+	switch (type) {
+		case LR_NUM:	return LR_MEM_NUMBERS;
+		case LR_STRING:	return LR_MEM_STRINGS;
+		case LR_ROPE:	return LR_MEM_ROPES;
+		case LR_VECTOR:	return LR_MEM_VECTORS;
+		case LR_MAP:	return LR_MEM_MAPS;
+		case LR_NODE:	return LR_MEM_NODES;
+		default:		return LR_MEM_OTHER;
+	}
+}
+
+/**
+ * Writes out where the memory went: live, peak and total bytes per category,
+ * then the bytes of values each function made. Safe to call from a signal
+ * handler.
+ * @param[in]	m		What to write out.
+ * @param[in]	fd		The file descriptor to write it to.
+ */
+void _lair_memory_report(const struct _lair_memory *m, const int fd);
+
+/**
+ * Writes a report to STDERR whenever the process gets `SIGUSR1`, for as long
+ * as the runtime's around. Only one runtime can be watched at a time: the
+ * first one to ask gets it, and the rest go without. The report only comes
+ * out if the signal lands on the thread running that runtime, which it always
+ * does for the command line.
+ * @param[in]	r		The current Lair runtime.
+ */
+void _lair_memory_watch(struct _lair_runtime *r);
+
+/**
+ * Stops writing reports for a runtime on `SIGUSR1`.
+ * @param[in]	r		The runtime.
+ */
+void _lair_memory_unwatch(struct _lair_runtime *r);
+
+/**
+ * Frees everything the memory tracking uses.
+ * @param[in]	m		The thing to free.
+ */
+void _lair_memory_free(struct _lair_memory *m);
@@ -0,0 +1,150 @@
+// vim: noet ts=4 sw=4
+#pragma once
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "value.h"
+
+/**
+ * @file
+ * Runs calls to pure Den functions on other threads. When a call's arguments
+ * include more than one call to a Den function, the compiler marks all but the
+ * last of those with `OP_FORKK`, and joins them with `OP_JOIN` right before
+ * the call. If the callee is safe to run somewhere else, the VM hands the call
+ * to a pool of worker threads and gets on with the rest of the arguments.
+ *
+ * A function is safe to run somewhere else if it's pure (see memo.h) and
+ * nothing it calls reads a global, since the globals belong to the runtime
+ * that's running the program. Only calls whose arguments are all numbers or
+ * booleans are forked, so nothing on either side looks at the other's values.
+ *
+ * Each forked call runs in a runtime of its own, with its own VM and heap but
+ * the same program and symbols. Whoever joins it takes everything its heap
+ * holds into their own, so the result can be used as is, and the collector
+ * sweeps up the rest later.
+ *
+ * Calls that have been finishing too quickly to be worth the trouble stay
+ * where they are, and so does everything once there's already more work
+ * waiting than there are workers to do it.
+ *
+ * The workers are shared by every runtime in the process, and once started
+ * they stay around. A thread that's waiting on a call that's still queued runs
+ * it itself, and one that's waiting on a call somebody else is running helps
+ * with whatever else is queued in the meantime.
+ *
+ * `pmap` and `preduce` hand out work explicitly instead. Their items are split
+ * into runs, a few for each thread, and each run is a task that calls the
+ * function on every item in it in a runtime of its own. The same rules about
+ * what's safe apply, and anything that isn't runs on the calling thread.
+ *
+ * When it's off, `r->parallel` is NULL, `OP_FORKK` is just `OP_CALLK`, and
+ * `pmap` and `preduce` do everything themselves.
+ */
+
+/* Forward declarations. */
+struct _lair_program;
+struct _lair_runtime;
+struct _lair_task;
+
+/** The most worker threads there can be. */
+#define LR_MAX_WORKERS 64
+
+/** Calls that take less than this many microseconds on average aren't forked, unless somebody says otherwise. */
+#define LR_PARALLEL_DEFAULT_COST 100
+
+/**
+ * @brief	What's known about running one program in parallel.
+ * Shared by the runtime running the program and every one running its forks.
+ */
+struct _lair_parallel {
+	const struct _lair_program *program; /**	The program. */
+	unsigned char *safe; /**	Set for each prototype whose calls can run on another thread. */
+	_Atomic uint64_t *cost; /**	How long calls to each prototype have been taking, in nanoseconds. 0 if we don't know yet. */
+	uint64_t threshold; /**	Calls that take less than this many nanoseconds stay inline. */
+	size_t workers; /**	How many other threads can be running forks at once. */
+	atomic_size_t outstanding; /**	Forks that haven't been joined yet. */
+	atomic_size_t forks; /**	Calls that have been forked, and runs of items maps and reduces have handed out. */
+};
+
+/**
+ * @brief	A forked call a frame hasn't joined yet.
+ */
+struct _lair_fork {
+	size_t reg; /**	Where the result goes, from the bottom of the register stack. */
+	struct _lair_task *task; /**	The call. */
+};
+
+/**
+ * Works out which functions in a program can run on other threads, and makes
+ * sure there are workers to run them on.
+ * @param[in]	r		The current Lair runtime.
+ * @param[in]	program	The program that's about to run.
+ * @param[in]	threads	How many threads to use, counting the one running the program.
+ * @param[in]	cost	Calls that take less than this many microseconds stay inline. 0 for the default.
+ */
+struct _lair_parallel *_lair_parallel_new(
+		struct _lair_runtime *r,
+		const struct _lair_program *program,
+		const int threads,
+		const size_t cost);
+
+/**
+ * Forks a call, if it's worth it.
+ * @param[in]	r			The current Lair runtime.
+ * @param[in]	parallel	What's known about the program.
+ * @param[in]	proto		The function's prototype.
+ * @param[in]	args		Its arguments. They're copied.
+ * @return	The call, or NULL if it should be made inline instead.
+ */
+struct _lair_task *_lair_fork(
+		struct _lair_runtime *r,
+		struct _lair_parallel *parallel,
+		const size_t proto,
+		const _lair_val *args);
+
+/**
+ * Waits for some forked calls and puts their results in registers. Every one
+ * of them is done with afterwards, even if one failed, in which case the first
+ * one that did has its error thrown.
+ * @param[in]	r		The current Lair runtime.
+ * @param[in]	forks	The calls, in the order they were forked.
+ * @param[in]	nforks	How many there are.
+ * @param[out]	regs	The register stack `reg` in each is counted from.
+ */
+void _lair_join(struct _lair_runtime *r, const struct _lair_fork *forks, const size_t nforks, _lair_val *regs);
+
+/**
+ * Calls a function on each of some items, on as many threads as it can.
+ * @param[in]	r		The current Lair runtime.
+ * @param[in]	f		The function. It takes one argument.
+ * @param[in]	things	A vector, or a number n for the numbers from 0 up to n.
+ * @return	A vector of what each call returned, in the same order as the items.
+ */
+_lair_val _lair_parallel_map(struct _lair_runtime *r, const _lair_val f, const _lair_val things);
+
+/**
+ * Combines some items with a function, on as many threads as it can. Runs of
+ * items get combined on their own and then with each other, so the function
+ * has to be associative to get the same answer as it would going in order.
+ * @param[in]	r		The current Lair runtime.
+ * @param[in]	f		The function. It takes what's been combined so far and the next item.
+ * @param[in]	init	What to start from.
+ * @param[in]	things	A vector, or a number n for the numbers from 0 up to n.
+ * @return	What it all came to. `init` if there weren't any items.
+ */
+_lair_val _lair_parallel_reduce(struct _lair_runtime *r, const _lair_val f, const _lair_val init, const _lair_val things);
+
+/**
+ * Waits for a forked call and throws its result away, for when the runtime
+ * that forked it is going away.
+ * @param[in]	task	The call.
+ */
+void _lair_fork_drop(struct _lair_task *task);
+
+/**
+ * Frees what's known about running a program in parallel. Every fork has to
+ * have been joined or dropped already.
+ * @param[in]	parallel	The thing to free.
+ */
+void _lair_parallel_free(struct _lair_parallel *parallel);
@@ -6,7 +6,13 @@
  * confusion.
  */
 
+#include "symbol.h"
+
+struct _lair_map;
+struct _lair_node;
+struct _lair_rope;
 struct _lair_runtime;
+struct _lair_vector;
 
 /**
  * @brief	Token types use when parsing.
@@ -28,24 +34,22 @@ typedef enum {
 	LR_IF, /**	The '?' operator. If, basically. */
 	LR_BOOL, /**	A boolean. */
 	LR_ATOM, /**	Atomic symbol. Reference to either a variable or a function. */
-	LR_NUM /**	A number. */
+	LR_NUM, /**	A number. */
+	LR_ROPE, /**	A string made by gluing two others together. Only exists at runtime. */
+	LR_VECTOR, /**	A persistent vector. Only exists at runtime. */
+	LR_MAP, /**	A persistent hash map. Only exists at runtime. */
+	LR_NODE /**	Part of a vector or map. Never seen by programs. */
 } LAIR_TOKEN;
 
-/**
- * @brief	Simple string type.
- */
-struct _str {
-	const size_t size; /**	The size of the string, in bytes. */
-	const char *data; /**	The actual string content. */
-};
-
 /**
  * @brief	This is a representation of a token use for parsing into the AST later.
  */
 struct _lair_token {
-	char *token_str; /**	The string representation of the token. Is probably NUL-terminated. */
+	const char *token_str; /**	Where the token starts in the program. Not NUL-terminated. */
+	size_t token_len; /**	The length of the token, in bytes. */
 	LAIR_TOKEN token_type; /**	The enumerated token's type. */
 	unsigned int indent_level; /**	The indent level for this piece of code. */
+	_lair_sym sym; /**	The interned name, if the token is an identifier. `token_str` is then the symbol's name. */
 	struct _lair_token *next; /**	Link to the next token in the list. */
 	struct _lair_token *prev; /**	Pointer to the previous token in the list. */
 };
@@ -57,6 +61,10 @@ typedef union _lair_value {
 	unsigned char bool; /**	Boolean value. */
 	int num; /**	If this type is an integer, this will be the integer value. */
 	char *str; /**	Like `num`, but this will hold a string instead. */
+	struct _lair_rope *rope; /**	The halves of an `LR_ROPE`. */
+	struct _lair_vector *vector; /**	The trie behind an `LR_VECTOR`. */
+	struct _lair_map *map; /**	The trie behind an `LR_MAP`. */
+	struct _lair_node *node; /**	The slots of an `LR_NODE`. */
 } _lair_value;
 
 /**
@@ -64,6 +72,9 @@ typedef union _lair_value {
  */
 struct _lair_type {
 	LAIR_TOKEN type; /**	This lets us know what kind of type the value is. Number, string, etc. */
+	unsigned char managed; /**	Set if the garbage collector owns this value. */
+	_lair_sym sym; /**	The interned name, for identifiers and function references. `value.str` is then the symbol's name. */
+	int proto; /**	For function references, the index of the prototype being referred to. -1 if there isn't one. */
 	_lair_value value; /**	The actual value. */
 };
 
@@ -87,7 +98,9 @@ struct _lair_ast {
 char *_friendly_enum(const LAIR_TOKEN val);
 
 /**
- * Parses a raw program (string) into tokens.
+ * Parses a raw program (string) into tokens. The tokens live in the runtime's
+ * arena and point into `program`, which has to outlive them. Identifiers point
+ * at their interned name instead.
  * @param[in]	runtime	The runtime state of the program.
  * @param[in]	program	The program to be parsed.
  * @param[in]	len	The length of the program, in bytes.
@@ -102,13 +115,8 @@ struct _lair_token *_lair_tokenize(struct _lair_runtime *runtime, const char *pr
 void lair_print_tokens(const struct _lair_token *tokens);
 
 /**
- * Frees the tokens generated by `_lair_tokenize`.
- * @param[in]	tokens	The tokens generated by `_lair_tokenize`.
- */
-void _lair_free_tokens(struct _lair_token *tokens);
-
-/**
- * Takes a list of tokens and turns it into an AST.
+ * Takes a list of tokens and turns it into an AST. The AST lives in the
+ * runtime's arena, same as the tokens.
  * @param[in]	r	The current lair runtime.
  * @param[in]	tokens	The list of tokens to manipulate.
  */
@@ -120,15 +128,13 @@ struct _lair_ast *_lair_parse_from_tokens(
  * Figures out what a token is based on what it looks like.
  * @param[in]	r	The current lair runtime.
  * @param[in]	new_token	The token to work on.
- * @param[in]	stripped	The raw C string representing the token.
  */
-void _intuit_token_type(
-		struct _lair_runtime *r,
-		struct _lair_token *new_token,
-		const char *stripped);
+void _intuit_token_type(struct _lair_runtime *r, struct _lair_token *new_token);
 
 /**
- * Fills out remaining token information.
+ * Fills out remaining token information. Any string the atom needs is
+ * allocated in the runtime's arena.
+ * @param[in]	r	The current lair runtime.
  * @param[in]	token	The token to analyze.
  */
-struct _lair_type _lair_atomize_token(const struct _lair_token *token);
+struct _lair_type _lair_atomize_token(struct _lair_runtime *r, const struct _lair_token *token);
@@ -0,0 +1,147 @@
+// vim: noet ts=4 sw=4
+#pragma once
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/**
+ * @file
+ * A profiler that counts every call. When it's on, the VM tells it whenever a
+ * function (Den or builtin) starts or finishes, and it keeps a stack of its
+ * own to work out how much time and how many allocations belong to each
+ * function by itself, and to each one with everything it called.
+ *
+ * A tail call finishes the caller and starts the callee, same as the VM sees
+ * it. Time spent in a recursive function only counts once towards its total.
+ *
+ * It can also just sample instead. Then the stack is all it keeps, and a
+ * `SIGPROF` timer copies it every so often. The report is the stacks it saw
+ * and how many times it saw each, folded the way flamegraph tools want them.
+ * That costs a lot less than timing every call, so the numbers are closer to
+ * what the program does when nobody's looking.
+ *
+ * When it's off, `r->profile` is NULL and the VM skips all of this.
+ */
+
+/* Forward declarations. */
+struct _lair_program;
+struct _lair_runtime;
+
+/**
+ * @brief	Everything we know about one function.
+ */
+struct _lair_profile_entry {
+	const char *name; /**	The function's name. Belongs to the symbol table. */
+	unsigned char builtin; /**	Set if this is a builtin. */
+	size_t calls; /**	How many times it's been called. */
+	size_t active; /**	How many calls to it haven't finished yet. */
+	uint64_t total_ns; /**	Time spent in it and everything it called. */
+	uint64_t self_ns; /**	Time spent in it and nothing else. */
+	size_t allocs; /**	Values it allocated itself. */
+	size_t alloc_bytes; /**	Bytes it allocated itself. */
+};
+
+/**
+ * @brief	A call that hasn't finished.
+ */
+struct _lair_profile_frame {
+	size_t entry; /**	Which function this is. */
+	uint64_t start; /**	When it started. */
+	uint64_t child_ns; /**	Time spent in the calls it's made. */
+	size_t start_allocs; /**	How many values had been allocated when it started. */
+	size_t start_bytes; /**	Likewise for bytes. */
+	size_t child_allocs; /**	Values allocated by the calls it's made. */
+	size_t child_bytes; /**	Likewise for bytes. */
+};
+
+/**
+ * @brief	A stack the sampler has seen, as a node in a tree of them. Its
+ * parent is the stack with the innermost call taken off.
+ */
+struct _lair_profile_node {
+	uint32_t entry; /**	The innermost function. */
+	uint32_t parent; /**	The node for the stack it was called from. 0 is the empty stack. */
+	uint32_t child; /**	The first stack called from this one. 0 if there aren't any. */
+	uint32_t sibling; /**	The next stack with the same parent. 0 if there aren't any. */
+	size_t count; /**	How many samples caught exactly this stack. */
+};
+
+/**
+ * @brief	A profile of one run of a program.
+ */
+struct _lair_profile {
+	struct _lair_profile_entry *entries; /**	One per prototype in the program, indexed the same. */
+	size_t nentries; /**	How many entries there are. */
+	struct _lair_profile_frame *stack; /**	Calls in progress, innermost last. */
+	volatile size_t depth; /**	How many calls are in progress. The sampler reads this. */
+	size_t stack_size; /**	How many frames `stack` has room for. */
+
+	int sampling; /**	Set if we're sampling rather than timing every call. */
+	volatile sig_atomic_t moving; /**	Set while `stack` is being reallocated, so the sampler stays away from it. */
+	uint32_t *samples; /**	Stacks the sampler has taken and we haven't added up yet: a depth, then that many entries. */
+	volatile size_t nsamples; /**	How much of `samples` is used. */
+	size_t samples_size; /**	How much room `samples` has. */
+	volatile size_t dropped; /**	Samples there wasn't room for. */
+	struct _lair_profile_node *nodes; /**	Every stack the sampler has seen. */
+	size_t nnodes; /**	How many nodes there are. */
+	size_t nodes_size; /**	How many nodes there's room for. */
+};
+
+/**
+ * Starts a profile of a program that's about to run.
+ * @param[in]	r		The current Lair runtime.
+ * @param[in]	program	The program.
+ */
+struct _lair_profile *_lair_profile_new(struct _lair_runtime *r, const struct _lair_program *program);
+
+/**
+ * Starts sampling a program that's about to run. Only one of these can run at
+ * a time, since the timer belongs to the whole process.
+ * @param[in]	r		The current Lair runtime.
+ * @param[in]	program	The program.
+ * @param[in]	hz		How many samples to take per second of CPU time.
+ */
+struct _lair_profile *_lair_profile_new_sampler(struct _lair_runtime *r, const struct _lair_program *program, const int hz);
+
+/**
+ * Notes that a function has been called.
+ * @param[in]	r		The current Lair runtime.
+ * @param[in]	profile	The profile.
+ * @param[in]	entry	The index of the function's prototype.
+ */
+void _lair_profile_enter(struct _lair_runtime *r, struct _lair_profile *profile, const size_t entry);
+
+/**
+ * Notes that the innermost call in progress has finished.
+ * @param[in]	r		The current Lair runtime.
+ * @param[in]	profile	The profile.
+ */
+void _lair_profile_exit(struct _lair_runtime *r, struct _lair_profile *profile);
+
+/**
+ * Notes that the innermost call in progress has been replaced by another, the
+ * way a tail call does.
+ * @param[in]	r		The current Lair runtime.
+ * @param[in]	profile	The profile.
+ * @param[in]	entry	The index of the new function's prototype.
+ */
+void _lair_profile_replace(struct _lair_runtime *r, struct _lair_profile *profile, const size_t entry);
+
+/**
+ * Finishes any calls still in progress (if the program died in the middle of
+ * them) and writes the profile out, as a table sorted by self time or as JSON.
+ * A sampler stops sampling and writes its folded stacks instead, one per line,
+ * like `main;fib;fib 42`.
+ * @param[in]	r		The current Lair runtime.
+ * @param[in]	profile	The profile.
+ * @param[in]	out		Where to write it.
+ * @param[in]	json	Write JSON instead of a table. Samplers ignore this.
+ */
+void _lair_profile_report(struct _lair_runtime *r, struct _lair_profile *profile, FILE *out, const int json);
+
+/**
+ * Frees a profile, stopping the sampler if it's still going.
+ * @param[in]	profile	The profile to free.
+ */
+void _lair_profile_free(struct _lair_profile *profile);
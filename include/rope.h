@@ -0,0 +1,57 @@
+// vim: noet ts=4 sw=4
+#pragma once
+#include <stdlib.h>
+
+#include "value.h"
+
+/**
+ * @file
+ * Strings built with `+`. Gluing two long strings together makes a rope: a
+ * node that points at both halves instead of copying them, so building a
+ * string a piece at a time takes linear time instead of quadratic. The bytes
+ * only get copied into one place when something needs them all at once, and
+ * that copy is kept around for next time.
+ *
+ * Ropes are `LR_ROPE` values, but `_lair_type_of` calls them `LR_STRING`, so
+ * nothing outside of here has to care which kind of string it has.
+ */
+
+/* Forward declarations. */
+struct _lair_runtime;
+
+/** Strings shorter than this get copied when they're glued together. */
+#define LAIR_ROPE_MIN 64
+
+/**
+ * @brief	Two strings, one after the other.
+ */
+struct _lair_rope {
+	_lair_val left; /**	The first half. LR_NIL once the rope has been flattened. */
+	_lair_val right; /**	The second half. LR_NIL once the rope has been flattened. */
+	_lair_val flat; /**	The whole thing in one piece, once somebody has asked for it. */
+	size_t len; /**	The length of the whole thing, in bytes. */
+};
+
+/**
+ * Glues two strings together. Might allocate, so both have to be reachable
+ * from the VM.
+ * @param[in]	r	The current Lair runtime.
+ * @param[in]	a	The first string.
+ * @param[in]	b	The second string.
+ */
+_lair_val _lair_string_concat(struct _lair_runtime *r, const _lair_val a, const _lair_val b);
+
+/**
+ * The length of a string, in bytes. Free for ropes.
+ * @param[in]	v	A string, rope or not.
+ */
+size_t _lair_string_len(const _lair_val v);
+
+/**
+ * The bytes of a string, in one piece and NUL-terminated. Ropes get flattened
+ * the first time this is called on them, which allocates, so `v` has to be
+ * reachable from the VM.
+ * @param[in]	r	The current Lair runtime.
+ * @param[in]	v	A string, rope or not.
+ */
+const char *_lair_string_bytes(struct _lair_runtime *r, const _lair_val v);
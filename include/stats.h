@@ -0,0 +1,46 @@
+// vim: noet ts=4 sw=4
+#pragma once
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "compile.h"
+
+/**
+ * @file
+ * Counters for what the interpreter spends its time doing: which instructions
+ * it runs, and how much the collector, the arena and the symbol table end up
+ * holding. The counting happens only when `r->stats` is set. The VM switches
+ * to a dispatch table that counts before each instruction, so a run without
+ * stats runs exactly the same instructions as before.
+ */
+
+/* Forward declarations. */
+struct _lair_runtime;
+
+/**
+ * @brief	Counts for one run of a program.
+ */
+struct _lair_stats {
+	size_t ops[OP_MAX]; /**	How many times each instruction was run. */
+};
+
+/**
+ * Starts counting.
+ * @param[in]	r		The current Lair runtime.
+ */
+struct _lair_stats *_lair_stats_new(struct _lair_runtime *r);
+
+/**
+ * Writes the counts out, along with what the runtime's allocators are
+ * holding now.
+ * @param[in]	r		The current Lair runtime.
+ * @param[in]	stats	The counts.
+ * @param[in]	out		Where to write them.
+ */
+void _lair_stats_report(struct _lair_runtime *r, const struct _lair_stats *stats, FILE *out);
+
+/**
+ * Frees the counts.
+ * @param[in]	stats	The counts to free.
+ */
+void _lair_stats_free(struct _lair_stats *stats);
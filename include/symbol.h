@@ -0,0 +1,64 @@
+// vim: noet ts=4 sw=4
+#pragma once
+#include <stdlib.h>
+
+/**
+ * @file
+ * Symbol interning. Every identifier in a program is turned into a small
+ * integer when it's tokenized, so comparing names is comparing numbers and
+ * each distinct name is only stored once.
+ */
+
+/* Forward declarations. */
+struct _lair_runtime;
+struct _str_map;
+struct vector;
+
+/**
+ * @brief	An interned identifier. Dense, starting at 1.
+ */
+typedef unsigned int _lair_sym;
+
+/** Not a symbol. Strings and numbers have this. */
+#define LR_NO_SYM ((_lair_sym)0)
+
+/**
+ * @brief	The interning table. One per runtime.
+ */
+struct _lair_symbols {
+	struct _str_map *ids; /**	map of str -> _lair_sym. */
+	struct vector *names; /**	The name of each symbol, indexed by symbol. Vector of char *. */
+};
+
+/**
+ * Creates a new, empty interning table.
+ */
+struct _lair_symbols *_lair_symbols_new();
+
+/**
+ * Finds the symbol for a name, making a new one if we haven't seen it before.
+ * @param[in]	r		The current Lair runtime.
+ * @param[in]	name	The name to intern. Doesn't need to be NUL-terminated.
+ * @param[in]	len		The length of the name, in bytes.
+ */
+_lair_sym _lair_intern(struct _lair_runtime *r, const char *name, const size_t len);
+
+/**
+ * Returns the one copy of a symbol's name. It lives as long as the runtime.
+ * @param[in]	r	The current Lair runtime.
+ * @param[in]	sym	The symbol.
+ */
+const char *_lair_symbol_name(const struct _lair_runtime *r, const _lair_sym sym);
+
+/**
+ * Returns one past the highest symbol handed out so far. Handy for sizing
+ * tables indexed by symbol.
+ * @param[in]	r	The current Lair runtime.
+ */
+size_t _lair_symbol_count(const struct _lair_runtime *r);
+
+/**
+ * Frees the table and every name in it.
+ * @param[in]	symbols	The table to free.
+ */
+void _lair_symbols_free(struct _lair_symbols *symbols);
@@ -0,0 +1,99 @@
+// vim: noet ts=4 sw=4
+#pragma once
+#include <limits.h>
+#include <stdint.h>
+
+#include "parse.h"
+
+/**
+ * @file
+ * How values are passed around at runtime. A value is one machine word:
+ * small integers and booleans live in the word itself, everything else is a
+ * pointer to a `struct _lair_type`. The low bits tell them apart:
+ *
+ *     ...xxx1    integer, shifted left by one
+ *     ...x010    false
+ *     ...x110    true
+ *     ...xx00    pointer to a boxed value (or nil, if it's zero)
+ *
+ * Boxed values are always at least 4-byte aligned, so their low bits are free.
+ */
+
+/**
+ * @brief	A tagged Lair value.
+ */
+typedef uintptr_t _lair_val;
+
+#define LR_NIL		((_lair_val)0) /**	No value. What functions return when they don't. */
+#define LR_FALSE	((_lair_val)0x2) /**	The one and only false. */
+#define LR_TRUE		((_lair_val)0x6) /**	The one and only true. */
+
+#define LR_IS_INT(V)	(((V) & 1) != 0)
+#define LR_IS_BOOL(V)	(((V) & 3) == 2)
+#define LR_IS_BOXED(V)	((V) != LR_NIL && ((V) & 3) == 0)
+
+#define LR_INT(N)		((((_lair_val)(intptr_t)(N)) << 1) | 1)
+#define LR_INT_VALUE(V)	((int)(((intptr_t)(V)) >> 1))
+#define LR_BOOL(B)		((B) ? LR_TRUE : LR_FALSE)
+#define LR_BOX(T)		((_lair_val)(T))
+#define LR_UNBOX(V)		((const struct _lair_type *)(V))
+
+/* An int fits in a tagged word whenever a pointer is wider than an int. Where
+ * it isn't, the few ints that don't fit get boxed.
+ */
+#if (INTPTR_MAX >> 1) >= INT_MAX
+#define LR_FITS_INT(N)	1
+#else
+#define LR_FITS_INT(N)	((N) >= (INTPTR_MIN >> 1) && (N) <= (INTPTR_MAX >> 1))
+#endif
+
+/**
+ * Figures out what kind of thing a value is. Nil has no type, so it comes
+ * back as `LR_ERR`.
+ * @param[in]	v	The value to look at.
+ */
+static inline LAIR_TOKEN _lair_type_of(const _lair_val v) {
+	if (LR_IS_INT(v))
+		return LR_NUM;
+	if (LR_IS_BOOL(v))
+		return LR_BOOL;
+	if (v == LR_NIL)
+		return LR_ERR;
+
+	/* Ropes are strings that just haven't been glued together yet. */
+	const LAIR_TOKEN type = LR_UNBOX(v)->type;
+	return type == LR_ROPE ? LR_STRING : type;
+}
+
+/**
+ * Gets the integer out of a number, boxed or not.
+ * @param[in]	v	A value of type `LR_NUM`.
+ */
+static inline int _lair_num_of(const _lair_val v) {
+	if (LR_IS_INT(v))
+		return LR_INT_VALUE(v);
+	return LR_UNBOX(v)->value.num;
+}
+
+/**
+ * Gets the C string out of a boxed value (strings, function names). Ropes
+ * don't have one; see `_lair_string_bytes`.
+ * @param[in]	v	A boxed value.
+ */
+static inline const char *_lair_str_of(const _lair_val v) {
+	return LR_UNBOX(v)->value.str;
+}
+
+/**
+ * Turns a `struct _lair_type`, like the ones in the constant pool, into a
+ * value. Numbers and booleans are copied into the word; anything else is
+ * pointed at, so `t` has to outlive the value.
+ * @param[in]	t	The thing to turn into a value.
+ */
+static inline _lair_val _lair_val_of(const struct _lair_type *t) {
+	if (t->type == LR_NUM && LR_FITS_INT(t->value.num))
+		return LR_INT(t->value.num);
+	if (t->type == LR_BOOL)
+		return LR_BOOL(t->value.bool);
+	return LR_BOX(t);
+}
@@ -0,0 +1,92 @@
+// vim: noet ts=4 sw=4
+#pragma once
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "value.h"
+
+/**
+ * @file
+ * The register machine that runs compiled programs.
+ */
+
+/* Forward declarations. */
+struct _lair_fork;
+struct _lair_program;
+struct _lair_proto;
+struct _lair_runtime;
+
+/**
+ * @brief	An activation record for a running function.
+ */
+struct _lair_frame {
+	const struct _lair_proto *proto; /**	The function being run. */
+	size_t pc; /**	Offset of the next instruction to run. */
+	size_t base; /**	Where this frame's registers start on the register stack. Locals come first. */
+	size_t memo; /**	Where the call is in the memo table's pending calls, plus one. 0 if it isn't there. */
+	int returns; /**	Set if the call was made from C, which gets the result when it returns. */
+};
+
+/**
+ * @brief	The evaluation state: a register stack and a frame stack.
+ */
+struct _lair_vm {
+	_lair_val *regs; /**	The register stack. */
+	size_t regs_size; /**	How many registers are allocated. */
+	struct _lair_frame *frames; /**	The frame stack. */
+	size_t frames_size; /**	How many frames are allocated. */
+	size_t depth; /**	How many frames are live. */
+	_lair_val *constants; /**	The program's constant pool, turned into values. */
+	_lair_val *globals; /**	The global slots. LR_NIL if they haven't been bound. */
+	size_t nglobals; /**	How many global slots there are. */
+	uint32_t *code; /**	The code with profiled calls and returns in it, if we're profiling. NULL otherwise. */
+	const struct _lair_proto *protos; /**	The program's prototypes. */
+	struct _lair_fork *forks; /**	Calls that were forked and haven't been joined yet, oldest first. */
+	size_t nforks; /**	How many there are. */
+	size_t forks_size; /**	How many there's room for. */
+	size_t bytes; /**	How much memory all of the above takes up. */
+};
+
+/**
+ * Makes a VM for a program, and makes it the runtime's. `_lair_vm_call` runs
+ * on it from then on, until `_lair_vm_end`.
+ * @param[in]	r		The current Lair runtime.
+ * @param[in]	program	The compiled program.
+ */
+struct _lair_vm *_lair_vm_new(struct _lair_runtime *r, const struct _lair_program *program);
+
+/**
+ * Frees the runtime's VM, once nothing is running on it.
+ * @param[in]	r		The current Lair runtime.
+ */
+void _lair_vm_end(struct _lair_runtime *r);
+
+/**
+ * Runs a program from its top-level prototype until it returns.
+ * @param[in]	r		The current Lair runtime.
+ * @param[in]	program	The compiled program.
+ */
+_lair_val _lair_vm_run(struct _lair_runtime *r, const struct _lair_program *program);
+
+/**
+ * Calls one function in a program from C, and runs it until it returns. If
+ * the runtime has a VM, the call runs on top of whatever's running on it, so
+ * builtins can call Den functions. Otherwise it gets a VM of its own for the
+ * length of the call.
+ * @param[in]	r		The current Lair runtime.
+ * @param[in]	program	The compiled program.
+ * @param[in]	proto	The function's prototype.
+ * @param[in]	args	Its arguments. There have to be as many as it takes, and they can't be in the VM's registers.
+ */
+_lair_val _lair_vm_call(
+		struct _lair_runtime *r,
+		const struct _lair_program *program,
+		const size_t proto,
+		const _lair_val *args);
+
+/**
+ * Frees a VM. Any calls it forked and didn't join get waited for and thrown
+ * away.
+ * @param[in]	vm	The VM to free.
+ */
+void _lair_vm_free(struct _lair_vm *vm);
@@ -0,0 +1,75 @@
+// vim: noet ts=4 sw=4
+#include <string.h>
+
+#include "arena.h"
+#include "error.h"
+#include "lair.h"
+#include "memory.h"
+
+/* Everything we hand out is aligned well enough for a pointer. */
+#define _align(N)		(((N) + sizeof(void *) - 1) & ~(sizeof(void *) - 1))
+#define _data_of(C)		((char *)(C) + _align(sizeof(struct _lair_arena_chunk)))
+
+struct _lair_arena *_lair_arena_new() {
+	return calloc(1, sizeof(struct _lair_arena));
+}
+
+static struct _lair_arena_chunk *_new_chunk(struct _lair_runtime *r, const size_t size) {
+	struct _lair_arena_chunk *chunk = calloc(1, _align(sizeof(struct _lair_arena_chunk)) + size);
+	check(r, chunk != NULL, ERR_RUNTIME, "Out of memory.");
+	_lair_mem_alloc(r->memory, LR_MEM_ARENA, _align(sizeof(struct _lair_arena_chunk)) + size);
+	chunk->size = size;
+	chunk->used = 0;
+	return chunk;
+}
+
+void *_lair_arena_alloc(struct _lair_runtime *r, struct _lair_arena *arena, const size_t size) {
+	const size_t needed = _align(size == 0 ? 1 : size);
+	struct _lair_arena_chunk *chunk = arena->chunks;
+
+	if (chunk == NULL || chunk->size - chunk->used < needed) {
+		if (needed > LAIR_ARENA_CHUNK_SIZE / 4) {
+			/* Big things get a chunk of their own. It goes behind the current
+			 * one so we can keep filling that.
+			 */
+			struct _lair_arena_chunk *big = _new_chunk(r, needed);
+			if (chunk == NULL) {
+				big->next = NULL;
+				arena->chunks = big;
+			} else {
+				big->next = chunk->next;
+				chunk->next = big;
+			}
+			chunk = big;
+		} else {
+			chunk = _new_chunk(r, LAIR_ARENA_CHUNK_SIZE);
+			chunk->next = arena->chunks;
+			arena->chunks = chunk;
+		}
+	}
+
+	/* Chunks are zeroed when they're allocated and never reused. */
+	void *memory = _data_of(chunk) + chunk->used;
+	chunk->used += needed;
+	arena->allocated += needed;
+	return memory;
+}
+
+char *_lair_arena_strndup(struct _lair_runtime *r, struct _lair_arena *arena, const char *str, const size_t len) {
+	char *copy = _lair_arena_alloc(r, arena, len + 1);
+	memcpy(copy, str, len);
+	return copy;
+}
+
+void _lair_arena_free(struct _lair_arena *arena) {
+	if (arena == NULL)
+		return;
+
+	struct _lair_arena_chunk *chunk = arena->chunks;
+	while (chunk != NULL) {
+		struct _lair_arena_chunk *next = chunk->next;
+		free(chunk);
+		chunk = next;
+	}
+	free(arena);
+}
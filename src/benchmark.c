@@ -0,0 +1,379 @@
+// vim: noet ts=4 sw=4
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lair.h"
+#include "vector.h"
+
+/* Runs whole Den programs over and over and reports how long they took, how
+ * much memory they needed and how much they allocated, as JSON. This is what
+ * `make bench` runs:
+ *
+ *     ./benchmark [-w warmup] [-n runs] [-t threads] [-o results.json] [program.den ...]
+ *
+ * With no programs it runs everything in `bench/`, plus a big generated
+ * program that's mostly there to be parsed. Each program gets a process of its
+ * own, so a crash only loses that program and peak RSS is its own.
+ *
+ * With `-t`, every run is that many copies of the program running at once on
+ * their own threads, each with its own runtime. If the runtimes really don't
+ * share anything, the time per run stays flat as threads go up (until they
+ * outnumber the cores).
+ */
+
+#define BENCH_WARMUP 2
+#define BENCH_RUNS 10
+/* How many functions go in the generated program. */
+#define BENCH_GENERATED_FUNCTIONS 10000
+
+/* Counting allocations means getting between the program and malloc, which
+ * needs glibc's real allocator to be reachable by name. Elsewhere the counts
+ * just come out as null.
+ */
+#ifdef __GLIBC__
+#define BENCH_COUNTS_ALLOCS 1
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static size_t _allocs = 0;
+static size_t _alloc_bytes = 0;
+
+/* Threads allocate too, so the counts have to be atomic. */
+static inline void _count_alloc(const size_t bytes) {
+	__atomic_fetch_add(&_allocs, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&_alloc_bytes, bytes, __ATOMIC_RELAXED);
+}
+
+void *malloc(size_t size) {
+	_count_alloc(size);
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+	_count_alloc(nmemb * size);
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+	_count_alloc(size);
+	return __libc_realloc(ptr, size);
+}
+#else
+#define BENCH_COUNTS_ALLOCS 0
+static size_t _allocs = 0;
+static size_t _alloc_bytes = 0;
+#endif
+
+/* What one timed run sends back to the parent. */
+struct _sample {
+	double wall_ns;
+	size_t allocs;
+	size_t alloc_bytes;
+	int rc;
+};
+
+struct _workload {
+	const char *name;
+	const char *path; /*	NULL for the generated program. */
+};
+
+/* One copy of the program, running on a thread of its own. */
+struct _copy {
+	pthread_t thread;
+	const char *program;
+	size_t len;
+	int rc;
+};
+
+static void *_run_copy(void *arg) {
+	struct _copy *copy = arg;
+	copy->rc = lair_execute(copy->program, copy->len);
+	return NULL;
+}
+
+/* Runs `threads` copies of a program at once. Returns the first non-zero rc. */
+static int _run_copies(const char *program, const size_t len, const int threads) {
+	if (threads == 1)
+		return lair_execute(program, len);
+
+	struct _copy copies[threads];
+	int started, i;
+	int rc = 0;
+	for (started = 0; started < threads; started++) {
+		copies[started] = (struct _copy){ .program = program, .len = len };
+		if (pthread_create(&copies[started].thread, NULL, _run_copy, &copies[started]) != 0) {
+			rc = 1;
+			break;
+		}
+	}
+	for (i = 0; i < started; i++) {
+		pthread_join(copies[i].thread, NULL);
+		if (rc == 0)
+			rc = copies[i].rc;
+	}
+	return rc;
+}
+
+static double _now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Lots of small functions, nearly all of which are never called. */
+static char *_generate_program(size_t *len) {
+	vector *out = vector_new(sizeof(char), 1024 * 1024);
+	char line[256];
+	int i;
+	for (i = 0; i < BENCH_GENERATED_FUNCTIONS; i++) {
+		const int n = snprintf(line, sizeof(line),
+			"generated%i a b\n  x : + a b\n  ? = x %i\n    : \"same\"\n  : ! - x b\n\n", i, i);
+		int j;
+		for (j = 0; j < n; j++)
+			vector_append(out, &line[j], sizeof(char));
+	}
+	const char *last = "println ! generated0 0 0\n";
+	for (i = 0; last[i] != '\0'; i++)
+		vector_append(out, &last[i], sizeof(char));
+
+	*len = out->count;
+	char *program = malloc(out->count);
+	memcpy(program, out->items, out->count);
+	vector_free(out);
+	return program;
+}
+
+/* Runs in the child. Writes one sample per run, warmups included, to `fd`. */
+static int _run_workload(const struct _workload *w, const int warmup, const int runs, const int threads, const int fd) {
+	/* The programs print things, and we don't want to see them. */
+	const int devnull = open("/dev/null", O_WRONLY);
+	if (devnull >= 0) {
+		fflush(stdout);
+		dup2(devnull, STDOUT_FILENO);
+		close(devnull);
+	}
+
+	size_t len = 0;
+	char *program = w->path == NULL ? _generate_program(&len) : lair_load_file(w->path, &len);
+	if (program == NULL)
+		return 1;
+
+	int i;
+	for (i = 0; i < warmup + runs; i++) {
+		struct _sample sample = {0};
+		_allocs = 0;
+		_alloc_bytes = 0;
+		const double start = _now();
+		sample.rc = _run_copies(program, len, threads);
+		sample.wall_ns = _now() - start;
+		sample.allocs = _allocs;
+		sample.alloc_bytes = _alloc_bytes;
+		fflush(stdout);
+
+		if (write(fd, &sample, sizeof(sample)) != sizeof(sample))
+			return 1;
+		if (sample.rc != 0)
+			break;
+	}
+
+	if (w->path == NULL)
+		free(program);
+	else
+		lair_unload_file(program, len);
+	return 0;
+}
+
+static int _compare_doubles(const void *a, const void *b) {
+	const double x = *(const double *)a;
+	const double y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+/* Nearest-rank percentile of sorted samples. */
+static double _percentile(const double *sorted, const size_t count, const double p) {
+	size_t rank = (size_t)(p * count + 0.999999);
+	if (rank == 0)
+		rank = 1;
+	if (rank > count)
+		rank = count;
+	return sorted[rank - 1];
+}
+
+static void _json_string(FILE *out, const char *str) {
+	fputc('"', out);
+	for (; *str != '\0'; str++) {
+		if (*str == '"' || *str == '\\')
+			fputc('\\', out);
+		fputc(*str, out);
+	}
+	fputc('"', out);
+}
+
+/* Runs one workload in a child process and writes its JSON object to `out`.
+ * Returns 0 if every run of it worked.
+ */
+static int _bench(FILE *out, const struct _workload *w, const int warmup, const int runs, const int threads) {
+	int fds[2];
+	if (pipe(fds) != 0)
+		return 1;
+
+	fflush(out);
+	const pid_t pid = fork();
+	if (pid < 0)
+		return 1;
+	if (pid == 0) {
+		close(fds[0]);
+		const int rc = _run_workload(w, warmup, runs, threads, fds[1]);
+		close(fds[1]);
+		_exit(rc);
+	}
+	close(fds[1]);
+
+	struct _sample samples[warmup + runs];
+	int got = 0;
+	while (got < warmup + runs) {
+		const ssize_t n = read(fds[0], &samples[got], sizeof(struct _sample));
+		if (n == sizeof(struct _sample)) {
+			got++;
+			continue;
+		}
+		if (n < 0 && errno == EINTR)
+			continue;
+		break;
+	}
+	close(fds[0]);
+
+	int status = 0;
+	struct rusage usage = {0};
+	wait4(pid, &status, 0, &usage);
+
+	int ok = got == warmup + runs && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+	double wall[runs > 0 ? runs : 1];
+	double total = 0;
+	int i;
+	for (i = 0; i < got; i++)
+		ok = ok && samples[i].rc == 0;
+	for (i = 0; ok && i < runs; i++) {
+		wall[i] = samples[warmup + i].wall_ns;
+		total += wall[i];
+	}
+
+	fprintf(out, "    {\n      \"name\": ");
+	_json_string(out, w->name);
+	fprintf(out, ",\n      \"ok\": %s,\n", ok ? "true" : "false");
+	fprintf(out, "      \"warmup\": %i,\n      \"runs\": %i,\n", warmup, runs);
+	if (ok && runs > 0) {
+		qsort(wall, runs, sizeof(double), _compare_doubles);
+		fprintf(out, "      \"wall_ms\": {\"min\": %.3f, \"median\": %.3f, \"p95\": %.3f, \"max\": %.3f, \"mean\": %.3f},\n",
+			wall[0] / 1e6, _percentile(wall, runs, 0.5) / 1e6, _percentile(wall, runs, 0.95) / 1e6,
+			wall[runs - 1] / 1e6, total / runs / 1e6);
+		fprintf(out, "      \"programs_per_s\": %.3f,\n", threads * 1e9 / _percentile(wall, runs, 0.5));
+		/* Runs of the same program allocate the same, so the last one will do. */
+		if (BENCH_COUNTS_ALLOCS) {
+			fprintf(out, "      \"allocs\": %zu,\n      \"alloc_bytes\": %zu,\n",
+				samples[got - 1].allocs, samples[got - 1].alloc_bytes);
+		} else {
+			fprintf(out, "      \"allocs\": null,\n      \"alloc_bytes\": null,\n");
+		}
+	} else {
+		fprintf(out, "      \"wall_ms\": null,\n      \"programs_per_s\": null,\n      \"allocs\": null,\n      \"alloc_bytes\": null,\n");
+	}
+	/* Linux reports this in kilobytes. */
+	fprintf(out, "      \"peak_rss_kb\": %li\n    }", usage.ru_maxrss);
+
+	fprintf(stderr, "%-30s %s", w->name, ok ? "" : "FAILED\n");
+	if (ok && runs > 0)
+		fprintf(stderr, "median %10.3f ms  p95 %10.3f ms\n", _percentile(wall, runs, 0.5) / 1e6, _percentile(wall, runs, 0.95) / 1e6);
+	else if (ok)
+		fprintf(stderr, "\n");
+	return !ok;
+}
+
+static void _print_usage(const char *name) {
+	fprintf(stderr, "%s [-w warmup] [-n runs] [-t threads] [-o results.json] [program.den ...]\n", name);
+}
+
+int main(int argc, char *argv[]) {
+	int warmup = BENCH_WARMUP;
+	int runs = BENCH_RUNS;
+	int threads = 1;
+	const char *out_path = NULL;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "w:n:t:o:h")) != -1) {
+		switch (opt) {
+			case 'w':
+				warmup = atoi(optarg);
+				break;
+			case 'n':
+				runs = atoi(optarg);
+				break;
+			case 't':
+				threads = atoi(optarg);
+				break;
+			case 'o':
+				out_path = optarg;
+				break;
+			default:
+				_print_usage(argv[0]);
+				return 1;
+		}
+	}
+	if (warmup < 0 || runs < 1 || threads < 1) {
+		_print_usage(argv[0]);
+		return 1;
+	}
+
+	glob_t found = {0};
+	char **paths = argv + optind;
+	size_t npaths = argc - optind;
+	int generated = 0;
+	if (npaths == 0) {
+		if (glob("bench/*.den", 0, NULL, &found) == 0) {
+			paths = found.gl_pathv;
+			npaths = found.gl_pathc;
+		}
+		generated = 1;
+	}
+
+	FILE *out = stdout;
+	if (out_path != NULL) {
+		out = fopen(out_path, "w");
+		if (out == NULL) {
+			fprintf(stderr, "Could not open %s.\n", out_path);
+			return 1;
+		}
+	}
+
+	fprintf(out, "{\n  \"warmup\": %i,\n  \"runs\": %i,\n  \"threads\": %i,\n  \"workloads\": [\n", warmup, runs, threads);
+	int failed = 0;
+	size_t i;
+	for (i = 0; i < npaths; i++) {
+		const struct _workload w = { .name = paths[i], .path = paths[i] };
+		failed += _bench(out, &w, warmup, runs, threads);
+		fprintf(out, i + 1 < npaths || generated ? ",\n" : "\n");
+	}
+	if (generated) {
+		const struct _workload w = { .name = "generated/parse", .path = NULL };
+		failed += _bench(out, &w, warmup, runs, threads);
+		fprintf(out, "\n");
+	}
+	fprintf(out, "  ]\n}\n");
+
+	if (out != stdout)
+		fclose(out);
+	globfree(&found);
+	return failed != 0;
+}
@@ -0,0 +1,528 @@
+// vim: noet ts=4 sw=4
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "compile.h"
+#include "eval.h"
+#include "lair.h"
+#include "map.h"
+#include "parse.h"
+#include "symbol.h"
+#include "vector.h"
+
+#define LR_CACHE_BYTE_ORDER 0x01020304
+
+/* FNV-1a. It only has to tell sources apart, and the length is checked too. */
+static uint64_t _hash(const char *source, const size_t len) {
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	size_t i;
+	for (i = 0; i < len; i++) {
+		hash ^= (unsigned char)source[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+static int _path_for(const struct _lair_runtime *r, const uint64_t hash, char path[PATH_MAX]) {
+	const int n = snprintf(path, PATH_MAX, "%s/%016llx.lairc", r->options.cache_dir, (unsigned long long)hash);
+	return n > 0 && n < PATH_MAX;
+}
+
+/* Where each section starts, worked out from the header. */
+struct _layout {
+	size_t code;
+	size_t constants;
+	size_t protos;
+	size_t locals;
+	size_t globals;
+	size_t strings;
+	size_t end;
+};
+
+static struct _layout _layout_of(const struct _lair_cache_header *h) {
+	struct _layout l = {0};
+	l.code = sizeof(struct _lair_cache_header);
+	l.constants = l.code + (size_t)h->ncode * sizeof(uint32_t);
+	l.protos = l.constants + (size_t)h->nconstants * sizeof(struct _lair_cache_constant);
+	l.locals = l.protos + (size_t)h->nprotos * sizeof(struct _lair_cache_proto);
+	l.globals = l.locals + (size_t)h->nlocals * sizeof(uint32_t);
+	l.strings = l.globals + (size_t)h->nglobals * sizeof(uint32_t);
+	l.end = l.strings + h->strings_len;
+	return l;
+}
+
+/* Where each prototype's code ends: at the next one's entry, or the end of the
+ * code. Protos are laid out one after another, so sorting the entries finds
+ * them.
+ */
+static int _by_entry(const void *a, const void *b) {
+	const uint32_t x = *(const uint32_t *)a;
+	const uint32_t y = *(const uint32_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static uint32_t _end_of(const uint32_t *entries, const size_t nentries, const uint32_t entry, const uint32_t ncode) {
+	size_t lo = 0;
+	size_t hi = nentries;
+	while (lo < hi) {
+		const size_t mid = lo + (hi - lo) / 2;
+		if (entries[mid] <= entry)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo < nentries ? entries[lo] : ncode;
+}
+
+/* Checks one prototype's code, from its entry up to `end`. Every register an
+ * instruction touches has to be one of the frame's, every local one of its
+ * locals, and every jump has to land inside it. The last instruction has to
+ * leave it, so nothing runs on into the next prototype's code.
+ */
+static int _proto_is_sane(
+		const struct _lair_cache_header *h,
+		const uint32_t *code,
+		const struct _lair_cache_proto *protos,
+		const struct _lair_cache_proto *p,
+		const uint32_t end) {
+	if (end <= p->entry)
+		return 0;
+	size_t pc;
+	for (pc = p->entry; pc < end; pc++) {
+		const uint32_t i = code[pc];
+		const int a = LR_A(i);
+		if (a >= p->nregs && LR_OP(i) != OP_RETNIL)
+			return 0;
+		switch (LR_OP(i)) {
+			case OP_LOADK:
+				if ((uint32_t)LR_BX(i) >= h->nconstants)
+					return 0;
+				break;
+			case OP_GETLOCAL:
+				if (LR_B(i) >= p->nlocals)
+					return 0;
+				break;
+			case OP_SETLOCAL:
+				if (a >= p->nlocals || LR_B(i) >= p->nregs)
+					return 0;
+				break;
+			case OP_GETGLOBAL:
+			case OP_SETGLOBAL:
+				if ((uint32_t)LR_BX(i) >= h->nglobals)
+					return 0;
+				break;
+			case OP_CALL:
+			case OP_TAILCALL:
+				if (a + LR_C(i) >= p->nregs)
+					return 0;
+				break;
+			case OP_CALLK:
+			case OP_TAILCALLK:
+			case OP_FORKK:
+				if ((uint32_t)LR_BX(i) >= h->nprotos || a + protos[LR_BX(i)].argc >= p->nregs)
+					return 0;
+				break;
+			case OP_JMPF: {
+				const long target = (long)pc + 1 + LR_SBX(i);
+				if (target < (long)p->entry || target >= (long)end)
+					return 0;
+				break;
+			}
+			case OP_RET:
+			case OP_RETNIL:
+			case OP_JOIN:
+				break;
+			default:
+				/* Including the profiled ones, which the compiler never emits. */
+				return 0;
+		}
+	}
+
+	switch (LR_OP(code[end - 1])) {
+		case OP_RET:
+		case OP_RETNIL:
+		case OP_TAILCALL:
+		case OP_TAILCALLK:
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+/* The compiler checked all of this when it wrote the code, but the file could
+ * have been cut short or come from somewhere else since. Anything that would
+ * send the VM outside the program, or outside a frame's registers, gets it
+ * thrown out. The prototypes themselves have been checked already.
+ */
+static int _code_is_sane(const struct _lair_cache_header *h, const uint32_t *code, const struct _lair_cache_proto *protos) {
+	uint32_t *entries = malloc((h->nprotos + 1) * sizeof(uint32_t));
+	if (entries == NULL)
+		return 0;
+	size_t nentries = 0;
+	size_t i;
+	for (i = 0; i < h->nprotos; i++)
+		if (!protos[i].builtin)
+			entries[nentries++] = protos[i].entry;
+	qsort(entries, nentries, sizeof(uint32_t), _by_entry);
+
+	int sane = 1;
+	for (i = 0; i < h->nprotos && sane; i++) {
+		const struct _lair_cache_proto *p = &protos[i];
+		if (!p->builtin)
+			sane = _proto_is_sane(h, code, protos, p, _end_of(entries, nentries, p->entry, h->ncode));
+	}
+	free(entries);
+	return sane;
+}
+
+/* Only the kinds of constant the compiler makes, with what each one needs. */
+static int _constant_is_sane(const struct _lair_cache_header *h, const struct _lair_cache_constant *k) {
+	if ((k->name != LR_CACHE_NONE && k->name >= h->strings_len) ||
+			(k->str != LR_CACHE_NONE && k->str >= h->strings_len) ||
+			k->proto < -1 || (k->proto >= 0 && (uint32_t)k->proto >= h->nprotos))
+		return 0;
+	switch (k->type) {
+		case LR_NUM:
+		case LR_BOOL:
+			return k->name == LR_CACHE_NONE && k->str == LR_CACHE_NONE;
+		case LR_STRING:
+			return k->name != LR_CACHE_NONE || k->str != LR_CACHE_NONE;
+		case LR_FUNCTION_DEF:
+		case LR_FUNCTION_CALL:
+			return k->name != LR_CACHE_NONE;
+		default:
+			return 0;
+	}
+}
+
+/* Looks a name up in the string table and interns it. */
+static _lair_sym _name_at(struct _lair_runtime *r, const char *strings, const uint32_t offset) {
+	const char *name = strings + offset;
+	return _lair_intern(r, name, strlen(name));
+}
+
+/* Turns a mapped cache file back into a program, or returns NULL if it isn't
+ * one we can use.
+ */
+static struct _lair_program *_unpack(
+		struct _lair_runtime *r,
+		const struct _lair_env *env,
+		const char *mapping,
+		const size_t size,
+		const uint64_t hash,
+		const size_t len) {
+	const struct _lair_cache_header *h = (const struct _lair_cache_header *)mapping;
+	if (size < sizeof(*h) ||
+			memcmp(h->magic, "LAIR", 4) != 0 ||
+			h->version != LAIR_CACHE_VERSION ||
+			h->byte_order != LR_CACHE_BYTE_ORDER ||
+			h->nops != OP_MAX ||
+			h->source_hash != hash ||
+			h->source_len != len)
+		return NULL;
+
+	const struct _layout l = _layout_of(h);
+	if (l.end != size || h->strings_len == 0 || mapping[l.end - 1] != '\0' || h->main >= h->nprotos)
+		return NULL;
+
+	const uint32_t *code = (const uint32_t *)(mapping + l.code);
+	const struct _lair_cache_constant *constants = (const struct _lair_cache_constant *)(mapping + l.constants);
+	const struct _lair_cache_proto *protos = (const struct _lair_cache_proto *)(mapping + l.protos);
+	const uint32_t *locals = (const uint32_t *)(mapping + l.locals);
+	const uint32_t *globals = (const uint32_t *)(mapping + l.globals);
+	const char *strings = mapping + l.strings;
+
+	size_t i;
+	for (i = 0; i < h->nconstants; i++)
+		if (!_constant_is_sane(h, &constants[i]))
+			return NULL;
+	for (i = 0; i < h->nprotos; i++) {
+		const struct _lair_cache_proto *p = &protos[i];
+		if (p->name >= h->strings_len || p->argc < 0)
+			return NULL;
+		if (!p->builtin && (p->nregs > LR_MAX_REGS || p->nlocals < 0 || p->nlocals > p->nregs ||
+				p->argc > p->nlocals || (size_t)p->locals + p->nlocals > h->nlocals || p->entry >= h->ncode))
+			return NULL;
+	}
+	for (i = 0; i < h->nlocals; i++)
+		if (locals[i] >= h->strings_len)
+			return NULL;
+	for (i = 0; i < h->nglobals; i++)
+		if (globals[i] >= h->strings_len)
+			return NULL;
+	/* Nothing calls the top level, so there's nothing to pass it. */
+	if (protos[h->main].builtin || protos[h->main].argc != 0)
+		return NULL;
+	if (!_code_is_sane(h, code, protos))
+		return NULL;
+
+	/* Builtins are found by name, since their addresses change from run to
+	 * run. One this interpreter doesn't have means the file's stale.
+	 */
+	struct _lair_program *program = calloc(1, sizeof(struct _lair_program));
+	program->protos = vector_new(sizeof(struct _lair_proto), h->nprotos);
+	for (i = 0; i < h->nprotos; i++) {
+		const struct _lair_cache_proto *p = &protos[i];
+		const _lair_sym sym = _name_at(r, strings, p->name);
+		const struct _lair_function *builtin = NULL;
+		if (p->builtin) {
+			builtin = _lair_env_get(r, env, sym);
+			if (builtin == NULL) {
+				vector_free(program->protos);
+				free(program);
+				return NULL;
+			}
+		}
+
+		const struct _lair_proto proto = {
+			.name = _lair_symbol_name(r, sym),
+			.sym = sym,
+			.argc = p->argc,
+			.nregs = p->nregs,
+			.nlocals = p->nlocals,
+			.locals = p->locals,
+			.entry = p->entry,
+			.builtin = builtin
+		};
+		vector_append(program->protos, &proto, sizeof(proto));
+	}
+
+	/* Strings stay where they are. Names have to be this runtime's symbols. */
+	program->constants = vector_new(sizeof(struct _lair_type), h->nconstants);
+	for (i = 0; i < h->nconstants; i++) {
+		const struct _lair_cache_constant *k = &constants[i];
+		struct _lair_type constant = {
+			.type = k->type,
+			.managed = 0,
+			.sym = LR_NO_SYM,
+			.proto = k->proto
+		};
+		if (k->name != LR_CACHE_NONE) {
+			constant.sym = _name_at(r, strings, k->name);
+			constant.value.str = (char *)_lair_symbol_name(r, constant.sym);
+		} else if (k->str != LR_CACHE_NONE) {
+			constant.value.str = (char *)(strings + k->str);
+		} else if (k->type == LR_BOOL) {
+			constant.value.bool = (unsigned char)k->num;
+		} else {
+			constant.value.num = k->num;
+		}
+		vector_append(program->constants, &constant, sizeof(constant));
+	}
+
+	program->locals = vector_new(sizeof(_lair_sym), h->nlocals);
+	for (i = 0; i < h->nlocals; i++) {
+		const _lair_sym sym = _name_at(r, strings, locals[i]);
+		vector_append(program->locals, &sym, sizeof(sym));
+	}
+	program->globals = vector_new(sizeof(_lair_sym), h->nglobals);
+	for (i = 0; i < h->nglobals; i++) {
+		const _lair_sym sym = _name_at(r, strings, globals[i]);
+		vector_append(program->globals, &sym, sizeof(sym));
+	}
+
+	/* The code's run straight out of the file. */
+	program->code = vector_new(sizeof(uint32_t), 0);
+	free(program->code->items);
+	program->code->items = (void *)code;
+	program->code->count = program->code->max_size = h->ncode;
+
+	program->main = h->main;
+	program->mapping = (void *)mapping;
+	program->mapping_len = size;
+	return program;
+}
+
+struct _lair_program *_lair_cache_load(
+		struct _lair_runtime *r,
+		const struct _lair_env *env,
+		const char *source,
+		const size_t len) {
+	const uint64_t hash = _hash(source, len);
+	char path[PATH_MAX];
+	if (!_path_for(r, hash, path))
+		return NULL;
+
+	const int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	struct stat st = {0};
+	if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(struct _lair_cache_header)) {
+		close(fd);
+		return NULL;
+	}
+
+	const size_t size = st.st_size;
+	void *mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mapping == MAP_FAILED)
+		return NULL;
+
+	struct _lair_program *program = _unpack(r, env, mapping, size, hash, len);
+	if (program == NULL)
+		munmap(mapping, size);
+	return program;
+}
+
+/* The string table we're building, while we're building it. */
+struct _strings {
+	char *buf;
+	size_t len;
+	size_t size;
+};
+
+/* Adds a string to the table and returns where it went, or LR_CACHE_NONE if
+ * there's no room.
+ */
+static uint32_t _add_string(struct _strings *s, const char *str) {
+	const size_t n = strlen(str) + 1;
+	if (s->len + n >= LR_CACHE_NONE)
+		return LR_CACHE_NONE;
+	if (s->len + n > s->size) {
+		const size_t size = (s->size + n) * 2;
+		char *buf = realloc(s->buf, size);
+		if (buf == NULL)
+			return LR_CACHE_NONE;
+		s->buf = buf;
+		s->size = size;
+	}
+	memcpy(s->buf + s->len, str, n);
+	s->len += n;
+	return s->len - n;
+}
+
+/* Lays a program out the way `_unpack` wants it. Returns 0 if it can't. */
+static int _pack(
+		struct _lair_runtime *r,
+		const struct _lair_program *program,
+		struct _lair_cache_constant *constants,
+		struct _lair_cache_proto *protos,
+		uint32_t *locals,
+		uint32_t *globals,
+		struct _strings *strings) {
+	const struct _lair_type *k = (const struct _lair_type *)program->constants->items;
+	const struct _lair_proto *p = (const struct _lair_proto *)program->protos->items;
+	const _lair_sym *local_names = (const _lair_sym *)program->locals->items;
+	const _lair_sym *global_names = (const _lair_sym *)program->globals->items;
+
+	size_t i;
+	for (i = 0; i < program->constants->count; i++) {
+		struct _lair_cache_constant *c = &constants[i];
+		c->type = k[i].type;
+		c->proto = k[i].proto;
+		c->num = k[i].type == LR_BOOL ? k[i].value.bool : k[i].value.num;
+		c->name = LR_CACHE_NONE;
+		c->str = LR_CACHE_NONE;
+		if (k[i].sym != LR_NO_SYM) {
+			c->num = 0;
+			if ((c->name = _add_string(strings, _lair_symbol_name(r, k[i].sym))) == LR_CACHE_NONE)
+				return 0;
+		} else if (k[i].type != LR_NUM && k[i].type != LR_BOOL && k[i].value.str != NULL) {
+			c->num = 0;
+			if ((c->str = _add_string(strings, k[i].value.str)) == LR_CACHE_NONE)
+				return 0;
+		}
+	}
+
+	for (i = 0; i < program->protos->count; i++) {
+		struct _lair_cache_proto *c = &protos[i];
+		c->argc = p[i].argc;
+		c->nregs = p[i].nregs;
+		c->nlocals = p[i].nlocals;
+		c->locals = p[i].locals;
+		c->entry = p[i].entry;
+		c->builtin = p[i].builtin != NULL;
+		if ((c->name = _add_string(strings, _lair_symbol_name(r, p[i].sym))) == LR_CACHE_NONE)
+			return 0;
+	}
+
+	for (i = 0; i < program->locals->count; i++)
+		if ((locals[i] = _add_string(strings, _lair_symbol_name(r, local_names[i]))) == LR_CACHE_NONE)
+			return 0;
+	for (i = 0; i < program->globals->count; i++)
+		if ((globals[i] = _add_string(strings, _lair_symbol_name(r, global_names[i]))) == LR_CACHE_NONE)
+			return 0;
+	return 1;
+}
+
+void _lair_cache_store(
+		struct _lair_runtime *r,
+		const struct _lair_program *program,
+		const char *source,
+		const size_t len) {
+	const uint64_t hash = _hash(source, len);
+	char path[PATH_MAX];
+	char tmp[PATH_MAX];
+	if (!_path_for(r, hash, path))
+		return;
+	const int n = snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+	if (n <= 0 || n >= (int)sizeof(tmp))
+		return;
+
+	struct _lair_cache_header h = {
+		.magic = {'L', 'A', 'I', 'R'},
+		.version = LAIR_CACHE_VERSION,
+		.byte_order = LR_CACHE_BYTE_ORDER,
+		.nops = OP_MAX,
+		.source_hash = hash,
+		.source_len = len,
+		.main = program->main,
+		.ncode = program->code->count,
+		.nconstants = program->constants->count,
+		.nprotos = program->protos->count,
+		.nlocals = program->locals->count,
+		.nglobals = program->globals->count,
+		.strings_len = 0,
+		.unused = 0
+	};
+
+	struct _lair_cache_constant *constants = calloc(h.nconstants + 1, sizeof(*constants));
+	struct _lair_cache_proto *protos = calloc(h.nprotos + 1, sizeof(*protos));
+	uint32_t *locals = calloc(h.nlocals + 1, sizeof(*locals));
+	uint32_t *globals = calloc(h.nglobals + 1, sizeof(*globals));
+	struct _strings strings = {0};
+	FILE *out = NULL;
+
+	if (constants == NULL || protos == NULL || locals == NULL || globals == NULL ||
+			!_pack(r, program, constants, protos, locals, globals, &strings))
+		goto done;
+	h.strings_len = strings.len;
+
+	/* Written off to the side and moved into place, so nobody ever maps half
+	 * a file.
+	 */
+	const int fd = mkstemp(tmp);
+	if (fd < 0)
+		goto done;
+	out = fdopen(fd, "wb");
+	if (out == NULL) {
+		close(fd);
+		unlink(tmp);
+		goto done;
+	}
+
+	const int ok =
+		fwrite(&h, sizeof(h), 1, out) == 1 &&
+		fwrite(program->code->items, sizeof(uint32_t), h.ncode, out) == h.ncode &&
+		fwrite(constants, sizeof(*constants), h.nconstants, out) == h.nconstants &&
+		fwrite(protos, sizeof(*protos), h.nprotos, out) == h.nprotos &&
+		fwrite(locals, sizeof(*locals), h.nlocals, out) == h.nlocals &&
+		fwrite(globals, sizeof(*globals), h.nglobals, out) == h.nglobals &&
+		fwrite(strings.buf, 1, strings.len, out) == strings.len;
+	if (fclose(out) != 0 || !ok || rename(tmp, path) != 0)
+		unlink(tmp);
+
+done:
+	free(constants);
+	free(protos);
+	free(locals);
+	free(globals);
+	free(strings.buf);
+}
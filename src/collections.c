@@ -0,0 +1,530 @@
+// vim: noet ts=4 sw=4
+#include <string.h>
+
+#include "collections.h"
+#include "error.h"
+#include "gc.h"
+#include "parse.h"
+#include "rope.h"
+
+#define _MASK			(LAIR_TRIE_WIDTH - 1)
+#define _node_of(V)		(LR_UNBOX(V)->value.node)
+#define _vector_of(V)	(LR_UNBOX(V)->value.vector)
+#define _map_of(V)		(LR_UNBOX(V)->value.map)
+
+static _lair_val _node_new(struct _lair_runtime *r, const uint32_t size) {
+	struct _lair_type *t = _lair_gc_alloc(r, LR_NODE, sizeof(struct _lair_node) + size * sizeof(_lair_val));
+	t->value.node = (struct _lair_node *)(t + 1);
+	t->value.node->size = size;
+	return LR_BOX(t);
+}
+
+/* A copy of `from` with `extra` more (empty) slots on the end. */
+static _lair_val _node_copy(struct _lair_runtime *r, const _lair_val from, const uint32_t extra) {
+	const struct _lair_node *old = _node_of(from);
+	const _lair_val copy = _node_new(r, old->size + extra);
+	_node_of(copy)->bitmap = old->bitmap;
+	_node_of(copy)->collision = old->collision;
+	memcpy(_node_of(copy)->slots, old->slots, old->size * sizeof(_lair_val));
+	return copy;
+}
+
+/* Collections are keyed by what's in them, so the same items make the same
+ * key whichever collection they're in. That means looking one up touches
+ * every item in it.
+ */
+struct _map_hash {
+	struct _lair_runtime *r;
+	uint32_t hash;
+};
+
+/* Added up, so the order the pairs come out in doesn't matter. */
+static void _hash_pair(const _lair_val key, const _lair_val value, void *ctx) {
+	struct _map_hash *h = ctx;
+	h->hash += _lair_hash_value(h->r, key) ^ (_lair_hash_value(h->r, value) * 0x9e3779b1u);
+}
+
+uint32_t _lair_hash_value(struct _lair_runtime *r, const _lair_val v) {
+	switch (_lair_type_of(v)) {
+		case LR_NUM: {
+			/* Numbers that are close together shouldn't land in the same slot. */
+			uint32_t x = (uint32_t)_lair_num_of(v);
+			x ^= x >> 16;
+			x *= 0x7feb352d;
+			x ^= x >> 15;
+			x *= 0x846ca68b;
+			x ^= x >> 16;
+			return x;
+		}
+		case LR_STRING: {
+			/* FNV-1a. */
+			const size_t len = _lair_string_len(v);
+			const unsigned char *bytes = (const unsigned char *)_lair_string_bytes(r, v);
+			uint32_t hash = 2166136261u;
+			size_t i;
+			for (i = 0; i < len; i++) {
+				hash ^= bytes[i];
+				hash *= 16777619u;
+			}
+			return hash;
+		}
+		case LR_FUNCTION_DEF:
+		case LR_FUNCTION_CALL:
+			return LR_UNBOX(v)->sym * 2654435761u;
+		case LR_VECTOR: {
+			const struct _lair_vector *vec = _vector_of(v);
+			uint32_t hash = 0x2f3a9c17u;
+			size_t i;
+			for (i = 0; i < vec->count; i++)
+				hash = hash * 31 + _lair_hash_value(r, _lair_vector_get(vec, i));
+			return hash;
+		}
+		case LR_MAP: {
+			struct _map_hash h = { .r = r, .hash = 0x6b43a9b5u };
+			_lair_map_each(_map_of(v), _hash_pair, &h);
+			return h.hash;
+		}
+		default:
+			return (uint32_t)(v >> 3) * 2654435761u;
+	}
+}
+
+struct _map_equal {
+	struct _lair_runtime *r;
+	_lair_val other;
+	int equal;
+};
+
+static void _equal_pair(const _lair_val key, const _lair_val value, void *ctx) {
+	struct _map_equal *e = ctx;
+	if (!e->equal)
+		return;
+	const _lair_val *found = _lair_map_get(e->r, e->other, key);
+	e->equal = found != NULL && _lair_values_equal(e->r, *found, value);
+}
+
+int _lair_values_equal(struct _lair_runtime *r, const _lair_val a, const _lair_val b) {
+	if (a == b)
+		return 1;
+
+	const LAIR_TOKEN type = _lair_type_of(a);
+	if (type != _lair_type_of(b))
+		return 0;
+
+	switch (type) {
+		case LR_NUM:
+			return _lair_num_of(a) == _lair_num_of(b);
+		case LR_STRING: {
+			const size_t len = _lair_string_len(a);
+			if (len != _lair_string_len(b))
+				return 0;
+			return memcmp(_lair_string_bytes(r, a), _lair_string_bytes(r, b), len) == 0;
+		}
+		case LR_FUNCTION_DEF:
+		case LR_FUNCTION_CALL:
+			return LR_UNBOX(a)->sym == LR_UNBOX(b)->sym;
+		case LR_VECTOR: {
+			const struct _lair_vector *x = _vector_of(a);
+			const struct _lair_vector *y = _vector_of(b);
+			if (x->count != y->count)
+				return 0;
+			size_t i;
+			for (i = 0; i < x->count; i++)
+				if (!_lair_values_equal(r, _lair_vector_get(x, i), _lair_vector_get(y, i)))
+					return 0;
+			return 1;
+		}
+		case LR_MAP: {
+			if (_map_of(a)->count != _map_of(b)->count)
+				return 0;
+			struct _map_equal e = { .r = r, .other = b, .equal = 1 };
+			_lair_map_each(_map_of(a), _equal_pair, &e);
+			return e.equal;
+		}
+		default:
+			return 0;
+	}
+}
+
+/* Vectors. These work like Clojure's: everything but the tail is in a trie
+ * that's always packed to the left, and the number of levels in it is in
+ * `shift`. Interior nodes always have all 32 slots; the empty ones are nil.
+ */
+
+static _lair_val _vector_alloc(struct _lair_runtime *r, const size_t count, const unsigned int shift, const _lair_val root, const _lair_val tail) {
+	struct _lair_type *t = _lair_gc_alloc(r, LR_VECTOR, sizeof(struct _lair_vector));
+	t->value.vector = (struct _lair_vector *)(t + 1);
+	t->value.vector->count = count;
+	t->value.vector->shift = shift;
+	t->value.vector->root = root;
+	t->value.vector->tail = tail;
+	return LR_BOX(t);
+}
+
+/* Where the tail starts. */
+static inline size_t _tail_offset(const struct _lair_vector *vec) {
+	if (vec->count < LAIR_TRIE_WIDTH)
+		return 0;
+	return ((vec->count - 1) >> LAIR_TRIE_BITS) << LAIR_TRIE_BITS;
+}
+
+_lair_val _lair_vector_new(struct _lair_runtime *r) {
+	return _vector_alloc(r, 0, LAIR_TRIE_BITS, LR_NIL, LR_NIL);
+}
+
+_lair_val _lair_vector_get(const struct _lair_vector *vec, const size_t i) {
+	if (i >= _tail_offset(vec))
+		return _node_of(vec->tail)->slots[i & _MASK];
+
+	_lair_val node = vec->root;
+	unsigned int level;
+	for (level = vec->shift; level > 0; level -= LAIR_TRIE_BITS)
+		node = _node_of(node)->slots[(i >> level) & _MASK];
+	return _node_of(node)->slots[i & _MASK];
+}
+
+/* A chain of nodes `level` deep with `leaf` at the bottom. */
+static _lair_val _new_path(struct _lair_runtime *r, const unsigned int level, const _lair_val leaf) {
+	if (level == 0)
+		return leaf;
+	const _lair_val node = _node_new(r, LAIR_TRIE_WIDTH);
+	_node_of(node)->slots[0] = _new_path(r, level - LAIR_TRIE_BITS, leaf);
+	return node;
+}
+
+/* Copies the path to the first empty leaf of `parent` and puts `leaf` there.
+ * `count` is how many items were in the vector before the push.
+ */
+static _lair_val _push_leaf(struct _lair_runtime *r, const size_t count, const unsigned int level, const _lair_val parent, const _lair_val leaf) {
+	const _lair_val node = parent == LR_NIL ? _node_new(r, LAIR_TRIE_WIDTH) : _node_copy(r, parent, 0);
+	const size_t sub = ((count - 1) >> level) & _MASK;
+
+	if (level == LAIR_TRIE_BITS) {
+		_node_of(node)->slots[sub] = leaf;
+	} else {
+		const _lair_val child = parent == LR_NIL ? LR_NIL : _node_of(parent)->slots[sub];
+		_node_of(node)->slots[sub] = child != LR_NIL
+			? _push_leaf(r, count, level - LAIR_TRIE_BITS, child, leaf)
+			: _new_path(r, level - LAIR_TRIE_BITS, leaf);
+	}
+	return node;
+}
+
+_lair_val _lair_vector_push(struct _lair_runtime *r, const _lair_val vec, const _lair_val item) {
+	const struct _lair_vector *old = _vector_of(vec);
+	_lair_gc_pause(r);
+
+	/* Room in the tail: only the tail gets copied. */
+	if (old->count - _tail_offset(old) < LAIR_TRIE_WIDTH) {
+		const _lair_val tail = old->tail == LR_NIL ? _node_new(r, 1) : _node_copy(r, old->tail, 1);
+		_node_of(tail)->slots[_node_of(tail)->size - 1] = item;
+		const _lair_val to_return = _vector_alloc(r, old->count + 1, old->shift, old->root, tail);
+		_lair_gc_resume(r);
+		return to_return;
+	}
+
+	/* The tail is full, so it goes into the trie and we start a new one. If
+	 * the trie is full too, it gets another level on top.
+	 */
+	_lair_val root;
+	unsigned int shift = old->shift;
+	if ((old->count >> LAIR_TRIE_BITS) > ((size_t)1 << old->shift)) {
+		root = _node_new(r, LAIR_TRIE_WIDTH);
+		_node_of(root)->slots[0] = old->root;
+		_node_of(root)->slots[1] = _new_path(r, old->shift, old->tail);
+		shift += LAIR_TRIE_BITS;
+	} else {
+		root = _push_leaf(r, old->count, old->shift, old->root, old->tail);
+	}
+
+	const _lair_val tail = _node_new(r, 1);
+	_node_of(tail)->slots[0] = item;
+	const _lair_val to_return = _vector_alloc(r, old->count + 1, shift, root, tail);
+	_lair_gc_resume(r);
+	return to_return;
+}
+
+static _lair_val _set_in(struct _lair_runtime *r, const unsigned int level, const _lair_val parent, const size_t i, const _lair_val item) {
+	const _lair_val node = _node_copy(r, parent, 0);
+	if (level == 0) {
+		_node_of(node)->slots[i & _MASK] = item;
+	} else {
+		const size_t sub = (i >> level) & _MASK;
+		_node_of(node)->slots[sub] = _set_in(r, level - LAIR_TRIE_BITS, _node_of(parent)->slots[sub], i, item);
+	}
+	return node;
+}
+
+_lair_val _lair_vector_set(struct _lair_runtime *r, const _lair_val vec, const size_t i, const _lair_val item) {
+	const struct _lair_vector *old = _vector_of(vec);
+	if (i == old->count)
+		return _lair_vector_push(r, vec, item);
+
+	_lair_gc_pause(r);
+	_lair_val to_return;
+	if (i >= _tail_offset(old)) {
+		const _lair_val tail = _node_copy(r, old->tail, 0);
+		_node_of(tail)->slots[i & _MASK] = item;
+		to_return = _vector_alloc(r, old->count, old->shift, old->root, tail);
+	} else {
+		const _lair_val root = _set_in(r, old->shift, old->root, i, item);
+		to_return = _vector_alloc(r, old->count, old->shift, root, old->tail);
+	}
+	_lair_gc_resume(r);
+	return to_return;
+}
+
+/* Maps. Each level of the trie uses the next five bits of the key's hash to
+ * pick a slot. When two keys still share a slot after all 32 bits are used
+ * up, they go in a collision node, which is just a list of pairs to search.
+ * A collision node keeps the hash its keys share in `bitmap`.
+ */
+
+static _lair_val _map_alloc(struct _lair_runtime *r, const size_t count, const _lair_val root) {
+	struct _lair_type *t = _lair_gc_alloc(r, LR_MAP, sizeof(struct _lair_map));
+	t->value.map = (struct _lair_map *)(t + 1);
+	t->value.map->count = count;
+	t->value.map->root = root;
+	return LR_BOX(t);
+}
+
+static inline uint32_t _bit_for(const uint32_t hash, const unsigned int shift) {
+	return (uint32_t)1 << ((hash >> shift) & _MASK);
+}
+
+/* Which pair in a node a bit's slot is stored at. */
+static inline uint32_t _index_of(const uint32_t bitmap, const uint32_t bit) {
+	return __builtin_popcount(bitmap & (bit - 1));
+}
+
+/* The pair in a collision node holding `key`, or -1. */
+static int _collision_find(struct _lair_runtime *r, const struct _lair_node *node, const _lair_val key) {
+	uint32_t i;
+	for (i = 0; i < node->size; i += 2) {
+		if (_lair_values_equal(r, node->slots[i], key))
+			return i;
+	}
+	return -1;
+}
+
+/* A copy of `from` with `count` slots starting at `at` taken out, or `count`
+ * empty ones put in if `grow` is set.
+ */
+static _lair_val _node_splice(struct _lair_runtime *r, const _lair_val from, const uint32_t at, const uint32_t count, const int grow) {
+	const struct _lair_node *old = _node_of(from);
+	const uint32_t size = grow ? old->size + count : old->size - count;
+	const _lair_val copy = _node_new(r, size);
+	struct _lair_node *node = _node_of(copy);
+	node->bitmap = old->bitmap;
+	node->collision = old->collision;
+	memcpy(node->slots, old->slots, at * sizeof(_lair_val));
+	if (grow)
+		memcpy(node->slots + at + count, old->slots + at, (old->size - at) * sizeof(_lair_val));
+	else
+		memcpy(node->slots + at, old->slots + at + count, (old->size - at - count) * sizeof(_lair_val));
+	return copy;
+}
+
+/* A node holding two pairs whose hashes agree up to `shift`. */
+static _lair_val _merge(struct _lair_runtime *r, const unsigned int shift,
+		const _lair_val key0, const uint32_t hash0, const _lair_val value0,
+		const _lair_val key1, const uint32_t hash1, const _lair_val value1) {
+	if (shift >= 32) {
+		const _lair_val node = _node_new(r, 4);
+		_node_of(node)->collision = 1;
+		_node_of(node)->bitmap = hash0;
+		_node_of(node)->slots[0] = key0;
+		_node_of(node)->slots[1] = value0;
+		_node_of(node)->slots[2] = key1;
+		_node_of(node)->slots[3] = value1;
+		return node;
+	}
+
+	const uint32_t bit0 = _bit_for(hash0, shift);
+	const uint32_t bit1 = _bit_for(hash1, shift);
+	if (bit0 == bit1) {
+		const _lair_val node = _node_new(r, 2);
+		_node_of(node)->bitmap = bit0;
+		_node_of(node)->slots[1] = _merge(r, shift + LAIR_TRIE_BITS, key0, hash0, value0, key1, hash1, value1);
+		return node;
+	}
+
+	const _lair_val node = _node_new(r, 4);
+	const int first = bit0 < bit1 ? 0 : 2;
+	_node_of(node)->bitmap = bit0 | bit1;
+	_node_of(node)->slots[first] = key0;
+	_node_of(node)->slots[first + 1] = value0;
+	_node_of(node)->slots[2 - first] = key1;
+	_node_of(node)->slots[3 - first] = value1;
+	return node;
+}
+
+static _lair_val _put_in(struct _lair_runtime *r, const _lair_val from, const unsigned int shift, const uint32_t hash,
+		const _lair_val key, const _lair_val value, int *added) {
+	if (from == LR_NIL) {
+		const _lair_val node = _node_new(r, 2);
+		_node_of(node)->bitmap = _bit_for(hash, shift);
+		_node_of(node)->slots[0] = key;
+		_node_of(node)->slots[1] = value;
+		*added = 1;
+		return node;
+	}
+
+	const struct _lair_node *old = _node_of(from);
+	if (old->collision) {
+		const int found = _collision_find(r, old, key);
+		if (found >= 0) {
+			const _lair_val node = _node_copy(r, from, 0);
+			_node_of(node)->slots[found + 1] = value;
+			return node;
+		}
+		const _lair_val node = _node_copy(r, from, 2);
+		_node_of(node)->slots[old->size] = key;
+		_node_of(node)->slots[old->size + 1] = value;
+		*added = 1;
+		return node;
+	}
+
+	const uint32_t bit = _bit_for(hash, shift);
+	const uint32_t at = _index_of(old->bitmap, bit) * 2;
+	if ((old->bitmap & bit) == 0) {
+		const _lair_val node = _node_splice(r, from, at, 2, 1);
+		_node_of(node)->bitmap |= bit;
+		_node_of(node)->slots[at] = key;
+		_node_of(node)->slots[at + 1] = value;
+		*added = 1;
+		return node;
+	}
+
+	const _lair_val here = old->slots[at];
+	const _lair_val there = old->slots[at + 1];
+	const _lair_val node = _node_copy(r, from, 0);
+	if (here == LR_NIL) {
+		_node_of(node)->slots[at + 1] = _put_in(r, there, shift + LAIR_TRIE_BITS, hash, key, value, added);
+	} else if (_lair_values_equal(r, here, key)) {
+		_node_of(node)->slots[at + 1] = value;
+	} else {
+		/* Two keys want the same slot, so they both move down a level. */
+		_node_of(node)->slots[at] = LR_NIL;
+		_node_of(node)->slots[at + 1] = _merge(r, shift + LAIR_TRIE_BITS,
+			here, _lair_hash_value(r, here), there, key, hash, value);
+		*added = 1;
+	}
+	return node;
+}
+
+/* Returns `from` itself if `key` isn't in it, and nil if nothing's left. */
+static _lair_val _del_from(struct _lair_runtime *r, const _lair_val from, const unsigned int shift, const uint32_t hash, const _lair_val key) {
+	const struct _lair_node *old = _node_of(from);
+	if (old->collision) {
+		const int found = _collision_find(r, old, key);
+		if (found < 0)
+			return from;
+		if (old->size == 2)
+			return LR_NIL;
+		return _node_splice(r, from, found, 2, 0);
+	}
+
+	const uint32_t bit = _bit_for(hash, shift);
+	if ((old->bitmap & bit) == 0)
+		return from;
+
+	const uint32_t at = _index_of(old->bitmap, bit) * 2;
+	const _lair_val here = old->slots[at];
+	const _lair_val there = old->slots[at + 1];
+	if (here == LR_NIL) {
+		const _lair_val child = _del_from(r, there, shift + LAIR_TRIE_BITS, hash, key);
+		if (child == there)
+			return from;
+		if (child != LR_NIL) {
+			const _lair_val node = _node_copy(r, from, 0);
+			_node_of(node)->slots[at + 1] = child;
+			return node;
+		}
+	} else if (!_lair_values_equal(r, here, key)) {
+		return from;
+	}
+
+	/* The pair (or the child it pointed to) is gone. */
+	if (old->size == 2)
+		return LR_NIL;
+	const _lair_val node = _node_splice(r, from, at, 2, 0);
+	_node_of(node)->bitmap &= ~bit;
+	return node;
+}
+
+_lair_val _lair_map_new(struct _lair_runtime *r) {
+	return _map_alloc(r, 0, LR_NIL);
+}
+
+const _lair_val *_lair_map_get(struct _lair_runtime *r, const _lair_val map, const _lair_val key) {
+	_lair_val from = _map_of(map)->root;
+	if (from == LR_NIL)
+		return NULL;
+
+	_lair_gc_pause(r);
+	const uint32_t hash = _lair_hash_value(r, key);
+	const _lair_val *found = NULL;
+	unsigned int shift = 0;
+	while (1) {
+		const struct _lair_node *node = _node_of(from);
+		if (node->collision) {
+			const int at = _collision_find(r, node, key);
+			found = at < 0 ? NULL : &node->slots[at + 1];
+			break;
+		}
+
+		const uint32_t bit = _bit_for(hash, shift);
+		if ((node->bitmap & bit) == 0)
+			break;
+		const uint32_t at = _index_of(node->bitmap, bit) * 2;
+		if (node->slots[at] == LR_NIL) {
+			from = node->slots[at + 1];
+			shift += LAIR_TRIE_BITS;
+			continue;
+		}
+		if (_lair_values_equal(r, node->slots[at], key))
+			found = &node->slots[at + 1];
+		break;
+	}
+	_lair_gc_resume(r);
+	return found;
+}
+
+_lair_val _lair_map_put(struct _lair_runtime *r, const _lair_val map, const _lair_val key, const _lair_val value) {
+	const struct _lair_map *old = _map_of(map);
+	_lair_gc_pause(r);
+	int added = 0;
+	const _lair_val root = _put_in(r, old->root, 0, _lair_hash_value(r, key), key, value, &added);
+	const _lair_val to_return = _map_alloc(r, old->count + added, root);
+	_lair_gc_resume(r);
+	return to_return;
+}
+
+_lair_val _lair_map_del(struct _lair_runtime *r, const _lair_val map, const _lair_val key) {
+	const struct _lair_map *old = _map_of(map);
+	if (old->root == LR_NIL)
+		return map;
+
+	_lair_gc_pause(r);
+	const _lair_val root = _del_from(r, old->root, 0, _lair_hash_value(r, key), key);
+	const _lair_val to_return = root == old->root ? map : _map_alloc(r, old->count - 1, root);
+	_lair_gc_resume(r);
+	return to_return;
+}
+
+static void _each_in(const _lair_val from, void (*per_pair)(const _lair_val key, const _lair_val value, void *ctx), void *ctx) {
+	const struct _lair_node *node = _node_of(from);
+	uint32_t i;
+	for (i = 0; i < node->size; i += 2) {
+		if (node->slots[i] == LR_NIL)
+			_each_in(node->slots[i + 1], per_pair, ctx);
+		else
+			per_pair(node->slots[i], node->slots[i + 1], ctx);
+	}
+}
+
+void _lair_map_each(const struct _lair_map *map, void (*per_pair)(const _lair_val key, const _lair_val value, void *ctx), void *ctx) {
+	if (map->root != LR_NIL)
+		_each_in(map->root, per_pair, ctx);
+}
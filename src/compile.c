@@ -0,0 +1,970 @@
+// vim: noet ts=4 sw=4
+#include <sys/mman.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "arena.h"
+#include "compile.h"
+#include "error.h"
+#include "eval.h"
+#include "lair_std.h"
+#include "map.h"
+#include "parse.h"
+#include "symbol.h"
+#include "vector.h"
+
+/* What we know about a top-level function before its body is compiled. */
+struct _global_def {
+	const struct _lair_ast *form; /*	The AST the function was defined by. */
+	int proto; /*	Index into the program's prototypes. */
+	int argc; /*	Number of parameters. */
+};
+
+/* A single line of a function body. */
+struct _line {
+	unsigned int indent;
+	const struct _lair_ast *start;
+	const struct _lair_ast *end;
+};
+
+/* All of the tables indexed by symbol are `nsyms` long. */
+struct _lair_compiler {
+	struct _lair_runtime *r;
+	struct _lair_program *program;
+	const struct _lair_env *env; /*	Where builtins live. */
+	size_t nsyms; /*	How many symbols there were when we started. */
+	struct _global_def *globals; /*	symbol -> top-level function. `form` is NULL if there isn't one. */
+	int *functions; /*	symbol -> constant pool index of the function value, or -1. */
+	int *global_slots; /*	symbol -> slot in the globals, or -1. */
+	int *slots; /*	symbol -> register of the local in the function being compiled, or -1. */
+	unsigned char *bound; /*	symbol -> set once the name has been bound where we are. */
+	int in_main; /*	Set while compiling the top-level code, whose bindings are globals. */
+	int nregs; /*	High-water mark of registers used by the current function. */
+	int fork; /*	Set while compiling an argument, so a call to a Den function there gets forked. */
+	size_t forked; /*	Where the last forked call was emitted, plus one. */
+};
+
+static inline int _is_line_end(const struct _lair_ast *n) {
+	return n == NULL ||
+		n->atom.type == LR_INDENT ||
+		n->atom.type == LR_DEDENT ||
+		n->atom.type == LR_EOF;
+}
+
+static inline int _is_operator_name(const char *name) {
+	/* Operators are the names that aren't spelled with letters. */
+	const char c = name[0];
+	return !((c >= 'a' && c <= 'z') ||
+			(c >= 'A' && c <= 'Z') ||
+			(c >= '0' && c <= '9') ||
+			c == '_');
+}
+
+static void _syntax_error(struct _lair_compiler *c, const char *fmt, const char *arg) {
+	char buf[512] = {0};
+	snprintf(buf, sizeof(buf), fmt, arg);
+	throw_exception(c->r, ERR_SYNTAX, buf);
+}
+
+/* Arguments to top-level calls come out of the tokenizer as LR_FUNCTION_ARGs,
+ * because we can't tell a call from a definition until we know what has been
+ * defined. Now we do, so figure out what they really are.
+ */
+static void _atom_of(struct _lair_compiler *c, const struct _lair_ast *n, struct _lair_type *out) {
+	if (n->atom.type != LR_FUNCTION_ARG) {
+		*out = n->atom;
+		return;
+	}
+
+	struct _lair_token token = {
+		.token_str = n->atom.value.str,
+		.token_len = strlen(n->atom.value.str),
+		.token_type = LR_ERR,
+		.indent_level = n->indent_level,
+		.sym = n->atom.sym,
+		.next = NULL,
+		.prev = NULL,
+	};
+	_intuit_token_type(c->r, &token);
+	*out = _lair_atomize_token(c->r, &token);
+}
+
+static size_t _emit(struct _lair_compiler *c, const uint32_t ins) {
+	const int rc = vector_append(c->program->code, &ins, sizeof(uint32_t));
+	check(c->r, rc == 1, ERR_RUNTIME, "Could not grow the instruction stream.");
+	return c->program->code->count - 1;
+}
+
+static inline uint32_t *_instruction_at(struct _lair_compiler *c, const size_t at) {
+	return (uint32_t *)vector_get(c->program->code, at);
+}
+
+static void _use_reg(struct _lair_compiler *c, const int reg) {
+	if (reg >= LR_MAX_REGS)
+		throw_exception(c->r, ERR_SYNTAX, "Expression is too deeply nested.");
+	if (reg + 1 > c->nregs)
+		c->nregs = reg + 1;
+}
+
+static int _add_constant(struct _lair_compiler *c, const struct _lair_type *k) {
+	struct _lair_type copy = *k;
+	/* Names are interned, and the symbol table outlives us. */
+	if (k->sym == LR_NO_SYM && k->type != LR_NUM && k->type != LR_BOOL && k->value.str != NULL)
+		copy.value.str = strdup(k->value.str);
+
+	const int rc = vector_append(c->program->constants, &copy, sizeof(struct _lair_type));
+	check(c->r, rc == 1, ERR_RUNTIME, "Could not grow the constant pool.");
+	check(c->r, c->program->constants->count <= LR_MAX_BX, ERR_SYNTAX, "Too many constants in program.");
+	return c->program->constants->count - 1;
+}
+
+static int _add_proto(
+		struct _lair_compiler *c,
+		const _lair_sym sym,
+		const int argc,
+		const struct _lair_function *builtin) {
+	struct _lair_proto proto = {
+		.name = _lair_symbol_name(c->r, sym),
+		.sym = sym,
+		.argc = argc,
+		.nregs = 0,
+		.nlocals = 0,
+		.locals = c->program->locals->count,
+		.entry = 0,
+		.builtin = builtin
+	};
+	const int rc = vector_append(c->program->protos, &proto, sizeof(proto));
+	check(c->r, rc == 1, ERR_RUNTIME, "Could not grow the function table.");
+	check(c->r, c->program->protos->count <= LR_MAX_BX, ERR_SYNTAX, "Too many functions in program.");
+	return c->program->protos->count - 1;
+}
+
+static inline struct _lair_proto *_proto_at(struct _lair_compiler *c, const int proto) {
+	return (struct _lair_proto *)vector_get(c->program->protos, proto);
+}
+
+typedef enum {
+	NAME_LOCAL, /*	A register in the current frame. */
+	NAME_GLOBAL, /*	A global slot. Names we don't know anything about end up here. */
+	NAME_FUNCTION, /*	A top-level function. */
+	NAME_BUILTIN /*	A builtin function. */
+} NAME_KIND;
+
+/* Figures out what a name refers to from where we are. Returns the arity of
+ * the function it names, or -1 if we can't know that until runtime.
+ */
+static int _resolve(struct _lair_compiler *c, const _lair_sym sym, NAME_KIND *kind) {
+	if (c->bound[sym]) {
+		*kind = c->in_main ? NAME_GLOBAL : NAME_LOCAL;
+		return -1;
+	}
+
+	const struct _global_def *def = &c->globals[sym];
+	if (def->form != NULL) {
+		*kind = NAME_FUNCTION;
+		return def->argc;
+	}
+
+	const struct _lair_function *builtin = _lair_env_get(c->r, c->env, sym);
+	if (builtin != NULL) {
+		*kind = NAME_BUILTIN;
+		return builtin->argc;
+	}
+
+	*kind = NAME_GLOBAL;
+	return -1;
+}
+
+/* The value of a function's name, as a constant. Builtins get a prototype the
+ * first time they're referred to. If there's no such function, the constant
+ * refers to nothing and calling it is a runtime error.
+ */
+static int _function_constant(struct _lair_compiler *c, const _lair_sym sym) {
+	if (c->functions[sym] != -1)
+		return c->functions[sym];
+
+	int proto = -1;
+	const struct _global_def *def = &c->globals[sym];
+	const struct _lair_function *builtin = _lair_env_get(c->r, c->env, sym);
+	if (def->form != NULL)
+		proto = def->proto;
+	else if (builtin != NULL)
+		proto = _add_proto(c, sym, builtin->argc, builtin);
+
+	const struct _lair_type k = {
+		.type = LR_FUNCTION_DEF,
+		.sym = sym,
+		.proto = proto,
+		.value = {
+			.str = (char *)_lair_symbol_name(c->r, sym)
+		}
+	};
+	c->functions[sym] = _add_constant(c, &k);
+	return c->functions[sym];
+}
+
+static int _global_slot(struct _lair_compiler *c, const _lair_sym sym) {
+	if (c->global_slots[sym] == -1) {
+		check(c->r, c->program->globals->count < LR_MAX_BX, ERR_SYNTAX, "Too many globals in program.");
+		c->global_slots[sym] = c->program->globals->count;
+		vector_append(c->program->globals, &sym, sizeof(sym));
+	}
+	return c->global_slots[sym];
+}
+
+static int _compile_expr(
+		struct _lair_compiler *c,
+		const struct _lair_ast **cursor,
+		const int dst,
+		const int tail);
+
+static void _compile_name(struct _lair_compiler *c, const _lair_sym sym, const int dst) {
+	NAME_KIND kind = NAME_GLOBAL;
+	_resolve(c, sym, &kind);
+	_use_reg(c, dst);
+
+	switch (kind) {
+		case NAME_LOCAL:
+			_emit(c, LR_ABC(OP_GETLOCAL, dst, c->slots[sym], 0));
+			break;
+		case NAME_GLOBAL:
+			_emit(c, LR_ABX(OP_GETGLOBAL, dst, _global_slot(c, sym)));
+			break;
+		case NAME_FUNCTION:
+		case NAME_BUILTIN:
+			_emit(c, LR_ABX(OP_LOADK, dst, _function_constant(c, sym)));
+			break;
+	}
+}
+
+static int _fold_call(
+		struct _lair_compiler *c,
+		const _lair_sym sym,
+		const struct _lair_ast **cursor,
+		struct _lair_type *out);
+
+/* Works out the value of the expression at `cursor` if it's a literal, or a
+ * call we can fold. Moves `cursor` past it and returns 1 if so; leaves it
+ * alone and returns 0 if not.
+ */
+static int _fold_operand(struct _lair_compiler *c, const struct _lair_ast **cursor, struct _lair_type *out) {
+	const struct _lair_ast *n = *cursor;
+	const struct _lair_ast *next = n->next;
+	struct _lair_type atom;
+	_atom_of(c, n, &atom);
+
+	switch (atom.type) {
+		case LR_NUM:
+		case LR_STRING:
+			*out = atom;
+			*cursor = next;
+			return 1;
+		case LR_CALL: {
+			struct _lair_type callee;
+			if (_is_line_end(next))
+				return 0;
+			_atom_of(c, next, &callee);
+			next = next->next;
+			if (callee.type != LR_ATOM || !_fold_call(c, callee.sym, &next, out))
+				return 0;
+			*cursor = next;
+			return 1;
+		}
+		case LR_ATOM:
+			if (!_is_operator_name(atom.value.str) || !_fold_call(c, atom.sym, &next, out))
+				return 0;
+			*cursor = next;
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+/* Calls to `+`, `-` and `=` whose arguments are all known at compile time
+ * get worked out here, so the program just loads the answer. Anything the
+ * builtin would complain about (adding a string to a number, say) is left
+ * for runtime, so it fails where and when it always did.
+ */
+static int _fold_call(
+		struct _lair_compiler *c,
+		const _lair_sym sym,
+		const struct _lair_ast **cursor,
+		struct _lair_type *out) {
+	NAME_KIND kind = NAME_GLOBAL;
+	_resolve(c, sym, &kind);
+	if (kind != NAME_BUILTIN)
+		return 0;
+
+	const struct _lair_function *builtin = _lair_env_get(c->r, c->env, sym);
+	_lair_val (*const f)(LAIR_FUNCTION_SIG) = builtin->function_ptr;
+	if (f != &_lair_builtin_operator_plus && f != &_lair_builtin_operator_minus && f != &_lair_builtin_operator_eq)
+		return 0;
+
+	const struct _lair_ast *at = *cursor;
+	struct _lair_type a, b;
+	if (_is_line_end(at) || !_fold_operand(c, &at, &a) ||
+			_is_line_end(at) || !_fold_operand(c, &at, &b))
+		return 0;
+
+	struct _lair_type folded = { .type = LR_NUM, .sym = LR_NO_SYM, .proto = -1 };
+	if (f == &_lair_builtin_operator_eq) {
+		if (a.type != b.type)
+			return 0;
+		folded.type = LR_BOOL;
+		if (a.type == LR_NUM)
+			folded.value.bool = a.value.num == b.value.num;
+		else if (a.type == LR_BOOL)
+			folded.value.bool = a.value.bool == b.value.bool;
+		else
+			folded.value.bool = strcmp(a.value.str, b.value.str) == 0;
+	} else if (a.type == LR_NUM && b.type == LR_NUM) {
+		const long long n = f == &_lair_builtin_operator_plus ?
+			(long long)a.value.num + b.value.num :
+			(long long)a.value.num - b.value.num;
+		if (n < INT_MIN || n > INT_MAX)
+			return 0;
+		folded.value.num = n;
+	} else if (f == &_lair_builtin_operator_plus && a.type == LR_STRING && b.type == LR_STRING) {
+		const size_t alen = strlen(a.value.str);
+		const size_t blen = strlen(b.value.str);
+		char *str = _lair_arena_alloc(c->r, c->r->arena, alen + blen + 1);
+		memcpy(str, a.value.str, alen);
+		memcpy(str + alen, b.value.str, blen + 1);
+		folded.type = LR_STRING;
+		folded.value.str = str;
+	} else {
+		return 0;
+	}
+
+	*out = folded;
+	*cursor = at;
+	return 1;
+}
+
+/* If `tail` is set the call is the last thing the function does, so it gets
+ * compiled as a tail call and returns on its own.
+ */
+static void _compile_call(
+		struct _lair_compiler *c,
+		const _lair_sym sym,
+		const struct _lair_ast **cursor,
+		const int dst,
+		const int tail) {
+	/* Only the call that is the argument gets forked, not the ones in its
+	 * own arguments.
+	 */
+	const int fork = c->fork && !tail;
+	c->fork = 0;
+
+	struct _lair_type folded;
+	if (_fold_call(c, sym, cursor, &folded)) {
+		_use_reg(c, dst);
+		_emit(c, LR_ABX(OP_LOADK, dst, _add_constant(c, &folded)));
+		if (tail)
+			_emit(c, LR_ABC(OP_RET, dst, 0, 0));
+		return;
+	}
+
+	/* The callee goes in `dst`, the arguments in the registers right after it. */
+	NAME_KIND kind = NAME_GLOBAL;
+	const int arity = _resolve(c, sym, &kind);
+
+	/* Functions can't be redefined, so if the name refers to one here it
+	 * always will, and the call can go straight to it. Otherwise the callee is
+	 * a value we'll only have at runtime. Calling a name nobody has bound or
+	 * defined fails then.
+	 */
+	int proto = -1;
+	if (kind == NAME_FUNCTION || kind == NAME_BUILTIN) {
+		const struct _lair_type *k = vector_get(c->program->constants, _function_constant(c, sym));
+		proto = k->proto;
+		_use_reg(c, dst);
+	} else if (kind == NAME_GLOBAL && !c->bound[sym]) {
+		_use_reg(c, dst);
+		_emit(c, LR_ABX(OP_LOADK, dst, _function_constant(c, sym)));
+	} else {
+		_compile_name(c, sym, dst);
+	}
+
+	/* If we don't know how many arguments the function takes, it gets the
+	 * rest of the line.
+	 */
+	int argc = 0;
+	int nforks = 0;
+	size_t last_fork = 0;
+	while (!_is_line_end(*cursor) && (arity < 0 || argc < arity)) {
+		c->fork = arity >= 0;
+		c->forked = 0;
+		_compile_expr(c, cursor, dst + 1 + argc, 0);
+		c->fork = 0;
+		if (c->forked != 0) {
+			last_fork = c->forked - 1;
+			nforks++;
+		}
+		argc++;
+	}
+
+	if (arity >= 0 && argc < arity)
+		_syntax_error(c, "Not enough arguments to function: %s", _lair_symbol_name(c->r, sym));
+
+	/* Arguments that call Den functions can run alongside each other. The
+	 * last one runs here while we wait for the rest, so it isn't forked, and
+	 * neither is one on its own.
+	 */
+	if (nforks > 0) {
+		uint32_t *last = _instruction_at(c, last_fork);
+		*last = LR_ABX(OP_CALLK, LR_A(*last), LR_BX(*last));
+		if (nforks > 1)
+			_emit(c, LR_ABC(OP_JOIN, dst + 1, 0, 0));
+	}
+
+	c->forked = 0;
+	if (proto != -1 && fork && _proto_at(c, proto)->builtin == NULL)
+		c->forked = _emit(c, LR_ABX(OP_FORKK, dst, proto)) + 1;
+	else if (proto != -1)
+		_emit(c, LR_ABX(tail ? OP_TAILCALLK : OP_CALLK, dst, proto));
+	else
+		_emit(c, LR_ABC(tail ? OP_TAILCALL : OP_CALL, dst, 0, argc));
+}
+
+/* Returns 1 if the expression was a call compiled in tail position. */
+static int _compile_expr(
+		struct _lair_compiler *c,
+		const struct _lair_ast **cursor,
+		const int dst,
+		const int tail) {
+	const struct _lair_ast *n = *cursor;
+	int returned = 0;
+	*cursor = n->next;
+
+	struct _lair_type atom;
+	_atom_of(c, n, &atom);
+
+	switch (atom.type) {
+		case LR_CALL: {
+			const struct _lair_ast *callee = *cursor;
+			if (_is_line_end(callee))
+				throw_exception(c->r, ERR_SYNTAX, "Nothing to call.");
+			*cursor = callee->next;
+
+			struct _lair_type callee_atom;
+			_atom_of(c, callee, &callee_atom);
+			if (callee_atom.type != LR_ATOM)
+				_syntax_error(c, "Cannot call a non-function: %s", _friendly_enum(callee_atom.type));
+			_compile_call(c, callee_atom.sym, cursor, dst, tail);
+			returned = tail;
+			break;
+		}
+		case LR_ATOM: {
+			NAME_KIND kind = NAME_GLOBAL;
+			_resolve(c, atom.sym, &kind);
+			if (_is_operator_name(atom.value.str) &&
+					(kind == NAME_FUNCTION || kind == NAME_BUILTIN)) {
+				_compile_call(c, atom.sym, cursor, dst, tail);
+				returned = tail;
+			} else {
+				_compile_name(c, atom.sym, dst);
+			}
+			break;
+		}
+		case LR_NUM:
+		case LR_STRING:
+			_use_reg(c, dst);
+			_emit(c, LR_ABX(OP_LOADK, dst, _add_constant(c, &atom)));
+			break;
+		default:
+			_syntax_error(c, "Unexpected %s in expression.", _friendly_enum(atom.type));
+	}
+
+	return returned;
+}
+
+/* Compiles one line that isn't an if statement. Returns the register holding
+ * the value of the line, or -1 if the line returns on its own. `tail` is set
+ * when the line is the last thing the function will do.
+ */
+static int _compile_statement(
+		struct _lair_compiler *c,
+		const struct _line *line,
+		const int base,
+		const int tail) {
+	const struct _lair_ast *cursor = line->start;
+	int reg = base;
+
+	struct _lair_type head;
+	_atom_of(c, cursor, &head);
+
+	if (head.type == LR_RETURN) {
+		reg = -1;
+		cursor = cursor->next;
+		if (_is_line_end(cursor))
+			_emit(c, LR_ABC(OP_RETNIL, 0, 0, 0));
+		else if (!_compile_expr(c, &cursor, base, 1))
+			_emit(c, LR_ABC(OP_RET, base, 0, 0));
+	} else if (head.type == LR_ATOM && !_is_line_end(cursor->next) &&
+			cursor->next->atom.type == LR_RETURN) {
+		/* Something like `name : value`. */
+		cursor = cursor->next->next;
+		if (_is_line_end(cursor))
+			_syntax_error(c, "Nothing to bind to %s.", head.value.str);
+
+		_compile_expr(c, &cursor, base, 0);
+		if (c->in_main)
+			_emit(c, LR_ABX(OP_SETGLOBAL, base, _global_slot(c, head.sym)));
+		else
+			_emit(c, LR_ABC(OP_SETLOCAL, c->slots[head.sym], base, 0));
+		c->bound[head.sym] = 1;
+	} else if (head.type == LR_ATOM || head.type == LR_FUNCTION_DEF) {
+		/* Whatever starts a line gets called. */
+		const struct _lair_ast *args = cursor->next;
+		_compile_call(c, head.sym, &args, base, tail);
+		if (tail)
+			reg = -1;
+	} else if (_compile_expr(c, &cursor, base, tail)) {
+		reg = -1;
+	}
+
+	return reg;
+}
+
+/* Compiles lines [from, to) and returns the index of the first line it didn't
+ * compile.
+ */
+static size_t _compile_block(
+		struct _lair_compiler *c,
+		const struct _line *lines,
+		const size_t from,
+		const size_t to,
+		const int base,
+		const int returns_last) {
+	size_t i = from;
+	while (i < to) {
+		const struct _line *line = &lines[i];
+
+		if (line->start->atom.type == LR_IF) {
+			/* Everything indented further than the '?' is the 'true' branch. */
+			size_t block_end = i + 1;
+			while (block_end < to && lines[block_end].indent > line->indent)
+				block_end++;
+
+			const struct _lair_ast *cursor = line->start->next;
+			if (_is_line_end(cursor))
+				throw_exception(c->r, ERR_SYNTAX, "No condition on if statement.");
+			if (block_end == i + 1)
+				throw_exception(c->r, ERR_SYNTAX, "No 'true' branch on if statement.");
+
+			_compile_expr(c, &cursor, base, 0);
+			const size_t jump = _emit(c, LR_ABX(OP_JMPF, base, 0));
+			_compile_block(c, lines, i + 1, block_end, base,
+					returns_last && block_end == to);
+
+			const size_t offset = c->program->code->count - (jump + 1);
+			if (offset > LR_SBX_BIAS)
+				throw_exception(c->r, ERR_SYNTAX, "Branch is too large to jump over.");
+			*_instruction_at(c, jump) = LR_ABX(OP_JMPF, base, offset + LR_SBX_BIAS);
+			i = block_end;
+			continue;
+		}
+
+		const int last = returns_last && i + 1 == to;
+		const int reg = _compile_statement(c, line, base, last);
+		if (last && reg != -1)
+			_emit(c, LR_ABC(OP_RET, reg, 0, 0));
+		i++;
+	}
+
+	return i;
+}
+
+/* Gives a local a register, if it doesn't have one already. */
+static void _declare_local(struct _lair_compiler *c, struct _lair_proto *proto, const _lair_sym sym) {
+	if (c->slots[sym] != -1)
+		return;
+	_use_reg(c, proto->nlocals);
+	c->slots[sym] = proto->nlocals++;
+	vector_append(c->program->locals, &sym, sizeof(sym));
+}
+
+static void _compile_function(struct _lair_compiler *c, const struct _global_def *def) {
+	const struct _lair_ast *form = def->form;
+	c->nregs = def->argc;
+
+	struct _lair_proto *proto = _proto_at(c, def->proto);
+	proto->entry = c->program->code->count;
+	proto->locals = c->program->locals->count;
+
+	/* The caller leaves the arguments in our first registers, so that's where
+	 * the parameters live.
+	 */
+	const struct _lair_ast *param = form->next;
+	int i;
+	for (i = 0; i < def->argc; i++, param = param->next) {
+		const _lair_sym sym = param->atom.sym;
+		if (sym == LR_NO_SYM)
+			_syntax_error(c, "Parameter has to be a name, not %s.", _friendly_enum(param->atom.type));
+		if (c->slots[sym] != -1)
+			_syntax_error(c, "Duplicate parameter name: %s", param->atom.value.str);
+		_declare_local(c, proto, sym);
+		c->bound[sym] = 1;
+	}
+
+	/* Chop the body up into lines, and give everything the body binds a
+	 * register after the parameters. Temporaries go after those.
+	 */
+	vector *lines = vector_new(sizeof(struct _line), 16);
+	const struct _lair_ast *n = param;
+	while (n != NULL && n->atom.type == LR_INDENT) {
+		struct _line line = {
+			.indent = n->indent_level,
+			.start = n->next,
+			.end = NULL
+		};
+		n = n->next;
+		while (!_is_line_end(n))
+			n = n->next;
+		line.end = n;
+		if (line.start == line.end)
+			continue;
+
+		vector_append(lines, &line, sizeof(line));
+		if (line.start->atom.type == LR_ATOM && !_is_line_end(line.start->next) &&
+				line.start->next->atom.type == LR_RETURN)
+			_declare_local(c, proto, line.start->atom.sym);
+	}
+
+	const int base = proto->nlocals;
+	_compile_block(c, (const struct _line *)lines->items, 0, lines->count, base, 1);
+	_emit(c, LR_ABC(OP_RETNIL, 0, 0, 0));
+
+	proto = _proto_at(c, def->proto);
+	proto->nregs = c->nregs;
+
+	/* Forget this function's locals. */
+	const _lair_sym *locals = vector_get(c->program->locals, proto->locals);
+	for (i = 0; i < proto->nlocals; i++) {
+		c->slots[locals[i]] = -1;
+		c->bound[locals[i]] = 0;
+	}
+	vector_free(lines);
+}
+
+static int _is_definition(struct _lair_compiler *c, const struct _lair_ast *form) {
+	if (form->atom.type != LR_FUNCTION_DEF)
+		return 0;
+	return c->globals[form->atom.sym].form == form;
+}
+
+struct _lair_program *_lair_compile(
+		struct _lair_runtime *r,
+		const struct _lair_ast *root,
+		const struct _lair_env *env) {
+	check(r, root != NULL, ERR_PARSE, "No AST to compile.");
+
+	struct _lair_program *program = calloc(1, sizeof(struct _lair_program));
+	program->code = vector_new(sizeof(uint32_t), 256);
+	program->constants = vector_new(sizeof(struct _lair_type), 64);
+	program->protos = vector_new(sizeof(struct _lair_proto), 16);
+	program->locals = vector_new(sizeof(_lair_sym), 64);
+	program->globals = vector_new(sizeof(_lair_sym), 16);
+	/* Syntax errors throw, so the program hangs off the runtime to get freed
+	 * if we die half way, and what we only need while compiling comes from
+	 * the arena the AST lives in.
+	 */
+	r->program = program;
+
+	/* Everything we'll ever name has been interned by now, except main. */
+	const _lair_sym main_sym = _lair_intern(r, "main", strlen("main"));
+	const size_t nsyms = _lair_symbol_count(r);
+
+	struct _lair_compiler c = {
+		.r = r,
+		.program = program,
+		.env = env,
+		.nsyms = nsyms,
+		.globals = _lair_arena_alloc(r, r->arena, nsyms * sizeof(struct _global_def)),
+		.functions = _lair_arena_alloc(r, r->arena, nsyms * sizeof(int)),
+		.global_slots = _lair_arena_alloc(r, r->arena, nsyms * sizeof(int)),
+		.slots = _lair_arena_alloc(r, r->arena, nsyms * sizeof(int)),
+		.bound = _lair_arena_alloc(r, r->arena, nsyms * sizeof(unsigned char)),
+		.in_main = 0,
+		.nregs = 0
+	};
+
+	size_t sym;
+	for (sym = 0; sym < nsyms; sym++) {
+		c.functions[sym] = -1;
+		c.global_slots[sym] = -1;
+		c.slots[sym] = -1;
+	}
+
+	/* First pass: find every definition, so calls know how many arguments
+	 * things take. A top-level name that's already defined is a call, same as
+	 * it ever was.
+	 */
+	const struct _lair_ast *form = NULL;
+	for (form = root->children; form != NULL; form = form->sibling) {
+		if (form->atom.type != LR_FUNCTION_DEF)
+			continue;
+
+		const _lair_sym name = form->atom.sym;
+		NAME_KIND kind = NAME_GLOBAL;
+		_resolve(&c, name, &kind);
+		if (kind != NAME_GLOBAL)
+			continue;
+
+		int argc = 0;
+		const struct _lair_ast *param = form->next;
+		while (!_is_line_end(param)) {
+			argc++;
+			param = param->next;
+		}
+
+		const struct _global_def def = {
+			.form = form,
+			.proto = _add_proto(&c, name, argc, NULL),
+			.argc = argc
+		};
+		c.globals[name] = def;
+	}
+
+	/* Second pass: function bodies. */
+	for (form = root->children; form != NULL; form = form->sibling) {
+		if (!_is_definition(&c, form))
+			continue;
+		_compile_function(&c, &c.globals[form->atom.sym]);
+	}
+
+	/* Last pass: the top-level code, which runs in order. Definitions have
+	 * all been taken care of.
+	 */
+	program->main = _add_proto(&c, main_sym, 0, NULL);
+	_proto_at(&c, program->main)->entry = program->code->count;
+	c.nregs = 0;
+	c.in_main = 1;
+
+	for (form = root->children; form != NULL; form = form->sibling) {
+		if (_is_definition(&c, form))
+			continue;
+
+		const struct _lair_ast *end = form;
+		while (!_is_line_end(end->next))
+			end = end->next;
+		const struct _line line = {
+			.indent = 0,
+			.start = form,
+			.end = end->next
+		};
+		_compile_statement(&c, &line, 0, 0);
+	}
+	_emit(&c, LR_ABC(OP_RETNIL, 0, 0, 0));
+	_proto_at(&c, program->main)->nregs = c.nregs;
+
+	return program;
+}
+
+/* For sorting prototypes by where their code starts. */
+struct _span {
+	size_t entry;
+	size_t proto;
+};
+
+static int _by_entry(const void *a, const void *b) {
+	const struct _span *x = a;
+	const struct _span *y = b;
+	return (x->entry > y->entry) - (x->entry < y->entry);
+}
+
+/* Builtins are pure unless they do I/O. Den functions start out pure and stop
+ * being so once they call something that isn't, or something we can't know
+ * about until runtime, until nothing changes. So functions that only call each
+ * other stay pure.
+ */
+void _lair_find_pure(const struct _lair_program *program, unsigned char *pure, const int globals) {
+	const struct _lair_proto *protos = (const struct _lair_proto *)program->protos->items;
+	const uint32_t *code = (const uint32_t *)program->code->items;
+	const size_t nprotos = program->protos->count;
+	struct _span *spans = calloc(nprotos + 1, sizeof(struct _span));
+	size_t *ends = calloc(nprotos + 1, sizeof(size_t));
+	size_t nspans = 0;
+	size_t p, s;
+
+	for (p = 0; p < nprotos; p++) {
+		if (protos[p].builtin != NULL) {
+			pure[p] = !protos[p].builtin->io;
+			continue;
+		}
+		pure[p] = 1;
+		spans[nspans].entry = protos[p].entry;
+		spans[nspans].proto = p;
+		nspans++;
+	}
+
+	/* The compiler lays functions out one after the other, so each one ends
+	 * where the next one starts.
+	 */
+	qsort(spans, nspans, sizeof(struct _span), _by_entry);
+	for (s = 0; s < nspans; s++)
+		ends[spans[s].proto] = s + 1 < nspans ? spans[s + 1].entry : program->code->count;
+
+	int changed = 1;
+	while (changed) {
+		changed = 0;
+		for (s = 0; s < nspans; s++) {
+			p = spans[s].proto;
+			if (!pure[p])
+				continue;
+
+			size_t pc;
+			for (pc = protos[p].entry; pc < ends[p] && pure[p]; pc++) {
+				const uint32_t i = code[pc];
+				switch (LR_OP(i)) {
+					case OP_CALL:
+					case OP_TAILCALL:
+					case OP_SETGLOBAL:
+						pure[p] = 0;
+						break;
+					case OP_GETGLOBAL:
+						if (!globals)
+							pure[p] = 0;
+						break;
+					case OP_CALLK:
+					case OP_FORKK:
+					case OP_TAILCALLK:
+						pure[p] = pure[LR_BX(i)];
+						break;
+					default:
+						break;
+				}
+			}
+			changed |= !pure[p];
+		}
+	}
+
+	free(spans);
+	free(ends);
+}
+
+const char *_lair_op_name(const LAIR_OPCODE op) {
+	switch (op) {
+		case OP_LOADK:		return "LOADK";
+		case OP_GETLOCAL:	return "GETLOCAL";
+		case OP_SETLOCAL:	return "SETLOCAL";
+		case OP_GETGLOBAL:	return "GETGLOBAL";
+		case OP_SETGLOBAL:	return "SETGLOBAL";
+		case OP_CALL:		return "CALL";
+		case OP_TAILCALL:	return "TAILCALL";
+		case OP_CALLK:		return "CALLK";
+		case OP_TAILCALLK:	return "TAILCALLK";
+		case OP_JMPF:		return "JMPF";
+		case OP_RET:		return "RET";
+		case OP_RETNIL:		return "RETNIL";
+		case OP_FORKK:		return "FORKK";
+		case OP_JOIN:		return "JOIN";
+		case OP_PCALL:		return "PCALL";
+		case OP_PTAILCALL:	return "PTAILCALL";
+		case OP_PCALLK:		return "PCALLK";
+		case OP_PTAILCALLK:	return "PTAILCALLK";
+		case OP_PRET:		return "PRET";
+		case OP_PRETNIL:	return "PRETNIL";
+		default:			return "ERR";
+	}
+}
+
+void lair_print_program(const struct _lair_runtime *r, const struct _lair_program *program) {
+	const uint32_t *code = (const uint32_t *)program->code->items;
+	const struct _lair_type *k = (const struct _lair_type *)program->constants->items;
+	const struct _lair_proto *protos = (const struct _lair_proto *)program->protos->items;
+	const _lair_sym *locals = (const _lair_sym *)program->locals->items;
+	const _lair_sym *globals = (const _lair_sym *)program->globals->items;
+
+	/* Builtins don't have any code, and everything else is in order. */
+	size_t p;
+	for (p = 0; p < program->protos->count; p++) {
+		const struct _lair_proto *proto = &protos[p];
+		if (proto->builtin != NULL)
+			continue;
+
+		size_t end = program->code->count;
+		size_t q;
+		for (q = p + 1; q < program->protos->count; q++) {
+			if (protos[q].builtin == NULL) {
+				end = protos[q].entry;
+				break;
+			}
+		}
+		printf("FUNCTION %s (args: %i, locals: %i, regs: %i)\n",
+				proto->name, proto->argc, proto->nlocals, proto->nregs);
+
+		size_t pc;
+		for (pc = proto->entry; pc < end; pc++) {
+			const uint32_t i = code[pc];
+			const LAIR_OPCODE op = LR_OP(i);
+			printf("    %04zu %-9s ", pc, _lair_op_name(op));
+			switch (op) {
+				case OP_LOADK: {
+					const struct _lair_type *c = &k[LR_BX(i)];
+					if (c->type == LR_NUM)
+						printf("%i %i\t; %i\n", LR_A(i), LR_BX(i), c->value.num);
+					else
+						printf("%i %i\t; %s\n", LR_A(i), LR_BX(i), c->value.str);
+					break;
+				}
+				case OP_GETLOCAL:
+					printf("%i %i\t; %s\n", LR_A(i), LR_B(i), _lair_symbol_name(r, locals[proto->locals + LR_B(i)]));
+					break;
+				case OP_SETLOCAL:
+					printf("%i %i\t; %s\n", LR_A(i), LR_B(i), _lair_symbol_name(r, locals[proto->locals + LR_A(i)]));
+					break;
+				case OP_GETGLOBAL:
+				case OP_SETGLOBAL:
+					printf("%i %i\t; %s\n", LR_A(i), LR_BX(i), _lair_symbol_name(r, globals[LR_BX(i)]));
+					break;
+				case OP_CALL:
+				case OP_TAILCALL:
+					printf("%i %i\n", LR_A(i), LR_C(i));
+					break;
+				case OP_CALLK:
+				case OP_TAILCALLK:
+				case OP_FORKK:
+					printf("%i %i\t; %s\n", LR_A(i), LR_BX(i), protos[LR_BX(i)].name);
+					break;
+				case OP_JMPF:
+					printf("%i %i\t; to %zu\n", LR_A(i), LR_SBX(i), pc + 1 + LR_SBX(i));
+					break;
+				case OP_RET:
+				case OP_JOIN:
+					printf("%i\n", LR_A(i));
+					break;
+				default:
+					printf("\n");
+			}
+		}
+	}
+	printf("---\n");
+}
+
+void _lair_free_program(struct _lair_program *program) {
+	if (program == NULL)
+		return;
+
+	/* A program from the cache has its code and strings in the file. */
+	size_t i;
+	for (i = 0; program->mapping == NULL && i < program->constants->count; i++) {
+		const struct _lair_type *k = vector_get(program->constants, i);
+		if (k->sym == LR_NO_SYM && k->type != LR_NUM && k->type != LR_BOOL)
+			free(k->value.str);
+	}
+
+	if (program->mapping != NULL)
+		free(program->code);
+	else
+		vector_free(program->code);
+	vector_free(program->constants);
+	vector_free(program->protos);
+	vector_free(program->locals);
+	vector_free(program->globals);
+	if (program->mapping != NULL)
+		munmap(program->mapping, program->mapping_len);
+	free(program);
+}
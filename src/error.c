@@ -40,10 +40,14 @@ void error_and_die(const ERROR_TYPE err_type, const char *msg) {
 }
 
 void print_error(const ERROR_TYPE err_type, const char *msg) {
+	fprint_error(stdout, err_type, msg);
+}
+
+void fprint_error(FILE *out, const ERROR_TYPE err_type, const char *msg) {
 	const char *friendly_err = _friendly_err(err_type);
 	char buf[256] = {0};
 
 	snprintf(buf, sizeof(buf), "%c[%dm%s%c[%dm", 0x1B, 31, friendly_err, 0x1B, 0x0);
 	snprintf(buf + strlen(buf), sizeof(buf), ": %s\n", msg);
-	printf("%s", buf);
+	fprintf(out, "%s", buf);
 }
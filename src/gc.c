@@ -1 +1,255 @@
+// vim: noet ts=4 sw=4
+#include <string.h>
+
+#include "collections.h"
+#include "compile.h"
+#include "error.h"
+#include "eval.h"
 #include "gc.h"
+#include "lair.h"
+#include "map.h"
+#include "memo.h"
+#include "memory.h"
+#include "parse.h"
+#include "rope.h"
+#include "vector.h"
+#include "vm.h"
+
+#define _node_of(V)		(((struct _lair_gc_node *)(V)) - 1)
+
+struct _lair_gc *_lair_gc_new() {
+	struct _lair_gc *gc = calloc(1, sizeof(struct _lair_gc));
+	gc->threshold = LAIR_GC_INITIAL_THRESHOLD;
+	gc->gray = vector_new(sizeof(_lair_val), 64);
+	return gc;
+}
+
+struct _lair_type *_lair_gc_alloc(struct _lair_runtime *r, const LAIR_TOKEN type, const size_t extra) {
+	struct _lair_gc *gc = r->gc;
+	if (gc->allocated >= gc->threshold && gc->paused == 0)
+		_lair_gc_collect(r);
+
+	const size_t size = sizeof(struct _lair_gc_node) + sizeof(struct _lair_type) + extra;
+	struct _lair_gc_node *node = calloc(1, size);
+	check(r, node != NULL, ERR_RUNTIME, "Out of memory.");
+	node->size = size;
+	node->next = gc->objects;
+	gc->objects = node;
+	gc->allocated += size;
+	gc->allocs++;
+	gc->total_bytes += size;
+
+	/* Charge it to whatever's running. */
+	node->category = _lair_mem_category_of(type);
+	_lair_mem_alloc(r->memory, node->category, size);
+	const struct _lair_vm *vm = r->vm;
+	if (vm != NULL && vm->depth > 0) {
+		node->site = vm->frames[vm->depth - 1].proto - vm->protos;
+		r->memory->site_live[node->site] += size;
+		r->memory->site_total[node->site] += size;
+	} else {
+		node->site = LR_NO_SITE;
+	}
+
+	struct _lair_type *value = (struct _lair_type *)(node + 1);
+	value->type = type;
+	value->managed = 1;
+	return value;
+}
+
+struct _lair_type *_lair_gc_string(struct _lair_runtime *r, const size_t len) {
+	struct _lair_type *value = _lair_gc_alloc(r, LR_STRING, len + 1);
+	value->value.str = (char *)(value + 1);
+	return value;
+}
+
+_lair_val _lair_gc_num(struct _lair_runtime *r, const int num) {
+	if (LR_FITS_INT(num))
+		return LR_INT(num);
+
+	struct _lair_type *boxed = _lair_gc_alloc(r, LR_NUM, 0);
+	boxed->value.num = num;
+	return LR_BOX(boxed);
+}
+
+static inline void _mark_value(struct _lair_runtime *r, const _lair_val value) {
+	if (!LR_IS_BOXED(value) || !LR_UNBOX(value)->managed)
+		return;
+
+	struct _lair_gc_node *node = _node_of(LR_UNBOX(value));
+	if (node->marked)
+		return;
+	node->marked = 1;
+
+	/* Anything that points at other values gets traced later. */
+	switch (LR_UNBOX(value)->type) {
+		case LR_ROPE:
+		case LR_VECTOR:
+		case LR_MAP:
+		case LR_NODE: {
+			const int rc = vector_append(r->gc->gray, &value, sizeof(value));
+			check(r, rc == 1, ERR_RUNTIME, "Out of memory collecting garbage.");
+			break;
+		}
+		default:
+			break;
+	}
+}
+
+static void _trace(struct _lair_runtime *r) {
+	vector *gray = r->gc->gray;
+	while (gray->count > 0) {
+		gray->count--;
+		const _lair_val value = *(const _lair_val *)vector_get(gray, gray->count);
+
+		const struct _lair_type *t = LR_UNBOX(value);
+		switch (t->type) {
+			case LR_ROPE:
+				_mark_value(r, t->value.rope->left);
+				_mark_value(r, t->value.rope->right);
+				_mark_value(r, t->value.rope->flat);
+				break;
+			case LR_VECTOR:
+				_mark_value(r, t->value.vector->root);
+				_mark_value(r, t->value.vector->tail);
+				break;
+			case LR_MAP:
+				_mark_value(r, t->value.map->root);
+				break;
+			case LR_NODE: {
+				/* Numbers, nils and constants in the slots are skipped by
+				 * `_mark_value` itself.
+				 */
+				const struct _lair_node *node = t->value.node;
+				uint32_t i;
+				for (i = 0; i < node->size; i++)
+					_mark_value(r, node->slots[i]);
+				break;
+			}
+			default:
+				break;
+		}
+	}
+}
+
+static void _mark_roots(struct _lair_runtime *r) {
+	const struct _lair_vm *vm = r->vm;
+	size_t i;
+	if (vm != NULL && vm->depth > 0) {
+		/* Registers above the top frame are garbage left by returned calls. */
+		const struct _lair_frame *top = &vm->frames[vm->depth - 1];
+		const size_t live_regs = top->base + top->proto->nregs;
+		for (i = 0; i < live_regs; i++)
+			_mark_value(r, vm->regs[i]);
+	}
+
+	if (vm != NULL)
+		for (i = 0; i < vm->nglobals; i++)
+			_mark_value(r, vm->globals[i]);
+
+	const struct _lair_gc_held *held;
+	for (held = r->gc->held; held != NULL; held = held->prev)
+		for (i = 0; i < held->count; i++)
+			_mark_value(r, held->values[i]);
+
+	if (r->memo != NULL)
+		for (i = 1; i < r->memo->nentries; i++)
+			_mark_value(r, r->memo->entries[i].result);
+}
+
+static void _sweep(struct _lair_runtime *r) {
+	struct _lair_gc *gc = r->gc;
+	struct _lair_memory *m = r->memory;
+	struct _lair_gc_node **cur = &gc->objects;
+	while (*cur != NULL) {
+		struct _lair_gc_node *node = *cur;
+		if (node->marked) {
+			node->marked = 0;
+			cur = &node->next;
+		} else {
+			*cur = node->next;
+			gc->allocated -= node->size;
+			_lair_mem_free(m, node->category, node->size);
+			if (node->site != LR_NO_SITE)
+				m->site_live[node->site] -= node->size;
+			free(node);
+		}
+	}
+}
+
+void _lair_gc_collect(struct _lair_runtime *r) {
+	struct _lair_gc *gc = r->gc;
+	_mark_roots(r);
+	_trace(r);
+	_sweep(r);
+	gc->collections++;
+
+	/* Give the program room to grow before we come back. */
+	gc->threshold = gc->allocated * 2;
+	if (gc->threshold < LAIR_GC_INITIAL_THRESHOLD)
+		gc->threshold = LAIR_GC_INITIAL_THRESHOLD;
+}
+
+void _lair_gc_pause(struct _lair_runtime *r) {
+	r->gc->paused++;
+}
+
+void _lair_gc_resume(struct _lair_runtime *r) {
+	r->gc->paused--;
+}
+
+_lair_val *_lair_gc_hold(struct _lair_runtime *r, const size_t count) {
+	const size_t size = sizeof(struct _lair_gc_held) + count * sizeof(_lair_val);
+	struct _lair_gc_held *held = calloc(1, size);
+	check(r, held != NULL, ERR_RUNTIME, "Out of memory.");
+	held->count = count;
+	held->prev = r->gc->held;
+	r->gc->held = held;
+	_lair_mem_alloc(r->memory, LR_MEM_VM, size);
+	return held->values;
+}
+
+void _lair_gc_release(struct _lair_runtime *r) {
+	struct _lair_gc_held *held = r->gc->held;
+	r->gc->held = held->prev;
+	_lair_mem_free(r->memory, LR_MEM_VM, sizeof(struct _lair_gc_held) + held->count * sizeof(_lair_val));
+	free(held);
+}
+
+void _lair_gc_adopt(struct _lair_runtime *r, struct _lair_runtime *from) {
+	struct _lair_gc *gc = r->gc;
+	struct _lair_gc *other = from->gc;
+	if (other->objects != NULL) {
+		struct _lair_gc_node *last = other->objects;
+		while (last->next != NULL)
+			last = last->next;
+		last->next = gc->objects;
+		gc->objects = other->objects;
+	}
+	gc->allocated += other->allocated;
+	gc->allocs += other->allocs;
+	gc->total_bytes += other->total_bytes;
+	_lair_memory_adopt(r->memory, from->memory);
+
+	other->objects = NULL;
+	other->allocated = 0;
+}
+
+void _lair_gc_free(struct _lair_gc *gc) {
+	if (gc == NULL)
+		return;
+
+	struct _lair_gc_node *node = gc->objects;
+	while (node != NULL) {
+		struct _lair_gc_node *next = node->next;
+		free(node);
+		node = next;
+	}
+	while (gc->held != NULL) {
+		struct _lair_gc_held *prev = gc->held->prev;
+		free(gc->held);
+		gc->held = prev;
+	}
+	vector_free(gc->gray);
+	free(gc);
+}
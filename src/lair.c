@@ -2,20 +2,50 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 
+#include "arena.h"
+#include "cache.h"
+#include "compile.h"
 #include "eval.h"
 #include "error.h"
+#include "gc.h"
 #include "lair.h"
+#include "memo.h"
+#include "memory.h"
+#include "parallel.h"
 #include "parse.h"
+#include "profile.h"
+#include "stats.h"
+#include "symbol.h"
+#include "vm.h"
 
 struct _lair_runtime *_lair_runtime_start() {
 	struct _lair_runtime *new_runtime = calloc(1, sizeof(struct _lair_runtime));
+	new_runtime->memory = _lair_memory_new();
+	new_runtime->arena = _lair_arena_new();
+	new_runtime->gc = _lair_gc_new();
+	new_runtime->symbols = _lair_symbols_new();
 	return new_runtime;
 }
 
 void _lair_runtime_end(struct _lair_runtime *runtime) {
+	_lair_vm_free(runtime->vm);
+	_lair_parallel_free(runtime->parallel);
+	_lair_free_program(runtime->program);
+	if (runtime->std_env != NULL)
+		_lair_free_env(runtime->std_env);
+	_lair_gc_free(runtime->gc);
+	_lair_arena_free(runtime->arena);
+	_lair_symbols_free(runtime->symbols);
+	_lair_profile_free(runtime->profile);
+	_lair_stats_free(runtime->stats);
+	_lair_memo_free(runtime->memo);
+	_lair_memory_unwatch(runtime);
+	_lair_memory_free(runtime->memory);
+	free(runtime->exception_msg);
 	free(runtime);
 }
 
@@ -38,33 +68,116 @@ char *lair_load_file(const char *file_path, size_t *buf_size) {
 	return loaded;
 }
 
+/* Writes out the profile, if there is one. Programs that died get one too,
+ * since that's when you most want to know where they were.
+ */
+static void _report_profile(struct _lair_runtime *runtime) {
+	if (runtime->profile == NULL)
+		return;
+
+	/* Whatever the program printed goes first. */
+	fflush(runtime->options.out);
+	const char *path = runtime->profile->sampling ? runtime->options.sample_path : runtime->options.profile_path;
+	FILE *out = path == NULL ? stderr : fopen(path, "w");
+	if (out == NULL) {
+		fprint_error(runtime->options.out, ERR_RUNTIME, "Could not open the profile for writing.");
+		return;
+	}
+	_lair_profile_report(runtime, runtime->profile, out, path != NULL);
+	if (out != stderr)
+		fclose(out);
+}
+
+/* Writes out the counts, if we're keeping them. */
+static void _report_stats(struct _lair_runtime *runtime) {
+	if (runtime->stats == NULL)
+		return;
+
+	fflush(runtime->options.out);
+	const char *path = runtime->options.stats_path;
+	FILE *out = path == NULL ? stderr : fopen(path, "w");
+	if (out == NULL) {
+		fprint_error(runtime->options.out, ERR_RUNTIME, "Could not open the stats for writing.");
+		return;
+	}
+	_lair_stats_report(runtime, runtime->stats, out);
+	if (out != stderr)
+		fclose(out);
+}
+
+/* Writes out where the memory went, if anyone asked. */
+static void _report_memory(struct _lair_runtime *runtime) {
+	if (!runtime->options.memory)
+		return;
+
+	fflush(runtime->options.out);
+	const char *path = runtime->options.memory_path;
+	const int fd = path == NULL ? STDERR_FILENO : open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		fprint_error(runtime->options.out, ERR_RUNTIME, "Could not open the memory report for writing.");
+		return;
+	}
+	_lair_memory_report(runtime->memory, fd);
+	if (fd != STDERR_FILENO)
+		close(fd);
+}
+
 int lair_execute(const char *program, const size_t len) {
+	return lair_execute_with_options(program, len, NULL);
+}
+
+int lair_execute_with_options(const char *program, const size_t len, const struct lair_options *options) {
 	struct _lair_runtime *runtime = _lair_runtime_start();
+	struct _lair_token *tokens = NULL;
+	if (options != NULL)
+		runtime->options = *options;
+	if (runtime->options.out == NULL)
+		runtime->options.out = stdout;
 	if (setjmp(runtime->exception_buffer)) {
 		if (runtime->exception_msg) {
-			print_error(runtime->exception_type, runtime->exception_msg);
+			fprint_error(runtime->options.out, runtime->exception_type, runtime->exception_msg);
 		}
 		goto error;
 	}
 
-	struct _lair_token *tokens = _lair_tokenize(runtime, program, len);
-	if (tokens == NULL)
-		goto error;
+	if (runtime->options.stats)
+		runtime->stats = _lair_stats_new(runtime);
+	if (runtime->options.memory)
+		_lair_memory_watch(runtime);
+
+	/* These hang off the runtime so they get freed if the program dies. */
+	runtime->std_env = _lair_standard_env(runtime);
+	if (runtime->options.cache_dir != NULL)
+		runtime->program = _lair_cache_load(runtime, runtime->std_env, program, len);
+
+	if (runtime->program == NULL) {
+		tokens = _lair_tokenize(runtime, program, len);
+		if (tokens == NULL)
+			goto error;
 
 #ifdef DEBUG
-	lair_print_tokens(tokens);
+		lair_print_tokens(tokens);
 #endif
-	const struct _lair_ast *ast = _lair_parse_from_tokens(runtime, &tokens);
-	if (ast == NULL)
-		return 1;
+		const struct _lair_ast *ast = _lair_parse_from_tokens(runtime, &tokens);
+		if (ast == NULL)
+			goto error;
+
+		runtime->program = _lair_compile(runtime, ast, runtime->std_env);
+		if (runtime->options.cache_dir != NULL)
+			_lair_cache_store(runtime, runtime->program, program, len);
+	}
 
-	_lair_eval(runtime, ast);
-	_lair_free_tokens(tokens);
+	_lair_eval(runtime);
+	_report_profile(runtime);
+	_report_stats(runtime);
+	_report_memory(runtime);
 	_lair_runtime_end(runtime);
 	return 0;
 
 error:
-	_lair_free_tokens(tokens);
+	_report_profile(runtime);
+	_report_stats(runtime);
+	_report_memory(runtime);
 	_lair_runtime_end(runtime);
 	return 1;
 }
@@ -3,204 +3,350 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "collections.h"
 #include "error.h"
 #include "eval.h"
+#include "gc.h"
+#include "parallel.h"
 #include "parse.h"
 #include "lair_std.h"
+#include "rope.h"
+#include "vector.h"
 
-const struct _lair_type *_lair_builtin_operator_plus(LAIR_FUNCTION_SIG) {
+_lair_val _lair_builtin_operator_plus(LAIR_FUNCTION_SIG) {
 	check(r, argc == 2, ERR_RUNTIME, "Incorrect number of arguments to `+` function.");
-	check(r, argv[0] != NULL, ERR_RUNTIME, "Argument to `+` function was NULL.");
-	check(r, argv[1] != NULL, ERR_RUNTIME, "Argument to `+` function was NULL.");
-	check(r, argv[0]->type == argv[1]->type, ERR_RUNTIME, "Cannot add variables of different types together.");
+	check(r, argv[0] != LR_NIL, ERR_RUNTIME, "Argument to `+` function was NULL.");
+	check(r, argv[1] != LR_NIL, ERR_RUNTIME, "Argument to `+` function was NULL.");
+
+	/* The common case: two small numbers, nothing to look up or allocate. */
+	if (LR_IS_INT(argv[0] & argv[1]))
+		return _lair_gc_num(r, LR_INT_VALUE(argv[0]) + LR_INT_VALUE(argv[1]));
+
+	check(r, _lair_type_of(argv[0]) == _lair_type_of(argv[1]), ERR_RUNTIME, "Cannot add variables of different types together.");
 
 	/* We already know (probably) that the types are the same. */
-	const LAIR_TOKEN first_arg_type = argv[0]->type;
+	const LAIR_TOKEN first_arg_type = _lair_type_of(argv[0]);
 	switch (first_arg_type) {
 		/* Integer addition. */
-		case LR_NUM: {
-			struct _lair_type _stack = {
-				.type = LR_NUM,
-				.value = {
-					.num = argv[0]->value.num + argv[1]->value.num
-				}
-			};
-			struct _lair_type *to_return = calloc(1, sizeof(struct _lair_type));
-			memcpy(to_return, &_stack, sizeof(struct _lair_type));
-			return to_return;
-		}
-		/* Append two strings together. */
-		case LR_STRING: {
-			const char *str0 = argv[0]->value.str;
-			const char *str1 = argv[1]->value.str;
-			const size_t str_siz = strlen(str0) + strlen(str1);
-
-			struct _lair_type _stack = {
-				.type = LR_STRING,
-				.value = {
-					.str = calloc(1, str_siz)
-				}
-			};
-
-			struct _lair_type *to_return = calloc(1, sizeof(struct _lair_type) + 1);
-			memcpy(_stack.value.str, str0, strlen(str0));
-			memcpy(_stack.value.str + strlen(str0), str1, strlen(str1));
-			memcpy(to_return, &_stack, sizeof(struct _lair_type));
-
-			return to_return;
-		}
+		case LR_NUM:
+			return _lair_gc_num(r, _lair_num_of(argv[0]) + _lair_num_of(argv[1]));
+		/* Append two strings together. Long ones don't get copied. */
+		case LR_STRING:
+			return _lair_string_concat(r, argv[0], argv[1]);
 		default:
 			throw_exception(r, ERR_RUNTIME, "Don't know how to add these things together.");
 	}
-	return NULL;
+	return LR_NIL;
 }
 
-const struct _lair_type *_lair_builtin_operator_minus(LAIR_FUNCTION_SIG) {
+_lair_val _lair_builtin_operator_minus(LAIR_FUNCTION_SIG) {
 	check(r, argc == 2, ERR_RUNTIME, "Incorrect number of arguments to `-` function.");
-	check(r, argv[0] != NULL, ERR_RUNTIME, "Argument to `-` function was NULL.");
-	check(r, argv[1] != NULL, ERR_RUNTIME, "Argument to `-` function was NULL.");
-	check(r, argv[0]->type == argv[1]->type, ERR_RUNTIME, "Cannot add variables of different types together.");
-	check(r, argv[0]->type != LR_STRING, ERR_RUNTIME, "Cannot subtract strings");
-	check(r, argv[1]->type != LR_STRING, ERR_RUNTIME, "Cannot subtract strings");
+	check(r, argv[0] != LR_NIL, ERR_RUNTIME, "Argument to `-` function was NULL.");
+	check(r, argv[1] != LR_NIL, ERR_RUNTIME, "Argument to `-` function was NULL.");
+
+	if (LR_IS_INT(argv[0] & argv[1]))
+		return _lair_gc_num(r, LR_INT_VALUE(argv[0]) - LR_INT_VALUE(argv[1]));
+
+	const LAIR_TOKEN first_arg_type = _lair_type_of(argv[0]);
+	const LAIR_TOKEN second_arg_type = _lair_type_of(argv[1]);
+	check(r, first_arg_type == second_arg_type, ERR_RUNTIME, "Cannot add variables of different types together.");
+	check(r, first_arg_type != LR_STRING, ERR_RUNTIME, "Cannot subtract strings");
+	check(r, second_arg_type != LR_STRING, ERR_RUNTIME, "Cannot subtract strings");
 
 	/* We already know (probably) that the types are the same. */
-	const LAIR_TOKEN first_arg_type = argv[0]->type;
 	switch (first_arg_type) {
 		/* Integer addition. */
-		case LR_NUM: {
-			struct _lair_type _stack = {
-				.type = LR_NUM,
-				.value = {
-					.num = argv[0]->value.num - argv[1]->value.num
-				}
-			};
-			struct _lair_type *to_return = calloc(1, sizeof(struct _lair_type));
-			memcpy(to_return, &_stack, sizeof(struct _lair_type));
-			return to_return;
-		}
+		case LR_NUM:
+			return _lair_gc_num(r, _lair_num_of(argv[0]) - _lair_num_of(argv[1]));
 		default:
 			throw_exception(r, ERR_RUNTIME, "Don't know how to subtract these things.");
 	}
-	return NULL;
+	return LR_NIL;
 }
 
-const struct _lair_type *_lair_builtin_operator_eq(LAIR_FUNCTION_SIG) {
+_lair_val _lair_builtin_operator_eq(LAIR_FUNCTION_SIG) {
 	check(r, argc == 2, ERR_RUNTIME, "Incorrect number of arguments to `=` function.");
-	check(r, argv[0] != NULL, ERR_RUNTIME, "Argument to `=` function was NULL.");
-	check(r, argv[1] != NULL, ERR_RUNTIME, "Argument to `=` function was NULL.");
-	check(r, argv[0]->type == argv[1]->type, ERR_RUNTIME, "Cannot compare disparate types.");
+	check(r, argv[0] != LR_NIL, ERR_RUNTIME, "Argument to `=` function was NULL.");
+	check(r, argv[1] != LR_NIL, ERR_RUNTIME, "Argument to `=` function was NULL.");
+
+	/* Small numbers and booleans are equal exactly when their words are. */
+	if (LR_IS_INT(argv[0] & argv[1]) || (LR_IS_BOOL(argv[0]) && LR_IS_BOOL(argv[1])))
+		return LR_BOOL(argv[0] == argv[1]);
+
+	const LAIR_TOKEN first_arg_type = _lair_type_of(argv[0]);
+	check(r, first_arg_type == _lair_type_of(argv[1]), ERR_RUNTIME, "Cannot compare disparate types.");
 
-	const LAIR_TOKEN first_arg_type = argv[0]->type;
 	switch (first_arg_type) {
-		case LR_BOOL:
-			if (argv[0]->value.bool == argv[1]->value.bool)
-				return _lair_canonical_true();
-			return _lair_canonical_false();
 		case LR_NUM:
-			if (argv[0]->value.num == argv[1]->value.num)
-				return _lair_canonical_true();
-			return _lair_canonical_false();
+			return LR_BOOL(_lair_num_of(argv[0]) == _lair_num_of(argv[1]));
 		case LR_STRING: {
-			const char *str0 = argv[0]->value.str;
-			const char *str1 = argv[1]->value.str;
-			const size_t str_siz = strlen(str0) + strlen(str1);
-			if (strncmp(str0, str1, str_siz) == 0)
-				return _lair_canonical_true();
-			return _lair_canonical_false();
+			const size_t len = _lair_string_len(argv[0]);
+			if (len != _lair_string_len(argv[1]))
+				return LR_FALSE;
+			const char *str0 = _lair_string_bytes(r, argv[0]);
+			const char *str1 = _lair_string_bytes(r, argv[1]);
+			return LR_BOOL(memcmp(str0, str1, len) == 0);
 		}
 		default:
 			throw_exception(r, ERR_RUNTIME, "Don't know how to compare these two things.");
 	}
-	return NULL;
+	return LR_NIL;
 }
 
-const struct _lair_type *_lair_builtin_print(LAIR_FUNCTION_SIG) {
-	check(r, argc == 1, ERR_RUNTIME, "Incorrect number of arguments to 'print' function.");
-
-	if (argv[0] == NULL) {
-		printf("(null)");
-		return NULL;
-	}
+/* Writes a human-readable version of `v` into `buf`, or returns a string that
+ * already holds one.
+ */
+static const char *_to_string(struct _lair_runtime *r, const _lair_val v, char *buf, const size_t siz) {
+	if (v == LR_NIL)
+		return "(null)";
 
-	switch (argv[0]->type) {
+	const LAIR_TOKEN type = _lair_type_of(v);
+	switch (type) {
 	case LR_STRING:
-		printf("%s", argv[0]->value.str);
-		break;
+		return _lair_string_bytes(r, v);
 	case LR_NUM:
-		printf("%i", argv[0]->value.num);
+		snprintf(buf, siz, "%i", _lair_num_of(v));
+		break;
+	case LR_BOOL:
+		snprintf(buf, siz, "<%s: %s>", _friendly_enum(type), v == LR_TRUE ? "true" : "false");
 		break;
 	case LR_FUNCTION_DEF:
 	case LR_FUNCTION_CALL:
-		printf("<%s!: %s>", _friendly_enum(argv[0]->type), argv[0]->value.str);
+		snprintf(buf, siz, "<%s: %s>", _friendly_enum(type), _lair_str_of(v));
 		break;
 	default:
-		printf("<%s: %p>", _friendly_enum(argv[0]->type), argv[0]);
+		snprintf(buf, siz, "<%s: %p>", _friendly_enum(type), (void *)v);
 		break;
 	}
+	return buf;
+}
+
+static void _write(vector *out, const char *str, const size_t len) {
+	size_t i;
+	for (i = 0; i < len; i++)
+		vector_append(out, &str[i], sizeof(char));
+}
+
+static void _write_value(struct _lair_runtime *r, vector *out, const _lair_val v, const int quoted);
+
+struct _write_ctx {
+	struct _lair_runtime *r;
+	vector *out;
+	int first;
+};
+
+static void _write_pair(const _lair_val key, const _lair_val value, void *ctx) {
+	struct _write_ctx *w = ctx;
+	if (!w->first)
+		_write(w->out, ", ", 2);
+	w->first = 0;
+	_write_value(w->r, w->out, key, 1);
+	_write(w->out, ": ", 2);
+	_write_value(w->r, w->out, value, 1);
+}
+
+/* Like `_to_string`, but collections too. Strings inside a collection get
+ * quotes so you can tell `["1"]` from `[1]`.
+ */
+static void _write_value(struct _lair_runtime *r, vector *out, const _lair_val v, const int quoted) {
+	const LAIR_TOKEN type = _lair_type_of(v);
+	if (type == LR_VECTOR) {
+		const struct _lair_vector *vec = LR_UNBOX(v)->value.vector;
+		_write(out, "[", 1);
+		size_t i;
+		for (i = 0; i < vec->count; i++) {
+			if (i > 0)
+				_write(out, ", ", 2);
+			_write_value(r, out, _lair_vector_get(vec, i), 1);
+		}
+		_write(out, "]", 1);
+	} else if (type == LR_MAP) {
+		struct _write_ctx ctx = { .r = r, .out = out, .first = 1 };
+		_write(out, "{", 1);
+		_lair_map_each(LR_UNBOX(v)->value.map, &_write_pair, &ctx);
+		_write(out, "}", 1);
+	} else if (type == LR_STRING && quoted) {
+		_write(out, "\"", 1);
+		_write(out, _lair_string_bytes(r, v), _lair_string_len(v));
+		_write(out, "\"", 1);
+	} else {
+		char buf[512] = {0};
+		const char *str = _to_string(r, v, buf, sizeof(buf));
+		_write(out, str, strlen(str));
+	}
+}
+
+static inline int _is_collection(const _lair_val v) {
+	const LAIR_TOKEN type = _lair_type_of(v);
+	return type == LR_VECTOR || type == LR_MAP;
+}
+
+_lair_val _lair_builtin_print(LAIR_FUNCTION_SIG) {
+	check(r, argc == 1, ERR_RUNTIME, "Incorrect number of arguments to 'print' function.");
+
+	const LAIR_TOKEN type = _lair_type_of(argv[0]);
+	if (type == LR_FUNCTION_DEF || type == LR_FUNCTION_CALL) {
+		fprintf(r->options.out, "<%s!: %s>", _friendly_enum(type), _lair_str_of(argv[0]));
+		return LR_NIL;
+	}
+
+	if (_is_collection(argv[0])) {
+		vector *out = vector_new(sizeof(char), 64);
+		_write_value(r, out, argv[0], 0);
+		fwrite(out->items, sizeof(char), out->count, r->options.out);
+		vector_free(out);
+		return LR_NIL;
+	}
+
+	char buf[512] = {0};
+	fputs(_to_string(r, argv[0], buf, sizeof(buf)), r->options.out);
 
-	return NULL;
+	return LR_NIL;
 }
 
-const struct _lair_type *_lair_builtin_println(LAIR_FUNCTION_SIG) {
+_lair_val _lair_builtin_println(LAIR_FUNCTION_SIG) {
 	check(r, argc == 1, ERR_RUNTIME, "Incorrect number of arguments to 'println' function.");
 	_lair_builtin_print(r, argc, argv);
-	printf("\n");
+	fputc('\n', r->options.out);
 
-	return NULL;
+	return LR_NIL;
 }
 
-const struct _lair_type *_lair_builtin_str(LAIR_FUNCTION_SIG) {
-	printf("ARGC IS %i", argc);
+_lair_val _lair_builtin_str(LAIR_FUNCTION_SIG) {
 	check(r, argc == 1, ERR_RUNTIME, "Incorrect number of arguments to 'str' function.");
 
-	struct _lair_type *new_string = calloc(1, sizeof(struct _lair_type));
-	new_string->type = LR_STRING;
+	/* Strings can't change, so they're their own string. */
+	if (_lair_type_of(argv[0]) == LR_STRING)
+		return argv[0];
 
-	if (argv[0] == NULL) {
-		char buf[] = "(null)";
-		char *ptr = calloc(1, sizeof(buf));
-		memcpy(ptr, buf, sizeof(buf));
-		new_string->value.str = ptr;
-	} else {
-		char *friendly = _friendly_enum(argv[0]->type);
-		char buf[512] = {0};
-		char *ptr = NULL;
-		size_t siz = 0;
+	if (_is_collection(argv[0])) {
+		vector *out = vector_new(sizeof(char), 64);
+		_write_value(r, out, argv[0], 0);
+		struct _lair_type *new_string = _lair_gc_string(r, out->count);
+		memcpy(new_string->value.str, out->items, out->count);
+		vector_free(out);
+		return LR_BOX(new_string);
+	}
 
-		switch (argv[0]->type) {
-		case LR_STRING:
-			siz = strlen(argv[0]->value.str);
-			ptr = calloc(1, siz);
-			memcpy(ptr, argv[0]->value.str, siz);
-			new_string->value.str = ptr;
-			break;
-		case LR_NUM:
-			snprintf(buf, sizeof(buf), "%i", argv[0]->value.num);
-
-			siz = strlen(buf);
-			ptr = calloc(1, siz);
-			memcpy(ptr, buf, siz);
-			new_string->value.str = ptr;
-			break;
-		case LR_FUNCTION_DEF:
-		case LR_FUNCTION_CALL:
-			snprintf(buf, sizeof(buf), "<%s: %s>", friendly, argv[0]->value.str);
-
-			siz = strlen(buf);
-			ptr = calloc(1, siz);
-			memcpy(ptr, buf, siz);
-			new_string->value.str = ptr;
-			break;
+	char buf[512] = {0};
+	const char *src = _to_string(r, argv[0], buf, sizeof(buf));
+
+	const size_t siz = strlen(src);
+	struct _lair_type *new_string = _lair_gc_string(r, siz);
+	memcpy(new_string->value.str, src, siz);
+	return LR_BOX(new_string);
+}
+
+_lair_val _lair_builtin_vector(LAIR_FUNCTION_SIG) {
+	check(r, argc == 0, ERR_RUNTIME, "Incorrect number of arguments to 'vector' function.");
+	(void)argv;
+	return _lair_vector_new(r);
+}
+
+_lair_val _lair_builtin_dict(LAIR_FUNCTION_SIG) {
+	check(r, argc == 0, ERR_RUNTIME, "Incorrect number of arguments to 'dict' function.");
+	(void)argv;
+	return _lair_map_new(r);
+}
+
+/* Checks that `index` is a number that's a valid position in `vec`. One past
+ * the end is fine if `or_end` is set.
+ */
+static size_t _index_into(struct _lair_runtime *r, const struct _lair_vector *vec, const _lair_val index, const int or_end) {
+	check(r, _lair_type_of(index) == LR_NUM, ERR_RUNTIME, "Vector indices have to be numbers.");
+	const int i = _lair_num_of(index);
+	check(r, i >= 0 && ((size_t)i < vec->count || (or_end && (size_t)i == vec->count)), ERR_RUNTIME, "Index out of range.");
+	return (size_t)i;
+}
+
+_lair_val _lair_builtin_push(LAIR_FUNCTION_SIG) {
+	check(r, argc == 2, ERR_RUNTIME, "Incorrect number of arguments to 'push' function.");
+	check(r, _lair_type_of(argv[0]) == LR_VECTOR, ERR_RUNTIME, "Can only push onto vectors.");
+	return _lair_vector_push(r, argv[0], argv[1]);
+}
+
+_lair_val _lair_builtin_put(LAIR_FUNCTION_SIG) {
+	check(r, argc == 3, ERR_RUNTIME, "Incorrect number of arguments to 'put' function.");
+
+	switch (_lair_type_of(argv[0])) {
+		case LR_VECTOR: {
+			const size_t i = _index_into(r, LR_UNBOX(argv[0])->value.vector, argv[1], 1);
+			return _lair_vector_set(r, argv[0], i, argv[2]);
+		}
+		case LR_MAP:
+			check(r, argv[1] != LR_NIL, ERR_RUNTIME, "Map keys can't be NULL.");
+			return _lair_map_put(r, argv[0], argv[1], argv[2]);
+		default:
+			throw_exception(r, ERR_RUNTIME, "Can only put things in vectors and maps.");
+	}
+	return LR_NIL;
+}
+
+_lair_val _lair_builtin_get(LAIR_FUNCTION_SIG) {
+	check(r, argc == 2, ERR_RUNTIME, "Incorrect number of arguments to 'get' function.");
+
+	switch (_lair_type_of(argv[0])) {
+		case LR_VECTOR: {
+			const struct _lair_vector *vec = LR_UNBOX(argv[0])->value.vector;
+			return _lair_vector_get(vec, _index_into(r, vec, argv[1], 0));
+		}
+		case LR_MAP: {
+			const _lair_val *found = _lair_map_get(r, argv[0], argv[1]);
+			check(r, found != NULL, ERR_RUNTIME, "No such key in map.");
+			return *found;
+		}
 		default:
-			snprintf(buf, sizeof(buf), "<%s: %p>", friendly, argv[0]);
+			throw_exception(r, ERR_RUNTIME, "Can only get things out of vectors and maps.");
+	}
+	return LR_NIL;
+}
+
+_lair_val _lair_builtin_has(LAIR_FUNCTION_SIG) {
+	check(r, argc == 2, ERR_RUNTIME, "Incorrect number of arguments to 'has' function.");
 
-			siz = strlen(buf);
-			ptr = calloc(1, siz);
-			memcpy(ptr, buf, siz);
-			new_string->value.str = ptr;
-			break;
+	switch (_lair_type_of(argv[0])) {
+		case LR_VECTOR: {
+			if (_lair_type_of(argv[1]) != LR_NUM)
+				return LR_FALSE;
+			const int i = _lair_num_of(argv[1]);
+			return LR_BOOL(i >= 0 && (size_t)i < LR_UNBOX(argv[0])->value.vector->count);
 		}
+		case LR_MAP:
+			return LR_BOOL(_lair_map_get(r, argv[0], argv[1]) != NULL);
+		default:
+			throw_exception(r, ERR_RUNTIME, "Can only look for things in vectors and maps.");
+	}
+	return LR_NIL;
+}
+
+_lair_val _lair_builtin_del(LAIR_FUNCTION_SIG) {
+	check(r, argc == 2, ERR_RUNTIME, "Incorrect number of arguments to 'del' function.");
+	check(r, _lair_type_of(argv[0]) == LR_MAP, ERR_RUNTIME, "Can only delete things from maps.");
+	return _lair_map_del(r, argv[0], argv[1]);
+}
+
+_lair_val _lair_builtin_count(LAIR_FUNCTION_SIG) {
+	check(r, argc == 1, ERR_RUNTIME, "Incorrect number of arguments to 'count' function.");
+
+	switch (_lair_type_of(argv[0])) {
+		case LR_VECTOR:
+			return _lair_gc_num(r, LR_UNBOX(argv[0])->value.vector->count);
+		case LR_MAP:
+			return _lair_gc_num(r, LR_UNBOX(argv[0])->value.map->count);
+		case LR_STRING:
+			return _lair_gc_num(r, _lair_string_len(argv[0]));
+		default:
+			throw_exception(r, ERR_RUNTIME, "Can only count vectors, maps and strings.");
 	}
+	return LR_NIL;
+}
+
+_lair_val _lair_builtin_pmap(LAIR_FUNCTION_SIG) {
+	check(r, argc == 2, ERR_RUNTIME, "Incorrect number of arguments to 'pmap' function.");
+	return _lair_parallel_map(r, argv[0], argv[1]);
+}
 
-	return new_string;
+_lair_val _lair_builtin_preduce(LAIR_FUNCTION_SIG) {
+	check(r, argc == 3, ERR_RUNTIME, "Incorrect number of arguments to 'preduce' function.");
+	return _lair_parallel_reduce(r, argv[0], argv[1], argv[2]);
 }
@@ -1,19 +1,74 @@
 // vim: noet ts=4 sw=4
+#include <sys/stat.h>
+#include <errno.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "error.h"
 #include "lair.h"
 
 static void _print_usage(const char *name) {
 	printf("%s -- Runs REPL mode.\n", name);
-	printf("%s <to_run.den> -- Executes a file.\n", name);
+	printf("%s [options] <to_run.den> -- Executes a file.\n", name);
+	printf("\n");
+	printf("  --profile          Print how long every function took to STDERR when done.\n");
+	printf("  --profile=<path>   Same, but as JSON, to <path>.\n");
+	printf("  --sample           Sample the call stack and print folded stacks to STDERR when done.\n");
+	printf("  --sample=<path>    Same, but to <path>.\n");
+	printf("  --sample-hz=<n>    Take <n> samples per second of CPU time. Default 997.\n");
+	printf("  --stats            Print counts of what the interpreter did to STDERR when done.\n");
+	printf("  --stats=<path>     Same, but to <path>. /dev/fd/<n> works too.\n");
+	printf("  --memory           Print where the memory went to STDERR when done, and on SIGUSR1.\n");
+	printf("  --memory=<path>    Same, but to <path> when done.\n");
+	printf("  --memo             Remember what pure functions return, and skip calling them again.\n");
+	printf("  --memo=<n>         Same, but remember at most <n> results. Default 65536.\n");
+	printf("  --parallel         Run independent calls to pure functions on every CPU.\n");
+	printf("  --parallel=<n>     Same, but on at most <n> threads.\n");
+	printf("  --parallel-cost=<n> Only fork calls that take at least <n> microseconds. Default 100.\n");
+	printf("  --no-cache         Compile the file even if it's in the cache, and don't add it.\n");
+	printf("\n");
+	printf("Compiled files are cached in $LAIR_CACHE_DIR, $XDG_CACHE_HOME/lair or ~/.cache/lair.\n");
 }
 
-int _load_file(const char *argv[]) {
-	/* The file we're going to load in: */
-	const char *file_path = argv[1];
+/* Works out where the cache goes and makes sure it's there. NULL if there's
+ * nowhere to put it, in which case we just don't cache anything.
+ */
+static const char *_cache_dir(char dir[PATH_MAX]) {
+	const char *env = getenv("LAIR_CACHE_DIR");
+	int n = 0;
+	if (env != NULL && env[0] != '\0')
+		n = snprintf(dir, PATH_MAX, "%s", env);
+	else if ((env = getenv("XDG_CACHE_HOME")) != NULL && env[0] != '\0')
+		n = snprintf(dir, PATH_MAX, "%s/lair", env);
+	else if ((env = getenv("HOME")) != NULL && env[0] != '\0')
+		n = snprintf(dir, PATH_MAX, "%s/.cache/lair", env);
+	if (n <= 0 || n >= PATH_MAX)
+		return NULL;
+
+	/* Like `mkdir -p`. */
+	char *slash = dir;
+	while ((slash = strchr(slash + 1, '/')) != NULL) {
+		*slash = '\0';
+		const int rc = mkdir(dir, 0755);
+		*slash = '/';
+		if (rc != 0 && errno != EEXIST)
+			return NULL;
+	}
+	if (mkdir(dir, 0755) != 0 && errno != EEXIST)
+		return NULL;
+	return dir;
+}
+
+/* How many CPUs we can run on. */
+static int _cpus() {
+	const long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (int)n : 1;
+}
+
+int _load_file(const char *file_path, const struct lair_options *options) {
 	/* Where we're going to store our loaded buffer: */
 	char *buf = NULL;
 	size_t buf_siz = 0;
@@ -24,7 +79,7 @@ int _load_file(const char *argv[]) {
 		return 1;
 	}
 
-	int rc = lair_execute(buf, buf_siz);
+	int rc = lair_execute_with_options(buf, buf_siz, options);
 	if (rc != 0) {
 		error_and_die(ERR_RUNTIME, "Could not execute.");
 		return 1;
@@ -58,7 +113,61 @@ int main(const int argc, const char *argv[]) {
 		exit(0);
 	}
 
-	if (argc >= 2)
-		return _load_file(argv);
+	struct lair_options options = {0};
+	char cache_dir[PATH_MAX];
+	int cache = 1;
+	int i;
+	for (i = 1; i < argc && strncmp(argv[i], "--", 2) == 0; i++) {
+		if (strcmp(argv[i], "--profile") == 0) {
+			options.profile = 1;
+		} else if (strncmp(argv[i], "--profile=", strlen("--profile=")) == 0) {
+			options.profile = 1;
+			options.profile_path = argv[i] + strlen("--profile=");
+		} else if (strcmp(argv[i], "--sample") == 0) {
+			options.sample = 1;
+		} else if (strncmp(argv[i], "--sample=", strlen("--sample=")) == 0) {
+			options.sample = 1;
+			options.sample_path = argv[i] + strlen("--sample=");
+		} else if (strcmp(argv[i], "--stats") == 0) {
+			options.stats = 1;
+		} else if (strncmp(argv[i], "--stats=", strlen("--stats=")) == 0) {
+			options.stats = 1;
+			options.stats_path = argv[i] + strlen("--stats=");
+		} else if (strcmp(argv[i], "--memory") == 0) {
+			options.memory = 1;
+		} else if (strncmp(argv[i], "--memory=", strlen("--memory=")) == 0) {
+			options.memory = 1;
+			options.memory_path = argv[i] + strlen("--memory=");
+		} else if (strncmp(argv[i], "--sample-hz=", strlen("--sample-hz=")) == 0) {
+			options.sample_hz = atoi(argv[i] + strlen("--sample-hz="));
+		} else if (strcmp(argv[i], "--memo") == 0) {
+			options.memo = 1;
+		} else if (strncmp(argv[i], "--memo=", strlen("--memo=")) == 0) {
+			options.memo = 1;
+			options.memo_size = strtoul(argv[i] + strlen("--memo="), NULL, 10);
+		} else if (strcmp(argv[i], "--parallel") == 0) {
+			options.parallel = _cpus();
+		} else if (strncmp(argv[i], "--parallel=", strlen("--parallel=")) == 0) {
+			options.parallel = atoi(argv[i] + strlen("--parallel="));
+		} else if (strncmp(argv[i], "--parallel-cost=", strlen("--parallel-cost=")) == 0) {
+			options.parallel_cost = strtoul(argv[i] + strlen("--parallel-cost="), NULL, 10);
+		} else if (strcmp(argv[i], "--no-cache") == 0) {
+			cache = 0;
+		} else {
+			_print_usage(argv[0]);
+			exit(1);
+		}
+	}
+
+	if (options.profile && options.sample) {
+		fprintf(stderr, "Pick one of --profile and --sample.\n");
+		exit(1);
+	}
+
+	if (i < argc) {
+		if (cache)
+			options.cache_dir = _cache_dir(cache_dir);
+		return _load_file(argv[i], &options);
+	}
 	return _repl_mode();
 }
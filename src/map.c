@@ -2,6 +2,7 @@
 #include <assert.h>
 #include <string.h>
 #include "map.h"
+#include "vector.h"
 
 static int _tst_insert(struct _tst_map_node **cur_node, const char *key, size_t klen, const void *value, const size_t vsiz) {
 	/* This function is just scary looking because we're passing around pointers
@@ -57,47 +58,61 @@ const void *_tst_map_get(struct _tst_map_node *current_node, const char *key, co
 	}
 }
 
-/* struct used to teardown the map. */
-struct destroy_queue {
-	struct destroy_queue *next;
-	void *data;
-};
-
-static inline void dq_push(struct destroy_queue **top, void *data) {
-	struct destroy_queue *to_push = NULL;
-	to_push = calloc(1, sizeof(struct destroy_queue));
-	to_push->next = *top;
-	to_push->data = data;
-	*top = to_push;
+int _tst_map_delete(struct _tst_map_node *current_node, const char *key, const size_t klen) {
+	/* Same walk as a get, minus the recursion. */
+	size_t i = 0;
+	while (current_node != NULL) {
+		if (key[i] < current_node->node_char) {
+			current_node = current_node->lokid;
+		} else if (key[i] > current_node->node_char) {
+			current_node = current_node->hikid;
+		} else if (i + 1 < klen) {
+			current_node = current_node->eqkid;
+			i++;
+		} else {
+			if (current_node->value == NULL)
+				return 1;
+			free(current_node->value);
+			current_node->value = NULL;
+			return 0;
+		}
+	}
+	return 1;
 }
 
-static inline void *dq_pop(struct destroy_queue **stack) {
-	struct destroy_queue *top = *stack;
-	*stack = top->next;
-	void *data = top->data;
-
-	free(top);
-	return data;
+void _tst_map_each(struct _tst_map_node *node, void (*per_value)(const void *value, void *ctx), void *ctx) {
+	while (node != NULL) {
+		if (node->value != NULL)
+			per_value(node->value, ctx);
+		_tst_map_each(node->lokid, per_value, ctx);
+		_tst_map_each(node->eqkid, per_value, ctx);
+		/* Loop instead of recursing down the hikid. */
+		node = node->hikid;
+	}
 }
 
 void _tst_map_destroy(struct _tst_map_node *root, void (*per_value_cleanup)(void *data)) {
 	if (root == NULL)
 		return;
-	/* TODO: This whole function. */
-	struct destroy_queue *top = calloc(1, sizeof(struct destroy_queue));
-	dq_push(&top, root);
 
-	while (top->next != NULL) {
-		struct _tst_map_node *cur_node = (struct _tst_map_node *)dq_pop(&top);
+	/* The nodes we still have to free. One allocation for the lot of them,
+	 * instead of one per node.
+	 */
+	vector *stack = vector_new(sizeof(struct _tst_map_node *), 64);
+	vector_append_ptr(stack, root);
+
+	while (stack->count > 0) {
+		stack->count--;
+		struct _tst_map_node *cur_node = *(struct _tst_map_node **)vector_get(stack, stack->count);
 
 		if (cur_node->lokid != NULL)
-			dq_push(&top, (void *)cur_node->lokid);
+			vector_append_ptr(stack, cur_node->lokid);
 
 		if (cur_node->eqkid != NULL)
-			dq_push(&top, (void *)cur_node->eqkid);
+			vector_append_ptr(stack, cur_node->eqkid);
 
 		if (cur_node->hikid != NULL)
-			dq_push(&top, (void *)cur_node->hikid);
+			vector_append_ptr(stack, cur_node->hikid);
 
 		if (per_value_cleanup != NULL && cur_node->value != NULL)
 			per_value_cleanup(cur_node->value);
@@ -105,5 +120,262 @@ void _tst_map_destroy(struct _tst_map_node *root, void (*per_value_cleanup)(void
 		free(cur_node);
 	}
 
-	free(top);
+	vector_free(stack);
+}
+
+#define SYM_MAP_INITIAL_CAPACITY 8
+
+static inline size_t _sym_map_slot(const struct _sym_map *map, const _lair_sym key) {
+	const size_t mask = map->capacity - 1;
+	size_t i = key & mask;
+	while (map->keys[i] != LR_NO_SYM && map->keys[i] != key)
+		i = (i + 1) & mask;
+	return i;
+}
+
+static int _sym_map_grow(struct _sym_map *map) {
+	const size_t new_capacity = map->capacity == 0 ? SYM_MAP_INITIAL_CAPACITY : map->capacity * 2;
+	struct _sym_map grown = {
+		.keys = calloc(new_capacity, sizeof(_lair_sym)),
+		.values = malloc(new_capacity * map->vsize),
+		.vsize = map->vsize,
+		.capacity = new_capacity,
+		.count = map->count
+	};
+	if (grown.keys == NULL || grown.values == NULL) {
+		free(grown.keys);
+		free(grown.values);
+		return 1;
+	}
+
+	size_t i;
+	for (i = 0; i < map->capacity; i++) {
+		if (map->keys[i] == LR_NO_SYM)
+			continue;
+		const size_t slot = _sym_map_slot(&grown, map->keys[i]);
+		grown.keys[slot] = map->keys[i];
+		memcpy(grown.values + slot * grown.vsize, map->values + i * map->vsize, map->vsize);
+	}
+
+	free(map->keys);
+	free(map->values);
+	*map = grown;
+	return 0;
+}
+
+int _sym_map_insert(struct _sym_map *map, const _lair_sym key, const void *value, const size_t vsize) {
+	assert(key != LR_NO_SYM);
+	assert(map->vsize == 0 || map->vsize == vsize);
+	map->vsize = vsize;
+
+	/* Keep the table at most half full so probe chains stay short. */
+	if ((map->count + 1) * 2 > map->capacity && _sym_map_grow(map) != 0)
+		return 1;
+
+	const size_t slot = _sym_map_slot(map, key);
+	if (map->keys[slot] == key) // Duplicate?
+		return 1;
+
+	map->keys[slot] = key;
+	memcpy(map->values + slot * vsize, value, vsize);
+	map->count++;
+	return 0;
+}
+
+void *_sym_map_get(const struct _sym_map *map, const _lair_sym key) {
+	if (map->count == 0)
+		return NULL;
+
+	const size_t slot = _sym_map_slot(map, key);
+	if (map->keys[slot] != key)
+		return NULL;
+	return map->values + slot * map->vsize;
+}
+
+void _sym_map_each(const struct _sym_map *map, void (*per_value)(const void *value, void *ctx), void *ctx) {
+	size_t i;
+	for (i = 0; i < map->capacity; i++) {
+		if (map->keys[i] != LR_NO_SYM)
+			per_value(map->values + i * map->vsize, ctx);
+	}
+}
+
+void _sym_map_clear(struct _sym_map *map, void (*per_value_cleanup)(void *data)) {
+	size_t i;
+	if (per_value_cleanup != NULL) {
+		for (i = 0; i < map->capacity; i++) {
+			if (map->keys[i] != LR_NO_SYM)
+				per_value_cleanup(map->values + i * map->vsize);
+		}
+	}
+
+	free(map->keys);
+	free(map->values);
+	memset(map, 0, sizeof(struct _sym_map));
+}
+
+#define STR_MAP_INITIAL_CAPACITY 8
+#define STR_MAP_EMPTY 0
+#define STR_MAP_DELETED 1
+
+/* FNV-1a. Real hashes are never mistaken for an empty or deleted slot. */
+static inline uint32_t _str_map_hash(const char *key, const size_t klen) {
+	uint32_t hash = 2166136261u;
+	size_t i;
+	for (i = 0; i < klen; i++) {
+		hash ^= (unsigned char)key[i];
+		hash *= 16777619u;
+	}
+	return hash > STR_MAP_DELETED ? hash : hash + 2;
+}
+
+static inline const char *_str_map_key(const struct _str_map_entry *entry) {
+	return entry->klen <= STR_MAP_INLINE_KEY ? entry->key.bytes : entry->key.ptr;
+}
+
+/* Finds the slot holding `key`, or if it isn't there, the slot it should go
+ * in. That's the first deleted slot we passed, if there was one.
+ */
+static size_t _str_map_slot(const struct _str_map *map, const char *key, const size_t klen, const uint32_t hash) {
+	const size_t mask = map->capacity - 1;
+	size_t i = hash & mask;
+	size_t insert_at = map->capacity;
+	while (map->entries[i].hash != STR_MAP_EMPTY) {
+		const struct _str_map_entry *entry = &map->entries[i];
+		if (entry->hash == hash && entry->klen == klen &&
+				memcmp(_str_map_key(entry), key, klen) == 0)
+			return i;
+		if (entry->hash == STR_MAP_DELETED && insert_at == map->capacity)
+			insert_at = i;
+		i = (i + 1) & mask;
+	}
+	return insert_at == map->capacity ? i : insert_at;
+}
+
+static int _str_map_grow(struct _str_map *map) {
+	/* If it's mostly deleted slots, the same size will do. */
+	size_t new_capacity = map->capacity == 0 ? STR_MAP_INITIAL_CAPACITY : map->capacity;
+	while ((map->count + 1) * 2 > new_capacity)
+		new_capacity *= 2;
+
+	struct _str_map grown = {
+		.entries = calloc(new_capacity, sizeof(struct _str_map_entry)),
+		.values = malloc(new_capacity * map->vsize),
+		.vsize = map->vsize,
+		.capacity = new_capacity,
+		.count = map->count,
+		.used = map->count
+	};
+	if (grown.entries == NULL || grown.values == NULL) {
+		free(grown.entries);
+		free(grown.values);
+		return 1;
+	}
+
+	/* Keys and hashes move over as they are. */
+	const size_t mask = new_capacity - 1;
+	size_t i;
+	for (i = 0; i < map->capacity; i++) {
+		const struct _str_map_entry *entry = &map->entries[i];
+		if (entry->hash <= STR_MAP_DELETED)
+			continue;
+		size_t slot = entry->hash & mask;
+		while (grown.entries[slot].hash != STR_MAP_EMPTY)
+			slot = (slot + 1) & mask;
+		grown.entries[slot] = *entry;
+		memcpy(grown.values + slot * grown.vsize, map->values + i * map->vsize, map->vsize);
+	}
+
+	free(map->entries);
+	free(map->values);
+	*map = grown;
+	return 0;
+}
+
+int _str_map_insert(struct _str_map *map, const char *key, const size_t klen, const void *value, const size_t vsize) {
+	assert(key != NULL);
+	assert(klen > 0 && klen <= UINT32_MAX);
+	assert(map->vsize == 0 || map->vsize == vsize);
+	map->vsize = vsize;
+
+	/* Deleted slots make probes longer too, so they count towards the load. */
+	if ((map->used + 1) * 2 > map->capacity && _str_map_grow(map) != 0)
+		return 1;
+
+	const uint32_t hash = _str_map_hash(key, klen);
+	const size_t slot = _str_map_slot(map, key, klen, hash);
+	struct _str_map_entry *entry = &map->entries[slot];
+	if (entry->hash == hash) // Duplicate?
+		return 1;
+
+	if (klen > STR_MAP_INLINE_KEY) {
+		char *copy = malloc(klen);
+		if (copy == NULL)
+			return 1;
+		memcpy(copy, key, klen);
+		entry->key.ptr = copy;
+	} else {
+		memcpy(entry->key.bytes, key, klen);
+	}
+
+	if (entry->hash == STR_MAP_EMPTY)
+		map->used++;
+	entry->hash = hash;
+	entry->klen = klen;
+	memcpy(map->values + slot * vsize, value, vsize);
+	map->count++;
+	return 0;
+}
+
+void *_str_map_get(const struct _str_map *map, const char *key, const size_t klen) {
+	if (map->count == 0)
+		return NULL;
+
+	const uint32_t hash = _str_map_hash(key, klen);
+	const size_t slot = _str_map_slot(map, key, klen, hash);
+	if (map->entries[slot].hash != hash)
+		return NULL;
+	return map->values + slot * map->vsize;
+}
+
+int _str_map_delete(struct _str_map *map, const char *key, const size_t klen) {
+	if (map->count == 0)
+		return 1;
+
+	const uint32_t hash = _str_map_hash(key, klen);
+	const size_t slot = _str_map_slot(map, key, klen, hash);
+	struct _str_map_entry *entry = &map->entries[slot];
+	if (entry->hash != hash)
+		return 1;
+
+	if (entry->klen > STR_MAP_INLINE_KEY)
+		free(entry->key.ptr);
+	entry->hash = STR_MAP_DELETED;
+	map->count--;
+	return 0;
+}
+
+void _str_map_each(const struct _str_map *map, void (*per_value)(const void *value, void *ctx), void *ctx) {
+	size_t i;
+	for (i = 0; i < map->capacity; i++) {
+		if (map->entries[i].hash > STR_MAP_DELETED)
+			per_value(map->values + i * map->vsize, ctx);
+	}
+}
+
+void _str_map_clear(struct _str_map *map, void (*per_value_cleanup)(void *data)) {
+	size_t i;
+	for (i = 0; i < map->capacity; i++) {
+		struct _str_map_entry *entry = &map->entries[i];
+		if (entry->hash <= STR_MAP_DELETED)
+			continue;
+		if (per_value_cleanup != NULL)
+			per_value_cleanup(map->values + i * map->vsize);
+		if (entry->klen > STR_MAP_INLINE_KEY)
+			free(entry->key.ptr);
+	}
+
+	free(map->entries);
+	free(map->values);
+	memset(map, 0, sizeof(struct _str_map));
 }
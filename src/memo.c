@@ -0,0 +1,196 @@
+// vim: noet ts=4 sw=4
+#include <string.h>
+
+#include "compile.h"
+#include "error.h"
+#include "eval.h"
+#include "lair.h"
+#include "memo.h"
+#include "memory.h"
+#include "vector.h"
+
+#define MEMO_INITIAL_ENTRIES	256
+#define MEMO_INITIAL_PENDING	64
+
+struct _lair_memo *_lair_memo_new(struct _lair_runtime *r, const struct _lair_program *program, const size_t size) {
+	const struct _lair_proto *protos = (const struct _lair_proto *)program->protos->items;
+	const size_t nprotos = program->protos->count;
+	struct _lair_memo *memo = calloc(1, sizeof(struct _lair_memo));
+	check(r, memo != NULL, ERR_RUNTIME, "Out of memory starting the memo table.");
+	/* So it gets freed if we run out of memory below. */
+	r->memo = memo;
+
+	memo->nprotos = nprotos;
+	memo->memoizable = calloc(nprotos + 1, sizeof(unsigned char));
+	memo->size = (size == 0 ? LR_MEMO_DEFAULT_SIZE : size) + 1;
+	check(r, memo->size <= UINT32_MAX, ERR_RUNTIME, "Memo table is too big.");
+	size_t nbuckets = 1;
+	while (nbuckets < memo->size)
+		nbuckets *= 2;
+	memo->mask = nbuckets - 1;
+	memo->buckets = calloc(nbuckets, sizeof(uint32_t));
+	memo->nentries = 1;
+	check(r, memo->memoizable != NULL && memo->buckets != NULL, ERR_RUNTIME, "Out of memory starting the memo table.");
+	_lair_mem_alloc(r->memory, LR_MEM_MEMO, nprotos + 1 + nbuckets * sizeof(uint32_t));
+
+	_lair_find_pure(program, memo->memoizable, 1);
+	size_t p;
+	for (p = 0; p < nprotos; p++) {
+		const int memoizable = memo->memoizable[p] && protos[p].builtin == NULL &&
+			p != program->main && protos[p].argc <= LR_MEMO_MAX_ARGS;
+		memo->memoizable[p] = memoizable ? protos[p].argc + 1 : 0;
+	}
+	return memo;
+}
+
+static inline uint64_t _hash(const struct _lair_memo_key *key) {
+	uint64_t hash = 0x9E3779B97F4A7C15ULL * (key->proto + 1);
+	size_t i;
+	for (i = 0; i < LR_MEMO_MAX_ARGS; i++) {
+		hash ^= key->args[i];
+		hash *= 0xFF51AFD7ED558CCDULL;
+		hash ^= hash >> 33;
+	}
+	return hash;
+}
+
+static inline int _same(const struct _lair_memo_key *a, const struct _lair_memo_key *b) {
+	return a->hash == b->hash && a->proto == b->proto && memcmp(a->args, b->args, sizeof(a->args)) == 0;
+}
+
+static uint32_t _find(const struct _lair_memo *memo, const struct _lair_memo_key *key) {
+	uint32_t e;
+	for (e = memo->buckets[key->hash & memo->mask]; e != 0; e = memo->entries[e].next)
+		if (_same(&memo->entries[e].key, key))
+			return e;
+	return 0;
+}
+
+/* Takes an entry out of the recently used list. */
+static void _unlink(struct _lair_memo *memo, const uint32_t e) {
+	struct _lair_memo_entry *entry = &memo->entries[e];
+	if (entry->newer != 0)
+		memo->entries[entry->newer].older = entry->older;
+	else
+		memo->newest = entry->older;
+	if (entry->older != 0)
+		memo->entries[entry->older].newer = entry->newer;
+	else
+		memo->oldest = entry->newer;
+}
+
+/* Puts an entry at the front of the recently used list. */
+static void _link_newest(struct _lair_memo *memo, const uint32_t e) {
+	struct _lair_memo_entry *entry = &memo->entries[e];
+	entry->newer = 0;
+	entry->older = memo->newest;
+	if (memo->newest != 0)
+		memo->entries[memo->newest].newer = e;
+	memo->newest = e;
+	if (memo->oldest == 0)
+		memo->oldest = e;
+}
+
+/* Takes an entry out of its bucket. */
+static void _unbucket(struct _lair_memo *memo, const uint32_t e) {
+	uint32_t *link = &memo->buckets[memo->entries[e].key.hash & memo->mask];
+	while (*link != e)
+		link = &memo->entries[*link].next;
+	*link = memo->entries[e].next;
+}
+
+/* Finds room for a new entry, forgetting the oldest one if we have to. */
+static uint32_t _new_entry(struct _lair_runtime *r, struct _lair_memo *memo) {
+	if (memo->nentries < memo->size) {
+		/* Grown as it fills, so small programs stay small. */
+		if (memo->nentries >= memo->capacity) {
+			size_t grown = memo->capacity == 0 ? MEMO_INITIAL_ENTRIES : memo->capacity * 2;
+			if (grown > memo->size)
+				grown = memo->size;
+			struct _lair_memo_entry *entries = realloc(memo->entries, grown * sizeof(struct _lair_memo_entry));
+			check(r, entries != NULL, ERR_RUNTIME, "Out of memory growing the memo table.");
+			_lair_mem_alloc(r->memory, LR_MEM_MEMO, (grown - memo->capacity) * sizeof(struct _lair_memo_entry));
+			memo->entries = entries;
+			memo->capacity = grown;
+		}
+		return memo->nentries++;
+	}
+
+	const uint32_t e = memo->oldest;
+	_unlink(memo, e);
+	_unbucket(memo, e);
+	memo->evictions++;
+	return e;
+}
+
+LAIR_MEMO_RESULT _lair_memo_call(
+		struct _lair_runtime *r,
+		struct _lair_memo *memo,
+		const size_t proto,
+		const _lair_val *args,
+		_lair_val *result,
+		const int remember) {
+	const int argc = memo->memoizable[proto] - 1;
+	struct _lair_memo_key key = { .proto = proto };
+	int i;
+	for (i = 0; i < argc; i++) {
+		if (!LR_IS_INT(args[i]) && !LR_IS_BOOL(args[i]))
+			return LR_MEMO_SKIP;
+		key.args[i] = args[i];
+	}
+	key.hash = _hash(&key);
+
+	const uint32_t e = _find(memo, &key);
+	if (e != 0) {
+		if (memo->newest != e) {
+			_unlink(memo, e);
+			_link_newest(memo, e);
+		}
+		*result = memo->entries[e].result;
+		memo->hits++;
+		return LR_MEMO_HIT;
+	}
+
+	memo->misses++;
+	if (!remember)
+		return LR_MEMO_MISS;
+
+	if (memo->npending == memo->pending_size) {
+		const size_t grown = memo->pending_size == 0 ? MEMO_INITIAL_PENDING : memo->pending_size * 2;
+		struct _lair_memo_key *pending = realloc(memo->pending, grown * sizeof(struct _lair_memo_key));
+		check(r, pending != NULL, ERR_RUNTIME, "Out of memory growing the memo table.");
+		_lair_mem_alloc(r->memory, LR_MEM_MEMO, (grown - memo->pending_size) * sizeof(struct _lair_memo_key));
+		memo->pending = pending;
+		memo->pending_size = grown;
+	}
+	memo->pending[memo->npending++] = key;
+	return LR_MEMO_MISS;
+}
+
+void _lair_memo_return(struct _lair_runtime *r, struct _lair_memo *memo, const size_t pending, const _lair_val result) {
+	const struct _lair_memo_key key = memo->pending[pending - 1];
+	memo->npending = pending - 1;
+
+	uint32_t e = _find(memo, &key);
+	if (e == 0) {
+		e = _new_entry(r, memo);
+		memo->entries[e].key = key;
+		uint32_t *bucket = &memo->buckets[key.hash & memo->mask];
+		memo->entries[e].next = *bucket;
+		*bucket = e;
+	} else {
+		_unlink(memo, e);
+	}
+	memo->entries[e].result = result;
+	_link_newest(memo, e);
+}
+
+void _lair_memo_free(struct _lair_memo *memo) {
+	if (memo == NULL)
+		return;
+	free(memo->memoizable);
+	free(memo->entries);
+	free(memo->buckets);
+	free(memo->pending);
+	free(memo);
+}
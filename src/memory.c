@@ -0,0 +1,212 @@
+// vim: noet ts=4 sw=4
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "compile.h"
+#include "error.h"
+#include "lair.h"
+#include "memory.h"
+#include "vector.h"
+
+/* What SIGUSR1 reports on, the thread that's allowed to read it, and what
+ * SIGUSR1 did before, to put back afterwards. Whoever sets `_signal_taken`
+ * first gets to set them.
+ */
+static atomic_flag _signal_taken = ATOMIC_FLAG_INIT;
+static struct _lair_memory *_Atomic _watched = NULL;
+static pthread_t _watcher;
+static struct sigaction _old_action;
+
+static const char *_category_names[LR_MEM_MAX] = {
+	[LR_MEM_ARENA] = "tokens and AST",
+	[LR_MEM_PROGRAM] = "program",
+	[LR_MEM_VM] = "vm",
+	[LR_MEM_NUMBERS] = "numbers",
+	[LR_MEM_STRINGS] = "strings",
+	[LR_MEM_ROPES] = "ropes",
+	[LR_MEM_VECTORS] = "vectors",
+	[LR_MEM_MAPS] = "maps",
+	[LR_MEM_NODES] = "vector and map nodes",
+	[LR_MEM_OTHER] = "other values",
+	[LR_MEM_MEMO] = "memo table",
+};
+
+struct _lair_memory *_lair_memory_new() {
+	return calloc(1, sizeof(struct _lair_memory));
+}
+
+void _lair_memory_sites(struct _lair_runtime *r, const struct _lair_program *program) {
+	struct _lair_memory *m = r->memory;
+	const size_t nsites = program->protos->count;
+	const char **names = calloc(nsites + 1, sizeof(char *));
+	size_t *live = calloc(nsites + 1, sizeof(size_t));
+	size_t *total = calloc(nsites + 1, sizeof(size_t));
+	if (names == NULL || live == NULL || total == NULL) {
+		free(names);
+		free(live);
+		free(total);
+		throw_exception(r, ERR_RUNTIME, "Out of memory keeping track of memory.");
+	}
+
+	const struct _lair_proto *protos = (const struct _lair_proto *)program->protos->items;
+	size_t i;
+	for (i = 0; i < nsites; i++)
+		names[i] = protos[i].name;
+
+	free(m->site_names);
+	free(m->site_live);
+	free(m->site_total);
+	m->site_names = names;
+	m->site_live = live;
+	m->site_total = total;
+	m->nsites = nsites;
+}
+
+void _lair_memory_adopt(struct _lair_memory *m, const struct _lair_memory *from) {
+	int cat;
+	for (cat = 0; cat < LR_MEM_MAX; cat++) {
+		m->count[cat] += from->count[cat];
+		m->total[cat] += from->total[cat];
+		m->live[cat] += from->live[cat];
+		if (m->live[cat] > m->peak[cat])
+			m->peak[cat] = m->live[cat];
+	}
+	m->live_total += from->live_total;
+	if (m->live_total > m->peak_total)
+		m->peak_total = m->live_total;
+
+	size_t i;
+	for (i = 0; i < m->nsites && i < from->nsites; i++) {
+		m->site_live[i] += from->site_live[i];
+		m->site_total[i] += from->site_total[i];
+	}
+}
+
+/* Just enough of printf to write the report, with nothing that isn't safe in
+ * a signal handler.
+ */
+struct _writer {
+	int fd;
+	size_t used;
+	char buf[1024];
+};
+
+static void _flush(struct _writer *w) {
+	size_t done = 0;
+	while (done < w->used) {
+		const ssize_t n = write(w->fd, w->buf + done, w->used - done);
+		if (n <= 0)
+			break;
+		done += n;
+	}
+	w->used = 0;
+}
+
+static void _put(struct _writer *w, const char *str, const size_t width) {
+	size_t len = strlen(str);
+	size_t i;
+	for (i = 0; i < len || i < width; i++) {
+		if (w->used == sizeof(w->buf))
+			_flush(w);
+		w->buf[w->used++] = i < len ? str[i] : ' ';
+	}
+}
+
+static void _put_num(struct _writer *w, size_t num, const size_t width) {
+	char digits[32];
+	size_t len = 0;
+	do {
+		digits[len++] = '0' + num % 10;
+		num /= 10;
+	} while (num > 0);
+
+	char padded[64];
+	size_t i = 0;
+	for (; i + len < width && i < sizeof(padded) - sizeof(digits); i++)
+		padded[i] = ' ';
+	while (len > 0)
+		padded[i++] = digits[--len];
+	padded[i] = '\0';
+	_put(w, padded, 0);
+}
+
+void _lair_memory_report(const struct _lair_memory *m, const int fd) {
+	struct _writer w = { .fd = fd };
+	_put(&w, "memory", 24);
+	_put(&w, "        live        peak       total      allocs\n", 0);
+
+	int cat;
+	for (cat = 0; cat < LR_MEM_MAX; cat++) {
+		if (m->count[cat] == 0)
+			continue;
+		_put(&w, _category_names[cat], 24);
+		_put_num(&w, m->live[cat], 12);
+		_put_num(&w, m->peak[cat], 12);
+		_put_num(&w, m->total[cat], 12);
+		_put_num(&w, m->count[cat], 12);
+		_put(&w, "\n", 0);
+	}
+	_put(&w, "all of it", 24);
+	_put_num(&w, m->live_total, 12);
+	_put_num(&w, m->peak_total, 12);
+	_put(&w, "\n", 0);
+
+	/* Values, by the function that made them. */
+	size_t i;
+	int header = 0;
+	for (i = 0; i < m->nsites; i++) {
+		if (m->site_total[i] == 0)
+			continue;
+		if (!header) {
+			_put(&w, "\nvalues made by", 24);
+			_put(&w, "        live       total\n", 0);
+			header = 1;
+		}
+		_put(&w, m->site_names[i], 24);
+		_put_num(&w, m->site_live[i], 12);
+		_put_num(&w, m->site_total[i], 12);
+		_put(&w, "\n", 0);
+	}
+	_flush(&w);
+}
+
+static void _report_on_signal(int sig) {
+	(void)sig;
+	const struct _lair_memory *m = atomic_load(&_watched);
+	if (m != NULL && pthread_equal(_watcher, pthread_self()))
+		_lair_memory_report(m, STDERR_FILENO);
+}
+
+void _lair_memory_watch(struct _lair_runtime *r) {
+	if (atomic_flag_test_and_set(&_signal_taken))
+		return;
+	_watcher = pthread_self();
+	atomic_store(&_watched, r->memory);
+
+	struct sigaction action = {0};
+	action.sa_handler = _report_on_signal;
+	action.sa_flags = SA_RESTART;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGUSR1, &action, &_old_action);
+}
+
+void _lair_memory_unwatch(struct _lair_runtime *r) {
+	if (atomic_load(&_watched) != r->memory)
+		return;
+	sigaction(SIGUSR1, &_old_action, NULL);
+	atomic_store(&_watched, NULL);
+	atomic_flag_clear(&_signal_taken);
+}
+
+void _lair_memory_free(struct _lair_memory *m) {
+	if (m == NULL)
+		return;
+
+	free(m->site_names);
+	free(m->site_live);
+	free(m->site_total);
+	free(m);
+}
@@ -0,0 +1,572 @@
+// vim: noet ts=4 sw=4
+#include <glob.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#include "map.h"
+#include "vector.h"
+
+/* Benchmarks the containers everything else is built on. With no arguments it
+ * runs the whole suite:
+ *
+ *   - The map engines in `map.c` on made-up keys: a few key-set sizes, short
+ *     identifier-like keys and long ones that share a prefix (like paths do),
+ *     and lookups that hit every time, half the time and never.
+ *   - `vector_append` and `vector_get`, reading in order and at random.
+ *   - The map engines again on identifiers pulled out of everything in `t/`.
+ *
+ * Give it Den programs and it only does the last part, on those:
+ *
+ *     ./microbench t/basic.den big_generated_program.den
+ *
+ * Everything is in ns/op. Where `perf_event_open` works, the number of cache
+ * misses per op goes in brackets after it.
+ */
+
+/* Roughly how many operations to time per measurement, unless that takes
+ * longer than BENCH_MAX_NS. Slow engines on long keys would take minutes.
+ */
+#define BENCH_OPS 2000000
+#define BENCH_MAX_NS 1e8
+/* How many lookups to make for each synthetic measurement, at least. */
+#define BENCH_QUERIES 4096
+
+struct _ident {
+	const char *str;
+	size_t len;
+};
+
+struct _idents {
+	vector *seen; /*	Every identifier, in the order the programs use them. */
+	vector *unique; /*	Each identifier once. */
+	vector *misses; /*	Identifiers that aren't in the programs. */
+	vector *buffers; /*	The loaded programs, which everything above points into. */
+};
+
+/* Time and cache misses per operation. `misses` is negative if we couldn't
+ * count them.
+ */
+struct _measure {
+	double ns;
+	double misses;
+};
+
+struct _timer {
+	double start;
+	double ns;
+	long long misses;
+};
+
+/* One of the maps in `map.c`, behind enough of an interface to time it. */
+struct _engine {
+	const char *name;
+	void *(*create)();
+	void (*insert)(void *map, const struct _ident *id);
+	int (*get)(void *map, const struct _ident *id);
+	void (*destroy)(void *map);
+};
+
+static int _perf_fd = -1;
+
+static void _perf_open() {
+#ifdef __linux__
+	struct perf_event_attr attr = {0};
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.size = sizeof(attr);
+	attr.config = PERF_COUNT_HW_CACHE_MISSES;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	_perf_fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+}
+
+static double _now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void _timer_start(struct _timer *t) {
+#ifdef __linux__
+	if (_perf_fd >= 0) {
+		ioctl(_perf_fd, PERF_EVENT_IOC_RESET, 0);
+		ioctl(_perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+	}
+#endif
+	t->start = _now();
+}
+
+static void _timer_stop(struct _timer *t) {
+	t->ns += _now() - t->start;
+#ifdef __linux__
+	if (_perf_fd >= 0) {
+		long long count = 0;
+		ioctl(_perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+		if (read(_perf_fd, &count, sizeof(count)) == sizeof(count))
+			t->misses += count;
+	}
+#endif
+}
+
+static struct _measure _per_op(const struct _timer *t, const size_t ops) {
+	const struct _measure m = {
+		.ns = t->ns / (ops == 0 ? 1 : ops),
+		.misses = _perf_fd >= 0 ? (double)t->misses / (ops == 0 ? 1 : ops) : -1
+	};
+	return m;
+}
+
+static void _print_measure(const struct _measure *m) {
+	char cell[32];
+	if (m->misses >= 0)
+		snprintf(cell, sizeof(cell), "%.1f (%.2f)", m->ns, m->misses);
+	else
+		snprintf(cell, sizeof(cell), "%.1f", m->ns);
+	printf(" %15s", cell);
+}
+
+static inline const struct _ident *_ident_at(const vector *v, const size_t i) {
+	return (const struct _ident *)vector_get(v, i);
+}
+
+static size_t _rounds(const size_t per_round) {
+	const size_t rounds = BENCH_OPS / (per_round == 0 ? 1 : per_round);
+	return rounds == 0 ? 1 : rounds;
+}
+
+/* The engines. */
+
+static const int _value = 0;
+
+static void *_tst_create() {
+	return calloc(1, sizeof(struct _tst_map_node *));
+}
+
+static void _tst_insert(void *map, const struct _ident *id) {
+	_tst_map_insert((struct _tst_map_node **)map, id->str, id->len, &_value, sizeof(_value));
+}
+
+static int _tst_get(void *map, const struct _ident *id) {
+	return _tst_map_get(*(struct _tst_map_node **)map, id->str, id->len) != NULL;
+}
+
+static void _tst_destroy(void *map) {
+	_tst_map_destroy(*(struct _tst_map_node **)map, NULL);
+	free(map);
+}
+
+static void *_str_create() {
+	return calloc(1, sizeof(struct _str_map));
+}
+
+static void _str_insert(void *map, const struct _ident *id) {
+	_str_map_insert(map, id->str, id->len, &_value, sizeof(_value));
+}
+
+static int _str_get(void *map, const struct _ident *id) {
+	return _str_map_get(map, id->str, id->len) != NULL;
+}
+
+static void _str_destroy(void *map) {
+	_str_map_clear(map, NULL);
+	free(map);
+}
+
+static const struct _engine _engines[] = {
+	{ "tst", &_tst_create, &_tst_insert, &_tst_get, &_tst_destroy },
+	{ "str_map", &_str_create, &_str_insert, &_str_get, &_str_destroy }
+};
+#define ENGINE_COUNT (sizeof(_engines) / sizeof(_engines[0]))
+
+/* Builds a map out of `keys` over and over, timing inserts and destroys.
+ * Returns the last one built, for looking things up in.
+ */
+static void *_bench_build(const struct _engine *e, const vector *keys, struct _measure *insert, struct _measure *destroy) {
+	struct _timer insert_timer = {0};
+	struct _timer destroy_timer = {0};
+	const size_t rounds = _rounds(keys->count);
+	void *map = NULL;
+	size_t round, i;
+	for (round = 0; round < rounds; round++) {
+		map = e->create();
+		_timer_start(&insert_timer);
+		for (i = 0; i < keys->count; i++)
+			e->insert(map, _ident_at(keys, i));
+		_timer_stop(&insert_timer);
+
+		/* Keep the last one around to look things up in, but make sure there
+		 * was at least one destroy to time.
+		 */
+		if (round + 1 == rounds || (round > 0 && insert_timer.ns > BENCH_MAX_NS))
+			break;
+		_timer_start(&destroy_timer);
+		e->destroy(map);
+		_timer_stop(&destroy_timer);
+	}
+
+	*insert = _per_op(&insert_timer, (round + 1) * keys->count);
+	*destroy = _per_op(&destroy_timer, round * keys->count);
+	return map;
+}
+
+static struct _measure _bench_lookups(const struct _engine *e, void *map, const vector *queries) {
+	struct _timer timer = {0};
+	volatile size_t found = 0;
+	const size_t rounds = _rounds(queries->count);
+	size_t round, i;
+	for (round = 0; round < rounds && timer.ns < BENCH_MAX_NS; round++) {
+		_timer_start(&timer);
+		for (i = 0; i < queries->count; i++)
+			found += e->get(map, _ident_at(queries, i));
+		_timer_stop(&timer);
+	}
+	return _per_op(&timer, round * queries->count);
+}
+
+/* Made-up keys. */
+
+static uint64_t _rng = 0x9e3779b97f4a7c15ull;
+
+static uint64_t _random() {
+	_rng ^= _rng << 13;
+	_rng ^= _rng >> 7;
+	_rng ^= _rng << 17;
+	return _rng;
+}
+
+struct _key_shape {
+	const char *name;
+	size_t min_len;
+	size_t max_len;
+	const char *prefix; /*	Every key starts with this. */
+};
+
+static const struct _key_shape _shapes[] = {
+	{ "short", 3, 12, "" },
+	{ "long", 48, 160, "/usr/local/share/lair/programs/" }
+};
+
+static const size_t _sizes[] = { 16, 256, 4096, 65536 };
+
+/* Keys are lowercase; the key a miss is made from gets an uppercase letter on
+ * the end, so it looks like a hit right up until the last byte.
+ */
+static void _make_keys(const struct _key_shape *shape, const size_t count, vector *keys, vector *misses) {
+	struct _str_map unique = {0};
+	const size_t prefix_len = strlen(shape->prefix);
+	while (keys->count < count) {
+		const size_t len = shape->min_len + _random() % (shape->max_len - shape->min_len + 1);
+		char *str = malloc(len + 2);
+		memcpy(str, shape->prefix, prefix_len);
+		size_t i;
+		for (i = prefix_len; i < len; i++)
+			str[i] = 'a' + _random() % 26;
+
+		if (_str_map_insert(&unique, str, len, &_value, sizeof(_value)) != 0) {
+			free(str);
+			continue;
+		}
+		const struct _ident key = { .str = str, .len = len };
+		vector_append(keys, &key, sizeof(key));
+
+		char *miss_str = malloc(len + 2);
+		memcpy(miss_str, str, len);
+		miss_str[len] = 'A' + _random() % 26;
+		const struct _ident miss = { .str = miss_str, .len = len + 1 };
+		vector_append(misses, &miss, sizeof(miss));
+	}
+	_str_map_clear(&unique, NULL);
+}
+
+/* A shuffled stream of lookups, `hit_percent` of which are for keys that are there. */
+static void _make_queries(const vector *keys, const vector *misses, const int hit_percent, vector *queries) {
+	const size_t count = keys->count > BENCH_QUERIES ? keys->count : BENCH_QUERIES;
+	size_t i;
+	for (i = 0; i < count; i++) {
+		const vector *from = (int)(_random() % 100) < hit_percent ? keys : misses;
+		vector_append(queries, _ident_at(from, _random() % from->count), sizeof(struct _ident));
+	}
+}
+
+static void _free_keys(vector *keys) {
+	size_t i;
+	for (i = 0; i < keys->count; i++)
+		free((char *)_ident_at(keys, i)->str);
+	vector_free(keys);
+}
+
+static const int _hit_percents[] = { 100, 50, 0 };
+#define HIT_PERCENT_COUNT (sizeof(_hit_percents) / sizeof(_hit_percents[0]))
+
+static void _bench_synthetic_maps() {
+	printf("Maps, made-up keys.\n");
+	printf("%-8s %-6s %6s %15s %15s %15s %15s %15s\n",
+		"ns/op", "keys", "count", "insert", "100% hit", "50% hit", "0% hit", "destroy");
+
+	size_t s, n, h, e;
+	for (s = 0; s < sizeof(_shapes) / sizeof(_shapes[0]); s++) {
+		for (n = 0; n < sizeof(_sizes) / sizeof(_sizes[0]); n++) {
+			vector *keys = vector_new(sizeof(struct _ident), _sizes[n]);
+			vector *misses = vector_new(sizeof(struct _ident), _sizes[n]);
+			_make_keys(&_shapes[s], _sizes[n], keys, misses);
+
+			vector *queries[HIT_PERCENT_COUNT];
+			for (h = 0; h < HIT_PERCENT_COUNT; h++) {
+				queries[h] = vector_new(sizeof(struct _ident), BENCH_QUERIES);
+				_make_queries(keys, misses, _hit_percents[h], queries[h]);
+			}
+
+			for (e = 0; e < ENGINE_COUNT; e++) {
+				struct _measure insert, destroy;
+				void *map = _bench_build(&_engines[e], keys, &insert, &destroy);
+
+				printf("%-8s %-6s %6zu", _engines[e].name, _shapes[s].name, _sizes[n]);
+				_print_measure(&insert);
+				for (h = 0; h < HIT_PERCENT_COUNT; h++) {
+					const struct _measure lookup = _bench_lookups(&_engines[e], map, queries[h]);
+					_print_measure(&lookup);
+				}
+				_engines[e].destroy(map);
+				_print_measure(&destroy);
+				printf("\n");
+			}
+
+			for (h = 0; h < HIT_PERCENT_COUNT; h++)
+				vector_free(queries[h]);
+			_free_keys(keys);
+			_free_keys(misses);
+		}
+	}
+	printf("\n");
+}
+
+/* Vectors hold values the size of a `_lair_val` or of a `struct _ident`. */
+static void _bench_vector(const size_t item_size, const size_t count) {
+	char item[64] = {0};
+	struct _timer append_timer = {0};
+	const size_t rounds = _rounds(count);
+	vector *vec = NULL;
+	size_t round, i;
+	for (round = 0; round < rounds; round++) {
+		if (vec != NULL)
+			vector_free(vec);
+		vec = vector_new(item_size, 16);
+		_timer_start(&append_timer);
+		for (i = 0; i < count; i++)
+			vector_append(vec, item, item_size);
+		_timer_stop(&append_timer);
+	}
+	const struct _measure append = _per_op(&append_timer, rounds * count);
+
+	/* Random reads go through a precomputed list so the RNG isn't timed. */
+	unsigned int *order = malloc(count * sizeof(unsigned int));
+	for (i = 0; i < count; i++)
+		order[i] = _random() % count;
+
+	volatile char sink = 0;
+	struct _timer seq_timer = {0};
+	_timer_start(&seq_timer);
+	for (round = 0; round < rounds; round++) {
+		for (i = 0; i < count; i++)
+			sink ^= *(const char *)vector_get(vec, i);
+	}
+	_timer_stop(&seq_timer);
+	const struct _measure seq = _per_op(&seq_timer, rounds * count);
+
+	struct _timer rand_timer = {0};
+	_timer_start(&rand_timer);
+	for (round = 0; round < rounds; round++) {
+		for (i = 0; i < count; i++)
+			sink ^= *(const char *)vector_get(vec, order[i]);
+	}
+	_timer_stop(&rand_timer);
+	const struct _measure at_random = _per_op(&rand_timer, rounds * count);
+
+	printf("%-8s %6zu %6zu", "vector", item_size, count);
+	_print_measure(&append);
+	_print_measure(&seq);
+	_print_measure(&at_random);
+	printf("\n");
+
+	free(order);
+	vector_free(vec);
+}
+
+static void _bench_vectors() {
+	printf("Vectors.\n");
+	printf("%-8s %6s %6s %15s %15s %15s\n", "ns/op", "item", "count", "append", "get in order", "get at random");
+	const size_t item_sizes[] = { sizeof(void *), sizeof(struct _ident) };
+	size_t s, n;
+	for (s = 0; s < sizeof(item_sizes) / sizeof(item_sizes[0]); s++) {
+		for (n = 0; n < sizeof(_sizes) / sizeof(_sizes[0]); n++)
+			_bench_vector(item_sizes[s], _sizes[n]);
+	}
+	printf("\n");
+}
+
+/* Identifiers from real programs. */
+
+static int _is_name(const char *word, const size_t len) {
+	if (len == 1 && (word[0] == ':' || word[0] == '!' || word[0] == '?'))
+		return 0;
+	size_t i;
+	for (i = 0; i < len; i++) {
+		if (word[i] < '0' || word[i] > '9')
+			return 1;
+	}
+	return 0;
+}
+
+/* Splits a program into words the same way the tokenizer does, and keeps the
+ * ones that would be interned.
+ */
+static void _collect(struct _idents *ids, struct _str_map *unique, const char *buf, const size_t len) {
+	size_t i = 0;
+	while (i < len) {
+		const char c = buf[i];
+		if (c == ' ' || c == '\n' || c == '\r' || c == '\t') {
+			i++;
+		} else if (c == '#') {
+			while (i < len && buf[i] != '\n')
+				i++;
+		} else if (c == '"') {
+			i++;
+			while (i < len && buf[i] != '"' && buf[i] != '\n')
+				i++;
+			i++;
+		} else {
+			const size_t start = i;
+			while (i < len && buf[i] != ' ' && buf[i] != '\n' && buf[i] != '\r')
+				i++;
+			if (!_is_name(buf + start, i - start))
+				continue;
+
+			const struct _ident ident = { .str = buf + start, .len = i - start };
+			vector_append(ids->seen, &ident, sizeof(ident));
+			if (_str_map_insert(unique, ident.str, ident.len, &_value, sizeof(_value)) == 0)
+				vector_append(ids->unique, &ident, sizeof(ident));
+		}
+	}
+}
+
+static int _load(struct _idents *ids, const char *path, struct _str_map *unique) {
+	FILE *f = fopen(path, "rb");
+	if (f == NULL)
+		return 1;
+
+	fseek(f, 0, SEEK_END);
+	const long len = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	char *buf = malloc(len + 1);
+	if (buf == NULL || fread(buf, 1, len, f) != (size_t)len) {
+		free(buf);
+		fclose(f);
+		return 1;
+	}
+	fclose(f);
+
+	vector_append_ptr(ids->buffers, buf);
+	_collect(ids, unique, buf, len);
+	return 0;
+}
+
+/* Misses look like the hits, so they take just as long to rule out. */
+static void _make_misses(struct _idents *ids) {
+	size_t i;
+	for (i = 0; i < ids->unique->count; i++) {
+		const struct _ident *hit = _ident_at(ids->unique, i);
+		char *str = malloc(hit->len + 1);
+		memcpy(str, hit->str, hit->len);
+		str[hit->len] = '\x01';
+		const struct _ident miss = { .str = str, .len = hit->len + 1 };
+		vector_append(ids->misses, &miss, sizeof(miss));
+	}
+}
+
+static int _bench_identifiers(char **paths, const size_t npaths) {
+	struct _idents ids = {
+		.seen = vector_new(sizeof(struct _ident), 1024),
+		.unique = vector_new(sizeof(struct _ident), 256),
+		.misses = vector_new(sizeof(struct _ident), 256),
+		.buffers = vector_new(sizeof(char *), 16)
+	};
+	struct _str_map unique = {0};
+	int rc = 0;
+
+	size_t i;
+	for (i = 0; i < npaths; i++) {
+		if (_load(&ids, paths[i], &unique) != 0) {
+			fprintf(stderr, "Could not load %s.\n", paths[i]);
+			rc = 1;
+			goto done;
+		}
+	}
+	if (ids.unique->count == 0) {
+		fprintf(stderr, "No identifiers in those files.\n");
+		rc = 1;
+		goto done;
+	}
+	_make_misses(&ids);
+
+	printf("Maps, %zu files, %zu identifiers, %zu unique.\n", npaths, ids.seen->count, ids.unique->count);
+	printf("%-10s %15s %15s %15s %15s\n", "ns/op", "insert", "hit", "miss", "destroy");
+	size_t e;
+	for (e = 0; e < ENGINE_COUNT; e++) {
+		struct _measure insert, destroy;
+		void *map = _bench_build(&_engines[e], ids.unique, &insert, &destroy);
+		const struct _measure hit = _bench_lookups(&_engines[e], map, ids.seen);
+		const struct _measure miss = _bench_lookups(&_engines[e], map, ids.misses);
+		_engines[e].destroy(map);
+
+		printf("%-10s", _engines[e].name);
+		_print_measure(&insert);
+		_print_measure(&hit);
+		_print_measure(&miss);
+		_print_measure(&destroy);
+		printf("\n");
+	}
+
+done:
+	for (i = 0; i < ids.misses->count; i++)
+		free((char *)_ident_at(ids.misses, i)->str);
+	for (i = 0; i < ids.buffers->count; i++)
+		free(*(char **)vector_get(ids.buffers, i));
+	vector_free(ids.seen);
+	vector_free(ids.unique);
+	vector_free(ids.misses);
+	vector_free(ids.buffers);
+	_str_map_clear(&unique, NULL);
+	return rc;
+}
+
+int main(int argc, char *argv[]) {
+	_perf_open();
+	if (_perf_fd < 0)
+		printf("Can't count cache misses here, so there won't be any.\n\n");
+
+	if (argc > 1)
+		return _bench_identifiers(argv + 1, argc - 1);
+
+	_bench_synthetic_maps();
+	_bench_vectors();
+
+	glob_t found = {0};
+	if (glob("t/*.den", 0, NULL, &found) != 0) {
+		fprintf(stderr, "No programs in t/ to pull identifiers out of.\n");
+		return 1;
+	}
+	const int rc = _bench_identifiers(found.gl_pathv, found.gl_pathc);
+	globfree(&found);
+	return rc;
+}
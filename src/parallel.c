@@ -0,0 +1,581 @@
+// vim: noet ts=4 sw=4
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "collections.h"
+#include "compile.h"
+#include "error.h"
+#include "eval.h"
+#include "gc.h"
+#include "lair.h"
+#include "memory.h"
+#include "parallel.h"
+#include "vector.h"
+#include "vm.h"
+
+/* How many pieces `_lair_parallel_map` and `_lair_parallel_reduce` split
+ * their work into for each thread, so threads that finish early have more
+ * to do.
+ */
+#define TASKS_PER_THREAD	4
+#define MAX_TASKS			(TASKS_PER_THREAD * (LR_MAX_WORKERS + 1))
+
+typedef enum {
+	TASK_CALL, /*	Make one call. */
+	TASK_MAP, /*	Call a function on each of a run of items. */
+	TASK_REDUCE /*	Combine a run of items with a function. */
+} TASK_KIND;
+
+typedef enum {
+	TASK_QUEUED, /*	Waiting for somebody to run it. */
+	TASK_RUNNING, /*	Somebody is. */
+	TASK_DONE /*	It's finished, one way or another. */
+} TASK_STATE;
+
+struct _lair_task {
+	struct _lair_task *prev; /*	The task queued before this one. */
+	struct _lair_task *next; /*	The task queued after this one. */
+	TASK_STATE state; /*	Only changed with the lock held. */
+	TASK_KIND kind; /*	What it does. */
+	struct _lair_parallel *parallel; /*	What's known about the program. */
+	struct _lair_symbols *symbols; /*	The symbols of the runtime that forked it. */
+	struct _lair_runtime *r; /*	The runtime it ran in. NULL until it runs. */
+	size_t proto; /*	The function. */
+	const struct _lair_vector *items; /*	What a map or a reduce goes over. NULL for the numbers from 0 up. */
+	size_t start; /*	The first of them it does. */
+	size_t end; /*	One past the last. */
+	_lair_val *results; /*	What each call a map made returned. Held by its runtime. */
+	_lair_val result; /*	What the call or the reduce came to. */
+	ERROR_TYPE error_type; /*	What kind of error it had, if it had one. */
+	char *error; /*	What the error said. NULL if there wasn't one. */
+	_lair_val args[]; /*	The arguments. */
+};
+
+/* The pool. Tasks are run oldest first, since those are the ones that are
+ * likely to have the most work left in them.
+ */
+static pthread_mutex_t _lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t _finished = PTHREAD_COND_INITIALIZER;
+static struct _lair_task *_oldest = NULL;
+static struct _lair_task *_newest = NULL;
+static size_t _nworkers = 0;
+
+static void _enqueue(struct _lair_task *task) {
+	task->state = TASK_QUEUED;
+	task->prev = _newest;
+	task->next = NULL;
+	if (_newest != NULL)
+		_newest->next = task;
+	else
+		_oldest = task;
+	_newest = task;
+}
+
+static void _dequeue(struct _lair_task *task) {
+	if (task->prev != NULL)
+		task->prev->next = task->next;
+	else
+		_oldest = task->next;
+	if (task->next != NULL)
+		task->next->prev = task->prev;
+	else
+		_newest = task->prev;
+	task->prev = task->next = NULL;
+}
+
+static uint64_t _now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static inline _lair_val _item(const struct _lair_vector *items, const size_t i) {
+	return items != NULL ? _lair_vector_get(items, i) : LR_INT((int)i);
+}
+
+/* Calls a function, builtin or not, on top of whatever's running. */
+static _lair_val _call(
+		struct _lair_runtime *r,
+		const struct _lair_program *program,
+		const size_t proto,
+		const _lair_val *args) {
+	const struct _lair_proto *p = &((const struct _lair_proto *)program->protos->items)[proto];
+	if (p->builtin != NULL)
+		return p->builtin->function_ptr(r, p->argc, args);
+	return _lair_vm_call(r, program, proto, args);
+}
+
+/* Does a map's or a reduce's share of the work. The VM's kept between calls,
+ * and what they return is held until whoever joins the task takes it.
+ */
+static void _run_items(struct _lair_runtime *r, struct _lair_task *task, const struct _lair_program *program) {
+	_lair_vm_new(r, program);
+	size_t i;
+	if (task->kind == TASK_MAP) {
+		task->results = _lair_gc_hold(r, task->end - task->start);
+		for (i = task->start; i < task->end; i++) {
+			const _lair_val item = _item(task->items, i);
+			task->results[i - task->start] = _call(r, program, task->proto, &item);
+		}
+	} else {
+		_lair_val *acc = _lair_gc_hold(r, 1);
+		acc[0] = _item(task->items, task->start);
+		for (i = task->start + 1; i < task->end; i++) {
+			const _lair_val args[2] = { acc[0], _item(task->items, i) };
+			acc[0] = _call(r, program, task->proto, args);
+		}
+		task->result = acc[0];
+	}
+	_lair_vm_end(r);
+}
+
+/* Does the work in a runtime of its own. Whatever goes wrong stays in the
+ * task, for whoever joins it.
+ */
+static void _run(struct _lair_task *task) {
+	const uint64_t start = _now_ns();
+	struct _lair_runtime *r = calloc(1, sizeof(struct _lair_runtime));
+	task->r = r;
+	if (r == NULL) {
+		task->error_type = ERR_RUNTIME;
+		task->error = strdup("Out of memory forking a call.");
+		return;
+	}
+	r->memory = _lair_memory_new();
+	r->gc = _lair_gc_new();
+	r->symbols = task->symbols;
+	r->parallel = task->parallel;
+	r->options.out = stdout;
+
+	if (setjmp(r->exception_buffer)) {
+		task->error_type = r->exception_type;
+		task->error = r->exception_msg != NULL ? r->exception_msg : strdup("Forked call failed.");
+		r->exception_msg = NULL;
+		return;
+	}
+
+	check(r, r->memory != NULL && r->gc != NULL, ERR_RUNTIME, "Out of memory forking a call.");
+	const struct _lair_program *program = task->parallel->program;
+	_lair_memory_sites(r, program);
+	if (task->kind != TASK_CALL) {
+		_run_items(r, task, program);
+		return;
+	}
+	task->result = _lair_vm_call(r, program, task->proto, task->args);
+
+	/* Races between threads finishing the same function at once only lose
+	 * a measurement.
+	 */
+	const uint64_t took = _now_ns() - start;
+	_Atomic uint64_t *cost = &task->parallel->cost[task->proto];
+	const uint64_t was = atomic_load_explicit(cost, memory_order_relaxed);
+	const uint64_t now = was == 0 ? took : (was * 3 + took) / 4;
+	atomic_store_explicit(cost, now == 0 ? 1 : now, memory_order_relaxed);
+}
+
+/* Runs a task that's just come off the queue. Called with the lock held, and
+ * returns with it held.
+ */
+static void _run_locked(struct _lair_task *task) {
+	task->state = TASK_RUNNING;
+	pthread_mutex_unlock(&_lock);
+	_run(task);
+	pthread_mutex_lock(&_lock);
+	task->state = TASK_DONE;
+	pthread_cond_broadcast(&_finished);
+}
+
+/* Waits for a task with the lock held. If nobody's started on it we do it
+ * ourselves. Otherwise, if `help` is set, we run whatever's queued until it's
+ * done.
+ */
+static void _wait(struct _lair_task *task, const int help) {
+	if (task->state == TASK_QUEUED) {
+		_dequeue(task);
+		_run_locked(task);
+		return;
+	}
+	while (task->state != TASK_DONE) {
+		if (help && _oldest != NULL) {
+			struct _lair_task *other = _oldest;
+			_dequeue(other);
+			_run_locked(other);
+		} else {
+			pthread_cond_wait(&_finished, &_lock);
+		}
+	}
+}
+
+static void _task_free(struct _lair_task *task) {
+	struct _lair_runtime *r = task->r;
+	if (r != NULL) {
+		/* The VM's only still there if something failed. The symbols aren't ours. */
+		_lair_vm_free(r->vm);
+		_lair_gc_free(r->gc);
+		_lair_memory_free(r->memory);
+		free(r->exception_msg);
+		free(r);
+	}
+	atomic_fetch_sub(&task->parallel->outstanding, 1);
+	free(task->error);
+	free(task);
+}
+
+static void *_work(void *unused) {
+	(void)unused;
+	pthread_mutex_lock(&_lock);
+	for (;;) {
+		while (_oldest == NULL)
+			pthread_cond_wait(&_queued, &_lock);
+		struct _lair_task *task = _oldest;
+		_dequeue(task);
+		_run_locked(task);
+	}
+	return NULL;
+}
+
+/* Starts workers until there are enough, or we can't start any more. Returns
+ * how many of them we can have.
+ */
+static size_t _start_workers(const size_t wanted) {
+	pthread_mutex_lock(&_lock);
+	while (_nworkers < wanted && _nworkers < LR_MAX_WORKERS) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, _work, NULL) != 0)
+			break;
+		pthread_detach(thread);
+		_nworkers++;
+	}
+	const size_t workers = _nworkers < wanted ? _nworkers : wanted;
+	pthread_mutex_unlock(&_lock);
+	return workers;
+}
+
+struct _lair_parallel *_lair_parallel_new(
+		struct _lair_runtime *r,
+		const struct _lair_program *program,
+		const int threads,
+		const size_t cost) {
+	const struct _lair_proto *protos = (const struct _lair_proto *)program->protos->items;
+	const size_t nprotos = program->protos->count;
+	struct _lair_parallel *parallel = calloc(1, sizeof(struct _lair_parallel));
+	check(r, parallel != NULL, ERR_RUNTIME, "Out of memory starting the workers.");
+	/* So it gets freed if we run out of memory below. */
+	r->parallel = parallel;
+
+	parallel->program = program;
+	parallel->safe = calloc(nprotos + 1, sizeof(unsigned char));
+	parallel->cost = calloc(nprotos + 1, sizeof(_Atomic uint64_t));
+	check(r, parallel->safe != NULL && parallel->cost != NULL, ERR_RUNTIME, "Out of memory starting the workers.");
+
+	_lair_find_pure(program, parallel->safe, 0);
+	size_t p;
+	for (p = 0; p < nprotos; p++)
+		parallel->safe[p] = parallel->safe[p] && protos[p].builtin == NULL && p != program->main;
+
+	parallel->threshold = (uint64_t)(cost == 0 ? LR_PARALLEL_DEFAULT_COST : cost) * 1000;
+	parallel->workers = threads > 1 ? _start_workers(threads - 1) : 0;
+	return parallel;
+}
+
+struct _lair_task *_lair_fork(
+		struct _lair_runtime *r,
+		struct _lair_parallel *parallel,
+		const size_t proto,
+		const _lair_val *args) {
+	if (!parallel->safe[proto])
+		return NULL;
+	const uint64_t cost = atomic_load_explicit(&parallel->cost[proto], memory_order_relaxed);
+	if (cost != 0 && cost < parallel->threshold)
+		return NULL;
+
+	const struct _lair_proto *protos = (const struct _lair_proto *)parallel->program->protos->items;
+	const int argc = protos[proto].argc;
+	int i;
+	for (i = 0; i < argc; i++)
+		if (!LR_IS_INT(args[i]) && !LR_IS_BOOL(args[i]))
+			return NULL;
+
+	/* A little more than the workers can take on, so whoever finishes first
+	 * has something to move on to.
+	 */
+	if (atomic_fetch_add(&parallel->outstanding, 1) >= 2 * parallel->workers) {
+		atomic_fetch_sub(&parallel->outstanding, 1);
+		return NULL;
+	}
+
+	struct _lair_task *task = calloc(1, sizeof(struct _lair_task) + argc * sizeof(_lair_val));
+	if (task == NULL) {
+		atomic_fetch_sub(&parallel->outstanding, 1);
+		return NULL;
+	}
+	task->parallel = parallel;
+	task->symbols = r->symbols;
+	task->proto = proto;
+	memcpy(task->args, args, argc * sizeof(_lair_val));
+	atomic_fetch_add(&parallel->forks, 1);
+
+	pthread_mutex_lock(&_lock);
+	_enqueue(task);
+	pthread_cond_signal(&_queued);
+	pthread_mutex_unlock(&_lock);
+	return task;
+}
+
+/* Waits for every one of some tasks. If any of them failed they're all freed,
+ * and the first one's error is thrown.
+ */
+static void _wait_all(struct _lair_runtime *r, struct _lair_task **tasks, const size_t ntasks) {
+	size_t t;
+	pthread_mutex_lock(&_lock);
+	for (t = 0; t < ntasks; t++)
+		_wait(tasks[t], 1);
+	pthread_mutex_unlock(&_lock);
+
+	const struct _lair_task *failed = NULL;
+	for (t = 0; t < ntasks && failed == NULL; t++)
+		if (tasks[t]->error != NULL)
+			failed = tasks[t];
+	if (failed == NULL)
+		return;
+
+	const ERROR_TYPE type = failed->error_type;
+	char msg[512] = {0};
+	snprintf(msg, sizeof(msg), "%s", failed->error);
+	for (t = 0; t < ntasks; t++)
+		_task_free(tasks[t]);
+	throw_exception(r, type, msg);
+}
+
+void _lair_join(struct _lair_runtime *r, const struct _lair_fork *forks, const size_t nforks, _lair_val *regs) {
+	struct _lair_task *tasks[nforks];
+	size_t f;
+	for (f = 0; f < nforks; f++)
+		tasks[f] = forks[f].task;
+	_wait_all(r, tasks, nforks);
+
+	/* Nothing gets allocated while we're doing this, so the results can't
+	 * be collected before they're in the registers.
+	 */
+	for (f = 0; f < nforks; f++) {
+		_lair_gc_adopt(r, tasks[f]->r);
+		regs[forks[f].reg] = tasks[f]->result;
+		_task_free(tasks[f]);
+	}
+}
+
+/* The program whatever's running in this runtime came from. Runtimes running
+ * forks don't have one of their own.
+ */
+static inline const struct _lair_program *_program(const struct _lair_runtime *r) {
+	return r->parallel != NULL ? r->parallel->program : r->program;
+}
+
+/* Checks what a map or a reduce was given, and works out what it goes over. */
+static size_t _check_args(
+		struct _lair_runtime *r,
+		const char *name,
+		const _lair_val f,
+		const int argc,
+		const _lair_val things,
+		const struct _lair_vector **items,
+		size_t *count) {
+	char buf[512] = {0};
+	if (_lair_type_of(f) != LR_FUNCTION_DEF || LR_UNBOX(f)->proto < 0) {
+		snprintf(buf, sizeof(buf), "'%s' needs a function to call.", name);
+		throw_exception(r, ERR_RUNTIME, buf);
+	}
+	const size_t proto = (size_t)LR_UNBOX(f)->proto;
+	const struct _lair_proto *protos = (const struct _lair_proto *)_program(r)->protos->items;
+	if (protos[proto].argc != argc) {
+		snprintf(buf, sizeof(buf), "The function given to '%s' has to take %d argument%s.", name, argc, argc == 1 ? "" : "s");
+		throw_exception(r, ERR_RUNTIME, buf);
+	}
+
+	switch (_lair_type_of(things)) {
+		case LR_VECTOR:
+			*items = LR_UNBOX(things)->value.vector;
+			*count = (*items)->count;
+			break;
+		case LR_NUM:
+			check(r, _lair_num_of(things) >= 0, ERR_RUNTIME, "Can't count up to a negative number.");
+			*items = NULL;
+			*count = (size_t)_lair_num_of(things);
+			break;
+		default:
+			snprintf(buf, sizeof(buf), "'%s' goes over a vector, or the numbers up to a number.", name);
+			throw_exception(r, ERR_RUNTIME, buf);
+	}
+	return proto;
+}
+
+/* Whether a map's or a reduce's work can be handed out. The items have to be
+ * numbers or booleans for the same reason forked calls' arguments do.
+ */
+static int _can_split(
+		const struct _lair_runtime *r,
+		const size_t proto,
+		const struct _lair_vector *items,
+		const size_t count) {
+	const struct _lair_parallel *parallel = r->parallel;
+	if (parallel == NULL || parallel->workers == 0 || count < 2)
+		return 0;
+	const struct _lair_proto *p = &((const struct _lair_proto *)parallel->program->protos->items)[proto];
+	if (p->builtin != NULL ? p->builtin->io : !parallel->safe[proto])
+		return 0;
+	if (items != NULL) {
+		size_t i;
+		for (i = 0; i < count; i++) {
+			const _lair_val item = _lair_vector_get(items, i);
+			if (!LR_IS_INT(item) && !LR_IS_BOOL(item))
+				return 0;
+		}
+	}
+	return 1;
+}
+
+/* How many runs to split a map's or a reduce's items into. */
+static inline size_t _ntasks(const struct _lair_parallel *parallel, const size_t count) {
+	const size_t ntasks = TASKS_PER_THREAD * (parallel->workers + 1);
+	return ntasks < count ? ntasks : count;
+}
+
+/* Splits a map's or a reduce's items into runs, and queues a task for each.
+ * Every run has at least one item in it.
+ */
+static size_t _split(
+		struct _lair_runtime *r,
+		const TASK_KIND kind,
+		const size_t proto,
+		const struct _lair_vector *items,
+		const size_t count,
+		struct _lair_task **tasks) {
+	struct _lair_parallel *parallel = r->parallel;
+	const size_t ntasks = _ntasks(parallel, count);
+
+	size_t t;
+	for (t = 0; t < ntasks; t++) {
+		struct _lair_task *task = calloc(1, sizeof(struct _lair_task));
+		if (task == NULL) {
+			while (t-- > 0)
+				_task_free(tasks[t]);
+			throw_exception(r, ERR_RUNTIME, "Out of memory splitting up work.");
+		}
+		atomic_fetch_add(&parallel->outstanding, 1);
+		task->kind = kind;
+		task->parallel = parallel;
+		task->symbols = r->symbols;
+		task->proto = proto;
+		task->items = items;
+		task->start = count * t / ntasks;
+		task->end = count * (t + 1) / ntasks;
+		tasks[t] = task;
+	}
+	atomic_fetch_add(&parallel->forks, ntasks);
+
+	pthread_mutex_lock(&_lock);
+	for (t = 0; t < ntasks; t++)
+		_enqueue(tasks[t]);
+	pthread_cond_broadcast(&_queued);
+	pthread_mutex_unlock(&_lock);
+	return ntasks;
+}
+
+_lair_val _lair_parallel_map(struct _lair_runtime *r, const _lair_val f, const _lair_val things) {
+	const struct _lair_program *program = _program(r);
+	const struct _lair_vector *items;
+	size_t count;
+	const size_t proto = _check_args(r, "pmap", f, 1, things, &items, &count);
+
+	/* The results, and then the vector they go in. */
+	_lair_val *held = _lair_gc_hold(r, count + 1);
+	size_t i;
+	if (_can_split(r, proto, items, count)) {
+		struct _lair_task *tasks[MAX_TASKS];
+		const size_t ntasks = _split(r, TASK_MAP, proto, items, count, tasks);
+		_wait_all(r, tasks, ntasks);
+
+		size_t t;
+		for (t = 0; t < ntasks; t++) {
+			struct _lair_task *task = tasks[t];
+			memcpy(held + task->start, task->results, (task->end - task->start) * sizeof(_lair_val));
+			_lair_gc_adopt(r, task->r);
+			_task_free(task);
+		}
+	} else {
+		for (i = 0; i < count; i++) {
+			const _lair_val item = _item(items, i);
+			held[i] = _call(r, program, proto, &item);
+		}
+	}
+
+	held[count] = _lair_vector_new(r);
+	for (i = 0; i < count; i++)
+		held[count] = _lair_vector_push(r, held[count], held[i]);
+	const _lair_val result = held[count];
+	_lair_gc_release(r);
+	return result;
+}
+
+_lair_val _lair_parallel_reduce(struct _lair_runtime *r, const _lair_val f, const _lair_val init, const _lair_val things) {
+	const struct _lair_program *program = _program(r);
+	const struct _lair_vector *items;
+	size_t count;
+	const size_t proto = _check_args(r, "preduce", f, 2, things, &items, &count);
+
+	_lair_val *acc;
+	if (_can_split(r, proto, items, count)) {
+		/* What it's come to so far, and then what each run came to. */
+		acc = _lair_gc_hold(r, _ntasks(r->parallel, count) + 1);
+		acc[0] = init;
+		struct _lair_task *tasks[MAX_TASKS];
+		const size_t ntasks = _split(r, TASK_REDUCE, proto, items, count, tasks);
+		_wait_all(r, tasks, ntasks);
+
+		size_t t;
+		for (t = 0; t < ntasks; t++) {
+			acc[t + 1] = tasks[t]->result;
+			_lair_gc_adopt(r, tasks[t]->r);
+			_task_free(tasks[t]);
+		}
+		for (t = 0; t < ntasks; t++) {
+			const _lair_val args[2] = { acc[0], acc[t + 1] };
+			acc[0] = _call(r, program, proto, args);
+		}
+	} else {
+		acc = _lair_gc_hold(r, 1);
+		acc[0] = init;
+		size_t i;
+		for (i = 0; i < count; i++) {
+			const _lair_val args[2] = { acc[0], _item(items, i) };
+			acc[0] = _call(r, program, proto, args);
+		}
+	}
+
+	const _lair_val result = acc[0];
+	_lair_gc_release(r);
+	return result;
+}
+
+void _lair_fork_drop(struct _lair_task *task) {
+	pthread_mutex_lock(&_lock);
+	if (task->state == TASK_QUEUED) {
+		_dequeue(task);
+		task->state = TASK_DONE;
+	}
+	_wait(task, 0);
+	pthread_mutex_unlock(&_lock);
+	_task_free(task);
+}
+
+void _lair_parallel_free(struct _lair_parallel *parallel) {
+	if (parallel == NULL)
+		return;
+
+	free(parallel->safe);
+	free(parallel->cost);
+	free(parallel);
+}
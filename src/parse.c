@@ -1,10 +1,13 @@
 // vim: noet ts=4 sw=4
 #include <inttypes.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 
+#include "arena.h"
 #include "error.h"
+#include "lair.h"
 #include "parse.h"
 
 inline char *_friendly_enum(const LAIR_TOKEN val) {
@@ -25,6 +28,10 @@ inline char *_friendly_enum(const LAIR_TOKEN val) {
 		case LR_IF:				return "IF";
 		case LR_BOOL:			return "BOOL";
 		case LR_EOF:			return "EOF";
+		case LR_ROPE:			return "ROPE";
+		case LR_VECTOR:			return "VECTOR";
+		case LR_MAP:			return "MAP";
+		case LR_NODE:			return "NODE";
 		default:				return "ERR";
 	}
 }
@@ -37,7 +44,7 @@ void lair_print_tokens(const struct _lair_token *tokens) {
 		switch (cur_tok->token_type) {
 			case LR_FUNCTION_DEF:
 			case LR_FUNCTION_CALL:
-				printf("%s %s ", frnd, cur_tok->token_str);
+				printf("%s %.*s ", frnd, (int)cur_tok->token_len, cur_tok->token_str);
 				break;
 			case LR_DEDENT:
 				printf("\n}\n");
@@ -63,38 +70,13 @@ void lair_print_tokens(const struct _lair_token *tokens) {
 	printf("\n---\n");
 }
 
-static struct _str read_line(const char *buf) {
-	char c = '\0';
-
-	size_t num_read = 0;
-	while (1) {
-		c = buf[num_read];
-		num_read++;
-		if (c == '\0' || c == '\n' || c == '\r')
-			break;
-	}
-
-	char *data = calloc(1, num_read + 1);
-	strncpy(data, buf, num_read);
-
-	struct _str to_return = {
-		.size = num_read,
-		.data = data
-	};
-
-	return to_return;
+static inline int _is_line_break(const char c) {
+	return c == '\n' || c == '\r' || c == '\0';
 }
 
-static inline int _is_newline(const char *token) {
-	if (strncmp(token, "\n", strlen("\n")) == 0 ||
-		strncmp(token, "\r", strlen("\r")) == 0)
-		return 1;
-	return 0;
-}
-
-static inline int _is_all_numbers(const char *token) {
-	unsigned int i = 0;
-	for (; i < strlen(token); i++) {
+static inline int _is_all_numbers(const char *token, const size_t len) {
+	size_t i = 0;
+	for (; i < len; i++) {
 		/* ASCII numerical values are between 0x30 and 0x39. */
 		if ((int)token[i] < 0x30 || (int)token[i] > 0x39)
 			return 0;
@@ -102,32 +84,26 @@ static inline int _is_all_numbers(const char *token) {
 	return 1;
 }
 
-static inline void _strip(const char *from, char *to) {
-	unsigned int i = 0, j = 0;
-	for (;i < strlen(from);) {
-		while (from[i] == '\n' || from[i] == '\r')
-			i++;
-		if (i >= strlen(from))
-			break;
-		to[j] = from[i];
-		j++;
-		i++;
-	}
-	to[++j] = '\0';
+/* Where the word starting at `p` ends. Words are separated by spaces and never
+ * run past the end of a line.
+ */
+static inline const char *_word_end(const char *p, const char *end) {
+	while (p < end && *p != ' ' && !_is_line_break(*p))
+		p++;
+	return p;
 }
 
-static void _insert_token(struct _lair_token **head, struct _lair_token *to_insert) {
+static inline void _append_token(
+		struct _lair_token **head,
+		struct _lair_token **tail,
+		struct _lair_token *to_insert) {
 	if (*head == NULL) {
 		*head = to_insert;
-		return;
-	}
-
-	struct _lair_token *current = *head;
-	while (current->next != NULL) {
-		current = current->next;
+	} else {
+		(*tail)->next = to_insert;
+		to_insert->prev = *tail;
 	}
-	current->next = to_insert;
-	to_insert->prev = current;
+	*tail = to_insert;
 }
 
 static int _is_valid_string(const char *stripped, const size_t stripped_len) {
@@ -152,6 +128,13 @@ static int _is_operator(const char *stripped, const size_t stripped_len) {
 	}
 }
 
+static inline int _is_identifier(const LAIR_TOKEN type) {
+	return type == LR_FUNCTION_DEF ||
+		type == LR_FUNCTION_CALL ||
+		type == LR_FUNCTION_ARG ||
+		type == LR_ATOM;
+}
+
 static int _function_args_shadow_function(
 		const struct _lair_token *new_token,
 		const struct _lair_token **shadowed) {
@@ -162,9 +145,8 @@ static int _function_args_shadow_function(
 			break;
 		}
 
-		const int32_t cmp_result = strcmp(
-				new_token->token_str, cur->token_str);
-		if (cur->token_str != NULL && cmp_result == 0) {
+		if (cur->token_str != NULL && cur->token_len == new_token->token_len &&
+				memcmp(new_token->token_str, cur->token_str, cur->token_len) == 0) {
 			*shadowed = cur;
 			return 1;
 		}
@@ -175,11 +157,9 @@ static int _function_args_shadow_function(
 	return 0;
 }
 
-void _intuit_token_type(
-		struct _lair_runtime *r,
-		struct _lair_token *new_token,
-		const char *stripped) {
-	const size_t stripped_len = strlen(stripped);
+void _intuit_token_type(struct _lair_runtime *r, struct _lair_token *new_token) {
+	const char *stripped = new_token->token_str;
+	const size_t stripped_len = new_token->token_len;
 	if (stripped_len == 1) {
 		if (stripped[0] == ':')
 			new_token->token_type = LR_RETURN;
@@ -191,7 +171,7 @@ void _intuit_token_type(
 			new_token->token_type = LR_OPERATOR;
 		else if (_is_valid_string(stripped, stripped_len))
 			new_token->token_type = LR_STRING;
-		else if (_is_all_numbers(stripped))
+		else if (_is_all_numbers(stripped, stripped_len))
 			new_token->token_type = LR_NUM;
 		else
 			new_token->token_type = LR_ATOM;
@@ -201,158 +181,137 @@ void _intuit_token_type(
 				throw_exception(r, ERR_SYNTAX, "String has no ending \".");
 			else
 				new_token->token_type = LR_STRING;
-		} else if (_is_all_numbers(stripped))
+		} else if (_is_all_numbers(stripped, stripped_len))
 			new_token->token_type = LR_NUM;
 		else
 			new_token->token_type = LR_ATOM;
 	}
 }
 
+/* Works out what a freshly read token is from the one before it. */
+static void _classify_token(struct _lair_runtime *r, struct _lair_token *new_token) {
+	const int is_call = new_token->token_len == 1 && new_token->token_str[0] == '!';
+
+	if (new_token->prev == NULL || new_token->prev->token_type == LR_DEDENT) {
+		/* The start of a top-level line. */
+		new_token->token_type = is_call ? LR_CALL : LR_FUNCTION_DEF;
+		return;
+	}
+
+	if (is_call) {
+		new_token->token_type = LR_CALL;
+		return;
+	}
+
+	switch (new_token->prev->token_type) {
+		case LR_FUNCTION_DEF:
+		case LR_FUNCTION_ARG:
+			/* Strings can't be parameter names, so a string here means this
+			 * is a call with a string argument.
+			 */
+			if (new_token->token_str[0] != '"') {
+				const struct _lair_token *out = NULL;
+				new_token->token_type = LR_FUNCTION_ARG;
+				if (_function_args_shadow_function(new_token, &out)) {
+					char buf[512] = {0};
+					const char *msg = "Function argument names shadow function name: %.*s shadows %.*s";
+					snprintf(buf, sizeof(buf), msg,
+							(int)new_token->token_len, new_token->token_str,
+							(int)out->token_len, out->token_str);
+					throw_exception(r, ERR_PARSE, buf);
+				}
+				break;
+			}
+			/* fall through */
+		default:
+			_intuit_token_type(r, new_token);
+	}
+}
+
 struct _lair_token *_lair_tokenize(struct _lair_runtime *r, const char *program, const size_t len) {
 	struct _lair_token *tokens = NULL;
-	size_t num_read = 0;
-
-	while (num_read < len) {
-		const struct _str line = read_line(program + num_read);
-		num_read += line.size;
+	struct _lair_token *tail = NULL;
+	struct _lair_arena *arena = r->arena;
+
+	/* Tokens point straight into the program, so it has to outlive them. */
+	const char *p = program;
+	const char *end = program + len;
+
+	while (p < end) {
+		/* A line's indentation is how many spaces it starts with. */
+		const char *line_start = p;
+		while (p < end && *p == ' ')
+			p++;
+		const unsigned int indentation_level = p - line_start;
 		int newline = 1;
 
-		/* Read in a token: */
-		char *token = strtok((char *)line.data, " ");
-		int indentation_level = token - line.data;
-		while (token != NULL) {
+		while (p < end && !_is_line_break(*p)) {
+			if (*p == ' ') {
+				p++;
+				continue;
+			}
+
 			/* Is it a comment? Ignore the rest of the line. */
-			if (token[0] == '#') {
-				break;
-			} else if (_is_newline(token)) {
+			if (*p == '#') {
+				while (p < end && !_is_line_break(*p))
+					p++;
 				break;
 			}
 
 			/* We don't want to insert an indent/dedent on the very first line,
-			* and we only want to do this at the beginning of each line. The beginning
-			* is basically the end though so this makes sense, right?
-			*/
+			 * and we only want to do this at the beginning of each line.
+			 */
 			if (newline != 0 && tokens != NULL) {
-				/* Dedent/indent stuff. */
-				struct _lair_token *new_token = calloc(1, sizeof(struct _lair_token));
+				struct _lair_token *new_token = _lair_arena_alloc(r, arena, sizeof(struct _lair_token));
 				new_token->token_str = NULL;
 				new_token->indent_level = indentation_level;
-				if (token - line.data != 0) {
+				if (indentation_level != 0) {
 					/* line starts with spaces. */
 					new_token->token_type = LR_INDENT;
 				} else {
 					new_token->token_type = LR_DEDENT;
 				}
-				_insert_token(&tokens, new_token);
-			}	
+				_append_token(&tokens, &tail, new_token);
+			}
+			newline = 0;
 
-			/* Create the shell of the new token and insert it. */
-			struct _lair_token *new_token = calloc(1, sizeof(struct _lair_token));
-			new_token->token_str = calloc(1, strlen(token) + 1);
+			struct _lair_token *new_token = _lair_arena_alloc(r, arena, sizeof(struct _lair_token));
+			new_token->token_str = p;
+			new_token->token_len = _word_end(p, end) - p;
 			new_token->indent_level = indentation_level;
-
-			/* Copy the string representation of the token into the stack. */
-			const size_t new_token_len = strlen(token);
-			char stripped[new_token_len + 1];
-			memset(stripped, '\0', new_token_len + 1);
-			_strip(token, stripped);
-			const size_t stripped_len = strlen(stripped);
-			memcpy(new_token->token_str, stripped, stripped_len);
-
-			/* Actually insert it. */
-			_insert_token(&tokens, new_token);
-
-#define CALL_OR_FUNCTION if (new_token->token_str[0] == '!' && stripped_len == 1) {\
-							new_token->token_type = LR_CALL;\
-						} else {\
-							new_token->token_type = LR_FUNCTION_DEF;\
-						}
-
-			int extra_modified = 0;
-			if (new_token->prev != NULL) {
-				if (new_token->token_str[0] == '!' && stripped_len == 1) {
-					new_token->token_type = LR_CALL;
-				} else {
-					switch (new_token->prev->token_type) {
-						case LR_FUNCTION_DEF:
-						case LR_FUNCTION_ARG: {
-							const struct _lair_token *out = NULL;
-							new_token->token_type = LR_FUNCTION_ARG;
-							if (_function_args_shadow_function(new_token, &out)) {
-								char buf[512] = {0};
-								const char *msg = "Function argument names shadow function name: %s shadows %s";
-								snprintf(buf, sizeof(buf), msg, new_token->token_str, (*out).token_str);
-								throw_exception(r, ERR_PARSE, buf);
-							}
-							break;
-						}
-						case LR_INDENT:
-							_intuit_token_type(r, new_token, stripped);
-							break;
-						case LR_DEDENT:
-							CALL_OR_FUNCTION
-							break;
-						case LR_FUNCTION_CALL:
-						default:
-							/* Check to see if we hit a space in the middle of a string. */
-							if (stripped[0] == '"' && stripped[stripped_len - 1] != '"') {
-								// TODO: Rewrite this to support multiline strings. Needs a stateful
-								// variable.
-								// this is a "test of the thing" okay
-								// |--------->    <-----------------|
-								const size_t start = token - line.data;
-								const size_t end = line.size;
-								char remaining[end - start];
-								memset(remaining, '\0', end - start);
-								memcpy(remaining, stripped, stripped_len);
-								remaining[stripped_len] = ' ';
-								size_t i = 0;
-								size_t new_len = stripped_len + 1;
-								int found_end = 0;
-								for(i = stripped_len + start + 1; i < end; i++) {
-									new_len++;
-									remaining[i - start] = line.data[i];
-
-									if (line.data[i] == '"') {
-										remaining[i] = '\0';
-										found_end = 1;
-										break;
-									}
-								}
-
-								if (!found_end) {
-									throw_exception(r, ERR_SYNTAX, "String has no ending \".");
-								}
-
-								free(new_token->token_str);
-								new_token->token_str = calloc(1, new_len + 1);
-								memcpy(new_token->token_str, remaining, new_len);
-
-								_intuit_token_type(r, new_token, remaining);
-
-								extra_modified = 1;
-								token = strtok((char *)line.data + start + strlen(remaining), " ");
-							} else {
-								_intuit_token_type(r, new_token, stripped);
-							}
-					}
-				}
-			} else {
-				CALL_OR_FUNCTION
+			p += new_token->token_len;
+
+			/* A string with spaces in it keeps going until the next quote on
+			 * the line.
+			 */
+			if (new_token->token_str[0] == '"' &&
+					(new_token->token_len == 1 || new_token->token_str[new_token->token_len - 1] != '"')) {
+				while (p < end && !_is_line_break(*p) && *p != '"')
+					p++;
+				if (p == end || *p != '"')
+					throw_exception(r, ERR_SYNTAX, "String has no ending \".");
+				p++;
+				new_token->token_len = p - new_token->token_str;
 			}
 
+			_append_token(&tokens, &tail, new_token);
+			_classify_token(r, new_token);
 
-			if (extra_modified == 0)
-				token = strtok(NULL, " ");
-			newline = 0;
+			/* Every identifier shares one copy of its name. */
+			if (_is_identifier(new_token->token_type)) {
+				new_token->sym = _lair_intern(r, new_token->token_str, new_token->token_len);
+				new_token->token_str = _lair_symbol_name(r, new_token->sym);
+			}
 		}
 
-		free((char *)line.data);
+		/* Past the line break, if there was one. */
+		if (p < end)
+			p++;
 	}
 
-	struct _lair_token *eof_token = calloc(1, sizeof(struct _lair_token));
+	struct _lair_token *eof_token = _lair_arena_alloc(r, arena, sizeof(struct _lair_token));
 	eof_token->token_type = LR_EOF;
-	_insert_token(&tokens, eof_token);
+	_append_token(&tokens, &tail, eof_token);
 
 	return tokens;
 }
@@ -368,24 +327,23 @@ static inline struct _lair_token *_pop_token(struct _lair_token **tokens) {
 
 }
 
-static char *_convert_str_token_to_str(const char *token) {
+static char *_convert_str_token_to_str(struct _lair_runtime *r, const char *token, const size_t string_len) {
 	/* This function does stuff like convert escaped characters to their
 	 * proper values, remove double quotes, etc.
 	 */
-	/* TODO: Escape stuff here. Like \r, \n, \t, etc. */
-	const size_t string_len = strlen(token);
 	const size_t new_string_len = string_len - strlen("\"\"");
-	char *to_return = malloc(new_string_len + 1);
-	to_return[new_string_len] = '\0';
+	char *to_return = _lair_arena_alloc(r, r->arena, new_string_len + 1);
 
-	//memcpy(to_return, token + 1, new_string_len);
-	int offset = 0;
+	/* Escapes make the string shorter, so stop at the closing quote. */
+	size_t offset = 0;
 	size_t i = 0;
-	for (i = 0, offset = 1; i < new_string_len; i++, offset++) {
+	for (i = 0, offset = 1; offset < string_len - 1; i++, offset++) {
 		if (token[offset] != '\\') {
 			to_return[i] = token[offset];
 		} else {
-			switch (token[++offset]) {
+			if (offset + 1 < string_len - 1)
+				offset++;
+			switch (token[offset]) {
 				case 'n':
 					to_return[i] = '\n';
 					break;
@@ -405,7 +363,24 @@ static char *_convert_str_token_to_str(const char *token) {
 	return to_return;
 }
 
-struct _lair_type _lair_atomize_token(const struct _lair_token *token) {
+/* Numbers are ints, so a literal that doesn't fit in one is an error rather
+ * than whatever it happens to wrap around to.
+ */
+static int _to_num(struct _lair_runtime *r, const char *str, const size_t len) {
+	long long num = 0;
+	size_t i;
+	for (i = 0; i < len; i++) {
+		num = num * 10 + (str[i] - '0');
+		if (num > INT_MAX) {
+			char buf[512] = {0};
+			snprintf(buf, sizeof(buf), "Number is too big: %.*s", (int)len, str);
+			throw_exception(r, ERR_PARSE, buf);
+		}
+	}
+	return (int)num;
+}
+
+struct _lair_type _lair_atomize_token(struct _lair_runtime *r, const struct _lair_token *token) {
 	/* This is where we do parse-time type coersion into things that
 	 * better represent the types we're eventually going to want out
 	 * of whatever it is they are in.
@@ -415,7 +390,7 @@ struct _lair_type _lair_atomize_token(const struct _lair_token *token) {
 			struct _lair_type num = {
 				.type = LR_NUM,
 				.value = {
-					.num = atoi(token->token_str)
+					.num = _to_num(r, token->token_str, token->token_len)
 				}
 			};
 			return num;
@@ -426,50 +401,40 @@ struct _lair_type _lair_atomize_token(const struct _lair_token *token) {
 				.value = {0}
 			};
 			if (token->token_str != NULL)
-				def.value.str = _convert_str_token_to_str(token->token_str);
+				def.value.str = _convert_str_token_to_str(r, token->token_str, token->token_len);
 			return def;
 		}
 		default: {
 			struct _lair_type def = {
 				.type = token->token_type,
+				.sym = token->sym,
 				.value = {0}
 			};
-			if (token->token_str != NULL) {
-				def.value.str = calloc(1, strlen(token->token_str) + 1);
-				memcpy(def.value.str, token->token_str, strlen(token->token_str));
+			if (token->sym != LR_NO_SYM) {
+				/* Interned, so everyone can share it. */
+				def.value.str = (char *)token->token_str;
+			} else if (token->token_str != NULL) {
+				def.value.str = _lair_arena_strndup(r, r->arena, token->token_str, token->token_len);
 			}
 			return def;
 		}
 	}
 }
 
-static void _lair_free_token(struct _lair_token *token) {
-	free(token->token_str);
-	free(token);
-}
-
-void _lair_free_tokens(struct _lair_token *tokens) {
-	while (tokens != NULL) {
-		struct _lair_token *to_free = (struct _lair_token *)tokens;
-		tokens = tokens->next;
-		_lair_free_token(to_free);
-	}
-}
-
-static struct _lair_ast *_parse_from_token(struct _lair_token **tokens) {
+static struct _lair_ast *_parse_from_token(struct _lair_runtime *r, struct _lair_token **tokens) {
 	/* "pop" the token off of the top of the stack. */
 	struct _lair_token *current_token = _pop_token(tokens);
 
 	/* Atomize the function, stick it at the head of the list. */
 	struct _lair_ast _stack_ast = {
-		.atom = _lair_atomize_token(current_token),
+		.atom = _lair_atomize_token(r, current_token),
 		.indent_level = current_token->indent_level
 	};
 
 	if (current_token->token_type == LR_FUNCTION_CALL ||
 			current_token->token_type == LR_FUNCTION_DEF ||
 			current_token->token_type == LR_CALL) {
-		struct _lair_ast *list = calloc(1, sizeof(struct _lair_ast));
+		struct _lair_ast *list = _lair_arena_alloc(r, r->arena, sizeof(struct _lair_ast));
 		memcpy(list, &_stack_ast, sizeof(struct _lair_ast));
 
 		/* We break out of the loop when we find an EOF or a DEDENT. */
@@ -477,7 +442,7 @@ static struct _lair_ast *_parse_from_token(struct _lair_token **tokens) {
 		struct _lair_ast *prev = NULL;
 		while (current_token->token_type != LR_DEDENT &&
 			   current_token->token_type != LR_EOF) {
-			struct _lair_ast *to_append = _parse_from_token(tokens);
+			struct _lair_ast *to_append = _parse_from_token(r, tokens);
 			cur_ast_item->next = to_append;
 			cur_ast_item->prev = prev;
 
@@ -494,7 +459,7 @@ static struct _lair_ast *_parse_from_token(struct _lair_token **tokens) {
 		}
 
 		if (current_token->token_type == LR_EOF) {
-			struct _lair_ast *to_append = _parse_from_token(tokens);
+			struct _lair_ast *to_append = _parse_from_token(r, tokens);
 			cur_ast_item->next = to_append;
 			cur_ast_item->prev = prev;
 
@@ -504,14 +469,11 @@ static struct _lair_ast *_parse_from_token(struct _lair_token **tokens) {
 		}
 		return list;
 	} else {
-		struct _lair_ast *to_return = calloc(1, sizeof(struct _lair_ast));
+		struct _lair_ast *to_return = _lair_arena_alloc(r, r->arena, sizeof(struct _lair_ast));
 		memcpy(to_return, &_stack_ast, sizeof(struct _lair_ast));
-		_lair_free_token(current_token);
 		return to_return;
 	}
 
-	_lair_free_tokens(current_token);
-
 	return NULL;
 }
 
@@ -519,15 +481,14 @@ struct _lair_ast *_lair_parse_from_tokens(
 		struct _lair_runtime *r,
 		struct _lair_token **tokens) {
 	check(r, tokens != NULL, ERR_PARSE, "No tokens to parse.");
-	struct _lair_ast *ast_root = calloc(1, sizeof(struct _lair_ast));
+	struct _lair_ast *ast_root = _lair_arena_alloc(r, r->arena, sizeof(struct _lair_ast));
 	struct _lair_ast *child_loc = ast_root->children;
 
 	while ((*tokens) != NULL) {
-		struct _lair_ast *to_append = _parse_from_token(tokens);
+		struct _lair_ast *to_append = _parse_from_token(r, tokens);
 
-		struct _lair_token *unused = _pop_token(tokens);
-		if (unused != NULL)
-			_lair_free_token(unused);
+		/* Skip whatever ended the form. */
+		_pop_token(tokens);
 
 		if (ast_root->children == NULL) {
 			ast_root->children = to_append;
@@ -0,0 +1,380 @@
+// vim: noet ts=4 sw=4
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include "compile.h"
+#include "error.h"
+#include "gc.h"
+#include "lair.h"
+#include "profile.h"
+#include "vector.h"
+
+#define PROFILE_INITIAL_DEPTH 64
+#define PROFILE_INITIAL_SAMPLES (1 << 16)
+#define PROFILE_INITIAL_NODES 256
+#define PROFILE_DEFAULT_HZ 997
+
+/* The sampler the timer is feeding. The timer belongs to the whole process,
+ * so there's only ever one. Whoever sets `_timer_taken` first gets it. SIGPROF
+ * can land on any thread, but only the one running the sampled program may
+ * touch the sampler's stack, so the handler checks `_owner` first.
+ */
+static atomic_flag _timer_taken = ATOMIC_FLAG_INIT;
+static struct _lair_profile *_Atomic _sampled = NULL;
+static pthread_t _owner;
+static struct sigaction _old_action;
+
+static inline uint64_t _now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+struct _lair_profile *_lair_profile_new(struct _lair_runtime *r, const struct _lair_program *program) {
+	struct _lair_profile *profile = calloc(1, sizeof(struct _lair_profile));
+	check(r, profile != NULL, ERR_RUNTIME, "Out of memory starting the profiler.");
+	profile->nentries = program->protos->count;
+	profile->entries = calloc(profile->nentries + 1, sizeof(struct _lair_profile_entry));
+	check(r, profile->entries != NULL, ERR_RUNTIME, "Out of memory starting the profiler.");
+
+	const struct _lair_proto *protos = (const struct _lair_proto *)program->protos->items;
+	size_t i;
+	for (i = 0; i < profile->nentries; i++) {
+		profile->entries[i].name = protos[i].name;
+		profile->entries[i].builtin = protos[i].builtin != NULL;
+	}
+	return profile;
+}
+
+static void _start(struct _lair_runtime *r, struct _lair_profile *profile, const size_t entry, const uint64_t now) {
+	if (profile->depth == profile->stack_size) {
+		const size_t new_size = profile->stack_size == 0 ? PROFILE_INITIAL_DEPTH : profile->stack_size * 2;
+		struct _lair_profile_frame *stack = realloc(profile->stack, new_size * sizeof(struct _lair_profile_frame));
+		check(r, stack != NULL, ERR_RUNTIME, "Out of memory growing the profiler's stack.");
+		profile->stack = stack;
+		profile->stack_size = new_size;
+	}
+
+	struct _lair_profile_entry *e = &profile->entries[entry];
+	e->calls++;
+	e->active++;
+
+	struct _lair_profile_frame *frame = &profile->stack[profile->depth++];
+	frame->entry = entry;
+	frame->start = now;
+	frame->child_ns = 0;
+	frame->start_allocs = r->gc->allocs;
+	frame->start_bytes = r->gc->total_bytes;
+	frame->child_allocs = 0;
+	frame->child_bytes = 0;
+}
+
+static void _finish(struct _lair_runtime *r, struct _lair_profile *profile, const uint64_t now) {
+	const struct _lair_profile_frame *frame = &profile->stack[--profile->depth];
+	const uint64_t elapsed = now - frame->start;
+	const size_t allocs = r->gc->allocs - frame->start_allocs;
+	const size_t bytes = r->gc->total_bytes - frame->start_bytes;
+
+	struct _lair_profile_entry *e = &profile->entries[frame->entry];
+	e->self_ns += elapsed - frame->child_ns;
+	e->allocs += allocs - frame->child_allocs;
+	e->alloc_bytes += bytes - frame->child_bytes;
+	/* Recursive calls are already inside the outermost one's total. */
+	if (--e->active == 0)
+		e->total_ns += elapsed;
+
+	if (profile->depth > 0) {
+		struct _lair_profile_frame *parent = &profile->stack[profile->depth - 1];
+		parent->child_ns += elapsed;
+		parent->child_allocs += allocs;
+		parent->child_bytes += bytes;
+	}
+}
+
+/* The SIGPROF handler. It can't allocate, so it copies the stack into space
+ * that's already there and leaves adding it up to _fold_samples.
+ */
+static void _take_sample(int sig) {
+	(void)sig;
+	struct _lair_profile *profile = atomic_load(&_sampled);
+	if (profile == NULL || !pthread_equal(_owner, pthread_self()))
+		return;
+
+	const size_t depth = profile->depth;
+	const size_t used = profile->nsamples;
+	if (depth == 0)
+		return;
+	if (profile->moving || used + depth + 1 > profile->samples_size) {
+		profile->dropped++;
+		return;
+	}
+
+	uint32_t *sample = profile->samples + used;
+	sample[0] = depth;
+	size_t i;
+	for (i = 0; i < depth; i++)
+		sample[i + 1] = profile->stack[i].entry;
+	profile->nsamples = used + depth + 1;
+}
+
+/* Finds the node for `entry` called from `parent`, making it if it's new. */
+static uint32_t _child(struct _lair_runtime *r, struct _lair_profile *profile, const uint32_t parent, const uint32_t entry) {
+	uint32_t n;
+	for (n = profile->nodes[parent].child; n != 0; n = profile->nodes[n].sibling) {
+		if (profile->nodes[n].entry == entry)
+			return n;
+	}
+
+	if (profile->nnodes == profile->nodes_size) {
+		const size_t new_size = profile->nodes_size * 2;
+		struct _lair_profile_node *nodes = realloc(profile->nodes, new_size * sizeof(struct _lair_profile_node));
+		check(r, nodes != NULL, ERR_RUNTIME, "Out of memory adding up samples.");
+		profile->nodes = nodes;
+		profile->nodes_size = new_size;
+	}
+
+	n = profile->nnodes++;
+	profile->nodes[n] = (struct _lair_profile_node){
+		.entry = entry,
+		.parent = parent,
+		.sibling = profile->nodes[parent].child,
+	};
+	profile->nodes[parent].child = n;
+	return n;
+}
+
+/* Adds the samples taken so far to the tree and empties the buffer. The timer
+ * is held off while we do, since the handler writes to the same buffer.
+ */
+static void _fold_samples(struct _lair_runtime *r, struct _lair_profile *profile) {
+	sigset_t prof, old;
+	sigemptyset(&prof);
+	sigaddset(&prof, SIGPROF);
+	pthread_sigmask(SIG_BLOCK, &prof, &old);
+
+	size_t i = 0;
+	while (i < profile->nsamples) {
+		const uint32_t depth = profile->samples[i++];
+		uint32_t node = 0;
+		uint32_t d;
+		for (d = 0; d < depth; d++)
+			node = _child(r, profile, node, profile->samples[i++]);
+		profile->nodes[node].count++;
+	}
+	profile->nsamples = 0;
+
+	/* Leave room for a few samples of the deepest stack we've got. */
+	if (profile->samples_size < 4 * (profile->depth + 1)) {
+		const size_t new_size = 4 * (profile->depth + 1);
+		uint32_t *samples = realloc(profile->samples, new_size * sizeof(uint32_t));
+		check(r, samples != NULL, ERR_RUNTIME, "Out of memory growing the sample buffer.");
+		profile->samples = samples;
+		profile->samples_size = new_size;
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/* A sampler only needs to know who's on the stack. */
+static void _push(struct _lair_runtime *r, struct _lair_profile *profile, const size_t entry) {
+	if (profile->depth == profile->stack_size) {
+		const size_t new_size = profile->stack_size == 0 ? PROFILE_INITIAL_DEPTH : profile->stack_size * 2;
+		profile->moving = 1;
+		atomic_signal_fence(memory_order_seq_cst);
+		struct _lair_profile_frame *stack = realloc(profile->stack, new_size * sizeof(struct _lair_profile_frame));
+		check(r, stack != NULL, ERR_RUNTIME, "Out of memory growing the profiler's stack.");
+		profile->stack = stack;
+		profile->stack_size = new_size;
+		atomic_signal_fence(memory_order_seq_cst);
+		profile->moving = 0;
+	}
+
+	/* The frame has to be there before the sampler can see it. */
+	profile->stack[profile->depth].entry = entry;
+	atomic_signal_fence(memory_order_release);
+	profile->depth++;
+
+	if (profile->nsamples * 2 > profile->samples_size)
+		_fold_samples(r, profile);
+}
+
+void _lair_profile_enter(struct _lair_runtime *r, struct _lair_profile *profile, const size_t entry) {
+	if (profile->sampling) {
+		_push(r, profile, entry);
+		return;
+	}
+	_start(r, profile, entry, _now());
+}
+
+void _lair_profile_exit(struct _lair_runtime *r, struct _lair_profile *profile) {
+	if (profile->sampling) {
+		profile->depth--;
+		return;
+	}
+	_finish(r, profile, _now());
+}
+
+void _lair_profile_replace(struct _lair_runtime *r, struct _lair_profile *profile, const size_t entry) {
+	if (profile->sampling) {
+		profile->stack[profile->depth - 1].entry = entry;
+		return;
+	}
+	const uint64_t now = _now();
+	_finish(r, profile, now);
+	_start(r, profile, entry, now);
+}
+
+struct _lair_profile *_lair_profile_new_sampler(struct _lair_runtime *r, const struct _lair_program *program, const int hz) {
+	struct _lair_profile *profile = _lair_profile_new(r, program);
+	profile->sampling = 1;
+	profile->samples_size = PROFILE_INITIAL_SAMPLES;
+	profile->samples = malloc(profile->samples_size * sizeof(uint32_t));
+	profile->nodes_size = PROFILE_INITIAL_NODES;
+	profile->nodes = calloc(profile->nodes_size, sizeof(struct _lair_profile_node));
+	/* Node 0 is the empty stack everything else hangs off. */
+	profile->nnodes = 1;
+	if (profile->samples == NULL || profile->nodes == NULL) {
+		_lair_profile_free(profile);
+		throw_exception(r, ERR_RUNTIME, "Out of memory starting the sampler.");
+	}
+	if (atomic_flag_test_and_set(&_timer_taken)) {
+		_lair_profile_free(profile);
+		throw_exception(r, ERR_RUNTIME, "Only one program can be sampled at a time.");
+	}
+
+	struct sigaction action = {0};
+	action.sa_handler = _take_sample;
+	action.sa_flags = SA_RESTART;
+	sigemptyset(&action.sa_mask);
+	_owner = pthread_self();
+	atomic_store(&_sampled, profile);
+	sigaction(SIGPROF, &action, &_old_action);
+
+	const long usec = 1000000 / (hz > 0 ? hz : PROFILE_DEFAULT_HZ);
+	struct itimerval timer = {0};
+	timer.it_interval.tv_sec = usec / 1000000;
+	timer.it_interval.tv_usec = usec > 0 ? usec % 1000000 : 1;
+	timer.it_value = timer.it_interval;
+	setitimer(ITIMER_PROF, &timer, NULL);
+	return profile;
+}
+
+static void _stop_sampling(struct _lair_profile *profile) {
+	if (atomic_load(&_sampled) != profile)
+		return;
+
+	const struct itimerval off = {0};
+	setitimer(ITIMER_PROF, &off, NULL);
+	sigaction(SIGPROF, &_old_action, NULL);
+	atomic_store(&_sampled, NULL);
+	atomic_flag_clear(&_timer_taken);
+}
+
+/* One line per stack: the functions on it, outermost first, then how many
+ * samples caught it.
+ */
+static void _report_samples(struct _lair_runtime *r, struct _lair_profile *profile, FILE *out) {
+	_stop_sampling(profile);
+	_fold_samples(r, profile);
+	profile->depth = 0;
+
+	vector *path = vector_new(sizeof(uint32_t), 16);
+	size_t n;
+	for (n = 1; n < profile->nnodes; n++) {
+		if (profile->nodes[n].count == 0)
+			continue;
+
+		path->count = 0;
+		uint32_t at;
+		for (at = n; at != 0; at = profile->nodes[at].parent)
+			vector_append(path, &profile->nodes[at].entry, sizeof(uint32_t));
+
+		size_t i;
+		for (i = path->count; i > 0; i--) {
+			const uint32_t entry = *(uint32_t *)vector_get(path, i - 1);
+			fprintf(out, "%s%s", profile->entries[entry].name, i > 1 ? ";" : "");
+		}
+		fprintf(out, " %zu\n", profile->nodes[n].count);
+	}
+	if (profile->dropped > 0)
+		fprintf(out, "[dropped] %zu\n", profile->dropped);
+	vector_free(path);
+}
+
+static int _by_self_time(const void *a, const void *b) {
+	const struct _lair_profile_entry *x = *(const struct _lair_profile_entry **)a;
+	const struct _lair_profile_entry *y = *(const struct _lair_profile_entry **)b;
+	if (x->self_ns != y->self_ns)
+		return x->self_ns < y->self_ns ? 1 : -1;
+	return strcmp(x->name, y->name);
+}
+
+static void _json_string(FILE *out, const char *str) {
+	fputc('"', out);
+	for (; *str != '\0'; str++) {
+		if (*str == '"' || *str == '\\')
+			fputc('\\', out);
+		fputc(*str, out);
+	}
+	fputc('"', out);
+}
+
+void _lair_profile_report(struct _lair_runtime *r, struct _lair_profile *profile, FILE *out, const int json) {
+	if (profile->sampling) {
+		_report_samples(r, profile, out);
+		return;
+	}
+
+	while (profile->depth > 0)
+		_lair_profile_exit(r, profile);
+
+	/* Only the functions that were called, busiest first. */
+	vector *called = vector_new(sizeof(struct _lair_profile_entry *), 16);
+	size_t i;
+	for (i = 0; i < profile->nentries; i++) {
+		if (profile->entries[i].calls > 0)
+			vector_append_ptr(called, &profile->entries[i]);
+	}
+	qsort(called->items, called->count, sizeof(struct _lair_profile_entry *), _by_self_time);
+
+	if (json) {
+		fprintf(out, "{\n  \"functions\": [");
+	} else {
+		fprintf(out, "%-24s %10s %12s %12s %10s %12s\n",
+			"function", "calls", "total ms", "self ms", "allocs", "bytes");
+	}
+
+	for (i = 0; i < called->count; i++) {
+		const struct _lair_profile_entry *e = *(struct _lair_profile_entry **)vector_get(called, i);
+		if (json) {
+			fprintf(out, "%s\n    {\"name\": ", i == 0 ? "" : ",");
+			_json_string(out, e->name);
+			fprintf(out, ", \"builtin\": %s, \"calls\": %zu, \"total_ms\": %.3f, \"self_ms\": %.3f, \"allocs\": %zu, \"alloc_bytes\": %zu}",
+				e->builtin ? "true" : "false", e->calls, e->total_ns / 1e6, e->self_ns / 1e6, e->allocs, e->alloc_bytes);
+		} else {
+			char name[64];
+			snprintf(name, sizeof(name), "%s%s", e->name, e->builtin ? " (builtin)" : "");
+			fprintf(out, "%-24s %10zu %12.3f %12.3f %10zu %12zu\n",
+				name, e->calls, e->total_ns / 1e6, e->self_ns / 1e6, e->allocs, e->alloc_bytes);
+		}
+	}
+
+	if (json)
+		fprintf(out, "\n  ]\n}\n");
+	vector_free(called);
+}
+
+void _lair_profile_free(struct _lair_profile *profile) {
+	if (profile == NULL)
+		return;
+
+	_stop_sampling(profile);
+	free(profile->samples);
+	free(profile->nodes);
+	free(profile->entries);
+	free(profile->stack);
+	free(profile);
+}
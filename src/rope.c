@@ -0,0 +1,95 @@
+// vim: noet ts=4 sw=4
+#include <string.h>
+
+#include "error.h"
+#include "gc.h"
+#include "parse.h"
+#include "rope.h"
+#include "vector.h"
+
+static inline struct _lair_rope *_rope_of(const _lair_val v) {
+	return LR_UNBOX(v)->value.rope;
+}
+
+static inline int _is_rope(const _lair_val v) {
+	return LR_UNBOX(v)->type == LR_ROPE;
+}
+
+size_t _lair_string_len(const _lair_val v) {
+	if (_is_rope(v))
+		return _rope_of(v)->len;
+	return strlen(_lair_str_of(v));
+}
+
+_lair_val _lair_string_concat(struct _lair_runtime *r, const _lair_val a, const _lair_val b) {
+	const size_t len0 = _lair_string_len(a);
+	const size_t len1 = _lair_string_len(b);
+	if (len1 == 0)
+		return a;
+	if (len0 == 0)
+		return b;
+
+	/* Short strings are cheaper to copy than to keep track of. Ropes are
+	 * never this short, so both of these are flat.
+	 */
+	if (len0 + len1 < LAIR_ROPE_MIN) {
+		struct _lair_type *to_return = _lair_gc_string(r, len0 + len1);
+		memcpy(to_return->value.str, _lair_str_of(a), len0);
+		memcpy(to_return->value.str + len0, _lair_str_of(b), len1);
+		return LR_BOX(to_return);
+	}
+
+	struct _lair_type *node = _lair_gc_alloc(r, LR_ROPE, sizeof(struct _lair_rope));
+	node->value.rope = (struct _lair_rope *)(node + 1);
+	node->value.rope->left = a;
+	node->value.rope->right = b;
+	node->value.rope->flat = LR_NIL;
+	node->value.rope->len = len0 + len1;
+	return LR_BOX(node);
+}
+
+/* Copies every piece of a rope into one string, left to right. Ropes built
+ * in a loop are as deep as the loop was long, so this keeps its own stack
+ * instead of recursing.
+ */
+static void _flatten(struct _lair_runtime *r, struct _lair_rope *rope) {
+	struct _lair_type *flat = _lair_gc_string(r, rope->len);
+	char *out = flat->value.str;
+
+	vector *todo = vector_new(sizeof(_lair_val), 32);
+	vector_append(todo, &rope->right, sizeof(_lair_val));
+	vector_append(todo, &rope->left, sizeof(_lair_val));
+
+	size_t pos = 0;
+	while (todo->count > 0) {
+		todo->count--;
+		const _lair_val piece = *(const _lair_val *)vector_get(todo, todo->count);
+
+		if (_is_rope(piece) && _rope_of(piece)->flat == LR_NIL) {
+			vector_append(todo, &_rope_of(piece)->right, sizeof(_lair_val));
+			vector_append(todo, &_rope_of(piece)->left, sizeof(_lair_val));
+			continue;
+		}
+
+		const char *bytes = _is_rope(piece) ? _lair_str_of(_rope_of(piece)->flat) : _lair_str_of(piece);
+		const size_t len = _lair_string_len(piece);
+		memcpy(out + pos, bytes, len);
+		pos += len;
+	}
+	vector_free(todo);
+
+	/* The halves aren't needed anymore, so let them go. */
+	rope->flat = LR_BOX(flat);
+	rope->left = LR_NIL;
+	rope->right = LR_NIL;
+}
+
+const char *_lair_string_bytes(struct _lair_runtime *r, const _lair_val v) {
+	if (!_is_rope(v))
+		return _lair_str_of(v);
+
+	struct _lair_rope *rope = _rope_of(v);
+	if (rope->flat == LR_NIL)
+		_flatten(r, rope);
+	return _lair_str_of(rope->flat);
+}
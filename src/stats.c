@@ -0,0 +1,56 @@
+// vim: noet ts=4 sw=4
+#include "arena.h"
+#include "error.h"
+#include "gc.h"
+#include "lair.h"
+#include "memo.h"
+#include "parallel.h"
+#include "stats.h"
+#include "symbol.h"
+#include "vector.h"
+
+struct _lair_stats *_lair_stats_new(struct _lair_runtime *r) {
+	struct _lair_stats *stats = calloc(1, sizeof(struct _lair_stats));
+	check(r, stats != NULL, ERR_RUNTIME, "Out of memory starting the counters.");
+	return stats;
+}
+
+void _lair_stats_report(struct _lair_runtime *r, const struct _lair_stats *stats, FILE *out) {
+	size_t total = 0;
+	int op;
+	for (op = 0; op < OP_MAX; op++)
+		total += stats->ops[op];
+
+	fprintf(out, "%-24s %12zu\n", "instructions", total);
+	for (op = 0; op < OP_MAX; op++) {
+		if (stats->ops[op] == 0)
+			continue;
+		fprintf(out, "  %-22s %12zu %6.2f%%\n", _lair_op_name(op), stats->ops[op], 100.0 * stats->ops[op] / total);
+	}
+
+	/* The calls and returns tell us how much the call stack was used. */
+	const size_t calls = stats->ops[OP_CALL] + stats->ops[OP_CALLK] + stats->ops[OP_FORKK] + stats->ops[OP_PCALL] + stats->ops[OP_PCALLK];
+	const size_t tail_calls = stats->ops[OP_TAILCALL] + stats->ops[OP_TAILCALLK] + stats->ops[OP_PTAILCALL] + stats->ops[OP_PTAILCALLK];
+	const size_t returns = stats->ops[OP_RET] + stats->ops[OP_RETNIL] + stats->ops[OP_PRET] + stats->ops[OP_PRETNIL];
+	fprintf(out, "%-24s %12zu\n", "calls", calls);
+	fprintf(out, "%-24s %12zu\n", "tail calls", tail_calls);
+	fprintf(out, "%-24s %12zu\n", "returns", returns);
+
+	fprintf(out, "%-24s %12zu\n", "values allocated", r->gc->allocs);
+	fprintf(out, "%-24s %12zu\n", "bytes allocated", r->gc->total_bytes);
+	fprintf(out, "%-24s %12zu\n", "bytes live", r->gc->allocated);
+	fprintf(out, "%-24s %12zu\n", "collections", r->gc->collections);
+	if (r->memo != NULL) {
+		fprintf(out, "%-24s %12zu\n", "memo hits", r->memo->hits);
+		fprintf(out, "%-24s %12zu\n", "memo misses", r->memo->misses);
+		fprintf(out, "%-24s %12zu\n", "memo evictions", r->memo->evictions);
+	}
+	if (r->parallel != NULL)
+		fprintf(out, "%-24s %12zu\n", "calls forked", atomic_load(&r->parallel->forks));
+	fprintf(out, "%-24s %12zu\n", "arena bytes", r->arena->allocated);
+	fprintf(out, "%-24s %12zu\n", "symbols", r->symbols->names->count);
+}
+
+void _lair_stats_free(struct _lair_stats *stats) {
+	free(stats);
+}
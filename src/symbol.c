@@ -0,0 +1,59 @@
+// vim: noet ts=4 sw=4
+#include <string.h>
+
+#include "error.h"
+#include "lair.h"
+#include "map.h"
+#include "symbol.h"
+#include "vector.h"
+
+struct _lair_symbols *_lair_symbols_new() {
+	struct _lair_symbols *symbols = calloc(1, sizeof(struct _lair_symbols));
+	symbols->ids = calloc(1, sizeof(struct _str_map));
+	symbols->names = vector_new(sizeof(char *), 64);
+
+	/* Symbol 0 is LR_NO_SYM, so it never gets a name. */
+	vector_append_ptr(symbols->names, NULL);
+	return symbols;
+}
+
+_lair_sym _lair_intern(struct _lair_runtime *r, const char *name, const size_t len) {
+	struct _lair_symbols *symbols = r->symbols;
+	check(r, len > 0, ERR_PARSE, "Cannot intern an empty name.");
+
+	const _lair_sym *existing = _str_map_get(symbols->ids, name, len);
+	if (existing != NULL)
+		return *existing;
+
+	char *copy = malloc(len + 1);
+	check(r, copy != NULL, ERR_RUNTIME, "Out of memory interning a name.");
+	memcpy(copy, name, len);
+	copy[len] = '\0';
+
+	const _lair_sym sym = symbols->names->count;
+	check(r, vector_append_ptr(symbols->names, copy) == 1, ERR_RUNTIME, "Could not grow the symbol table.");
+	check(r, _str_map_insert(symbols->ids, name, len, &sym, sizeof(sym)) == 0, ERR_RUNTIME, "Could not grow the symbol table.");
+	return sym;
+}
+
+inline const char *_lair_symbol_name(const struct _lair_runtime *r, const _lair_sym sym) {
+	return *(char * const *)vector_get(r->symbols->names, sym);
+}
+
+inline size_t _lair_symbol_count(const struct _lair_runtime *r) {
+	return r->symbols->names->count;
+}
+
+void _lair_symbols_free(struct _lair_symbols *symbols) {
+	if (symbols == NULL)
+		return;
+
+	size_t i;
+	for (i = 0; i < symbols->names->count; i++)
+		free(*(char **)vector_get(symbols->names, i));
+
+	_str_map_clear(symbols->ids, NULL);
+	free(symbols->ids);
+	vector_free(symbols->names);
+	free(symbols);
+}
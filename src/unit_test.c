@@ -1,8 +1,18 @@
 // vim: noet ts=4 sw=4
+#include <sys/stat.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
 
+#include "cache.h"
+#include "eval.h"
 #include "lair.h"
+#include "map.h"
 
 /* Taken from OlegDB */
 #define run_test(test) printf("%s: ", #test);\
@@ -35,6 +45,61 @@ int _expect_failure(const char *filename) {
 	return !_run_program(filename);
 }
 
+/* Makes an empty file for a report to go in, named so that runs of the tests
+ * at the same time don't write over each other's. Non-zero if it couldn't.
+ */
+static int _temp_file(char path[PATH_MAX]) {
+	snprintf(path, PATH_MAX, "/tmp/lair_test.XXXXXX");
+	const int fd = mkstemp(path);
+	if (fd < 0)
+		return 1;
+	close(fd);
+	return 0;
+}
+
+/* Reads a report a run wrote and deletes it, whatever happened. Hands back a
+ * copy with a NUL on the end for the caller to free, or NULL if there wasn't
+ * one.
+ */
+static char *_read_report(const char *path) {
+	size_t len = 0;
+	char *report = lair_load_file(path, &len);
+	if (report == NULL) {
+		unlink(path);
+		return NULL;
+	}
+	char *copy = malloc(len + 1);
+	if (copy != NULL) {
+		memcpy(copy, report, len);
+		copy[len] = '\0';
+	}
+	lair_unload_file(report, len);
+	unlink(path);
+	return copy;
+}
+
+/* Runs a file with some options, catching what it prints. Returns -1 if that
+ * wasn't exactly `expected`, and otherwise what the run returned.
+ */
+static int _run_with_options(const char *filename, const struct lair_options *options, const char *expected) {
+	char *output = NULL;
+	size_t output_len = 0;
+	size_t buf_siz = 0;
+	FILE *out = open_memstream(&output, &output_len);
+	if (out == NULL)
+		return -1;
+	struct lair_options with_out = *options;
+	with_out.out = out;
+
+	char *buf = lair_load_file(filename, &buf_siz);
+	const int rc = lair_execute_with_options(buf, buf_siz, &with_out);
+	lair_unload_file(buf, buf_siz);
+	fclose(out);
+	const int same = output_len == strlen(expected) && memcmp(output, expected, output_len) == 0;
+	free(output);
+	return same ? rc : -1;
+}
+
 int test_assignment() {
 	return _run_program("t/assignment.den");
 }
@@ -47,6 +112,126 @@ int test_basic() {
 	return _run_program("t/basic.den");
 }
 
+int test_collections() {
+	return _run_program("t/collections.den");
+}
+
+/* Runs t/collections.den with the cache in `dir`, and hands back what it
+ * printed and how much of the arena it used. That's 0 if it didn't have to
+ * parse anything.
+ */
+static int _run_cached(const char *dir, char **output, size_t *output_len, size_t *arena_bytes) {
+	char stats[PATH_MAX];
+	if (_temp_file(stats) != 0)
+		return 1;
+	char *buf = NULL;
+	size_t buf_siz = 0;
+	FILE *out = open_memstream(output, output_len);
+	if (out == NULL) {
+		unlink(stats);
+		return 1;
+	}
+	const struct lair_options options = { .cache_dir = dir, .stats = 1, .stats_path = stats, .out = out };
+
+	buf = lair_load_file("t/collections.den", &buf_siz);
+	const int rc = lair_execute_with_options(buf, buf_siz, &options);
+	lair_unload_file(buf, buf_siz);
+	fclose(out);
+
+	char *report = _read_report(stats);
+	if (rc != 0 || report == NULL) {
+		free(report);
+		return 1;
+	}
+	const char *arena = strstr(report, "arena bytes");
+	if (arena != NULL)
+		*arena_bytes = strtoul(arena + strlen("arena bytes"), NULL, 10);
+	free(report);
+	return arena == NULL;
+}
+
+/* Finds the one file in the cache. */
+static int _cache_file(const char *dir, char path[PATH_MAX]) {
+	DIR *d = opendir(dir);
+	if (d == NULL)
+		return 1;
+	const struct dirent *e = NULL;
+	int found = 0;
+	while ((e = readdir(d)) != NULL) {
+		if (e->d_name[0] == '.')
+			continue;
+		snprintf(path, PATH_MAX, "%s/%s", dir, e->d_name);
+		found++;
+	}
+	closedir(d);
+	return found != 1;
+}
+
+int test_builtins() {
+	/* The lookup's a binary search, so the table had better be sorted. */
+	size_t i;
+	for (i = 0; i < _lair_nbuiltins; i++) {
+		if (i > 0 && strcmp(_lair_builtins[i - 1].name, _lair_builtins[i].name) >= 0)
+			return 1;
+		if (_lair_find_builtin(_lair_builtins[i].name) != &_lair_builtins[i])
+			return 1;
+	}
+	return _lair_find_builtin("main") != NULL || _lair_find_builtin("") != NULL;
+}
+
+int test_cache() {
+	char dir[] = "/tmp/lair_test_cache.XXXXXX";
+	if (mkdtemp(dir) == NULL)
+		return 1;
+
+	char *outputs[4] = {0};
+	size_t lens[4] = {0};
+	size_t arena[4] = {0};
+	char path[PATH_MAX] = {0};
+	struct stat st = {0};
+	int rc = 1;
+
+	/* The first run compiles it and the second doesn't. */
+	if (_run_cached(dir, &outputs[0], &lens[0], &arena[0]) != 0 ||
+			_run_cached(dir, &outputs[1], &lens[1], &arena[1]) != 0)
+		goto done;
+	if (arena[0] == 0 || arena[1] != 0 || _cache_file(dir, path) != 0)
+		goto done;
+
+	/* A file that got cut short is ignored, and replaced. */
+	if (stat(path, &st) != 0 || truncate(path, st.st_size / 2) != 0)
+		goto done;
+	if (_run_cached(dir, &outputs[2], &lens[2], &arena[2]) != 0 || arena[2] == 0)
+		goto done;
+	if (stat(path, &st) != 0 || st.st_size == 0)
+		goto done;
+
+	/* So is one whose first instruction writes past the end of its frame. */
+	FILE *f = fopen(path, "r+b");
+	if (f == NULL)
+		goto done;
+	const int patched = fseek(f, sizeof(struct _lair_cache_header) + 1, SEEK_SET) == 0 && fputc(0xff, f) != EOF;
+	if (fclose(f) != 0 || !patched)
+		goto done;
+	if (_run_cached(dir, &outputs[3], &lens[3], &arena[3]) != 0 || arena[3] == 0)
+		goto done;
+
+	rc = lens[0] != lens[1] || lens[0] != lens[2] || lens[0] != lens[3] ||
+		memcmp(outputs[0], outputs[1], lens[0]) != 0 ||
+		memcmp(outputs[0], outputs[2], lens[0]) != 0 ||
+		memcmp(outputs[0], outputs[3], lens[0]) != 0;
+
+done:
+	free(outputs[0]);
+	free(outputs[1]);
+	free(outputs[2]);
+	free(outputs[3]);
+	if (_cache_file(dir, path) == 0)
+		unlink(path);
+	rmdir(dir);
+	return rc;
+}
+
 int test_equality() {
 	return _run_program("t/equality.den");
 }
@@ -55,30 +240,237 @@ int test_equality_disparate() {
 	return _expect_failure("t/equality_disparate.den");
 }
 
+int test_escapes() {
+	return _run_program("t/escapes.den");
+}
+
+int test_folding() {
+	char stats[PATH_MAX];
+	if (_temp_file(stats) != 0)
+		return 1;
+	const struct lair_options options = { .stats = 1, .stats_path = stats };
+	const int ran = _run_with_options("t/folding.den", &options, "3\n3\n<BOOL: true>\n<BOOL: false>\n<BOOL: false>\nfoobarbaz\n42\n");
+	char *report = _read_report(stats);
+	if (ran != 0 || report == NULL) {
+		free(report);
+		return 1;
+	}
+	/* Only the printlns and `twice` are left to call. */
+	const char *calls = strstr(report, "\ncalls");
+	const int rc = calls == NULL || strtoul(calls + strlen("\ncalls"), NULL, 10) != 8;
+	free(report);
+	return rc;
+}
+
 int test_functions_all_the_way_down() {
 	return _run_program("t/functions_all_the_way_down.den");
 }
 
+int test_garbage() {
+	return _run_program("t/garbage.den");
+}
+
 int test_id_function() {
 	return _run_program("t/id_function.den");
 }
 
+int test_immediates() {
+	return _run_program("t/immediates.den");
+}
+
+int test_locals() {
+	return _run_program("t/locals.den");
+}
+
 int test_loop() {
 	return _run_program("t/loop.den");
 }
 
+int test_memo() {
+	char stats[PATH_MAX];
+	if (_temp_file(stats) != 0)
+		return 1;
+	/* Small enough that some results get forgotten. */
+	const struct lair_options options = { .memo = 1, .memo_size = 16, .stats = 1, .stats_path = stats };
+	const int ran = _run_with_options("t/memo.den", &options, "184756\n25740\n3\n3\n3\n3\n");
+	char *report = _read_report(stats);
+	if (ran != 0 || report == NULL) {
+		free(report);
+		return 1;
+	}
+	const char *hits = strstr(report, "memo hits");
+	const char *evictions = strstr(report, "memo evictions");
+	const int rc = hits == NULL || evictions == NULL ||
+		strtoul(hits + strlen("memo hits"), NULL, 10) == 0 ||
+		strtoul(evictions + strlen("memo evictions"), NULL, 10) == 0;
+	free(report);
+	return rc;
+}
+
+int test_memory() {
+	char path[PATH_MAX];
+	if (_temp_file(path) != 0)
+		return 1;
+	char *buf = NULL;
+	size_t buf_siz = 0;
+	const struct lair_options options = { .memory = 1, .memory_path = path };
+
+	/* Whatever SIGUSR1 did before, it does again afterwards. */
+	struct sigaction before = {0};
+	struct sigaction after = {0};
+	before.sa_handler = SIG_IGN;
+	sigemptyset(&before.sa_mask);
+	sigaction(SIGUSR1, &before, NULL);
+
+	buf = lair_load_file("t/collections.den", &buf_siz);
+	const int rc = lair_execute_with_options(buf, buf_siz, &options);
+	lair_unload_file(buf, buf_siz);
+
+	sigaction(SIGUSR1, NULL, &after);
+	signal(SIGUSR1, SIG_DFL);
+	char *report = _read_report(path);
+	if (rc != 0 || report == NULL || after.sa_handler != SIG_IGN) {
+		free(report);
+		return 1;
+	}
+
+	/* The program's gone by the time we write the report, but it was there. */
+	int failed = 1;
+	const char *program = strstr(report, "\nprogram");
+	if (program != NULL) {
+		char *end = NULL;
+		const unsigned long live = strtoul(program + strlen("\nprogram"), &end, 10);
+		const unsigned long peak = strtoul(end, NULL, 10);
+		/* `fill` made every vector, and they're all gone. */
+		const char *fill = strstr(report, "\nfill");
+		failed = live != 0 || peak == 0 || fill == NULL || strtoul(fill + strlen("\nfill"), NULL, 10) != 0;
+	}
+	free(report);
+	return failed;
+}
+
 int test_multilinefunction() {
 	return _run_program("t/multilinefunction.den");
 }
 
+int test_number_too_big() {
+	return _expect_failure("t/number_too_big.den");
+}
+
 int test_objects() {
 	return _run_program("t/objects.den");
 }
 
+/* Runs a file on some threads and hands back how many calls were forked, or
+ * -1 if it didn't print what it should have.
+ */
+static long _run_parallel(const char *path, const int threads, const size_t cost, const char *expected) {
+	char stats[PATH_MAX];
+	if (_temp_file(stats) != 0)
+		return -1;
+	const struct lair_options options = { .parallel = threads, .parallel_cost = cost, .stats = 1, .stats_path = stats };
+	const int ran = _run_with_options(path, &options, expected);
+	char *report = _read_report(stats);
+	if (ran != 0 || report == NULL) {
+		free(report);
+		return -1;
+	}
+	/* Not there at all when there aren't any workers. */
+	const char *forked = strstr(report, "calls forked");
+	long n = threads > 1 ? -1 : 0;
+	if (forked != NULL)
+		n = (long)strtoul(forked + strlen("calls forked"), NULL, 10);
+	free(report);
+	return n;
+}
+
+int test_parallel() {
+	/* Forks whatever it can, and gets the same answers. */
+	const long forked = _run_parallel("t/parallel.den", 4, 1, "184756\n924!3432!\n700\n1\n2\n3\n");
+	if (forked <= 0)
+		return 1;
+
+	/* Calls that are over in no time stop being forked. */
+	const long cheap = _run_parallel("t/parallel_cheap.den", 4, 0, "1998000\n");
+	return cheap < 0 || cheap > 10;
+}
+
+int test_pmap() {
+	/* The same answers, in the same order, with the workers or without. */
+	const char *expected = "[1, 2, 6, 20, 70, 252, 924, 3432]\n4707\n499500\n"
+		"[\"4!\", \"5!\"]\n[\"0\", \"1\", \"2\"]\n0\n1\n2\n[0, 1, 2]\n5\n";
+	if (_run_parallel("t/pmap.den", 0, 0, expected) != 0)
+		return 1;
+	if (_run_parallel("t/pmap.den", 4, 0, expected) <= 0)
+		return 1;
+
+	/* A run that fails on a worker fails the whole thing. */
+	const struct lair_options options = { .parallel = 4 };
+	return _run_with_options("t/pmap_fail.den", &options, "\x1B[31mERR_RUNTIME\x1B[0m: Index out of range.\n") <= 0;
+}
+
 int test_plus() {
 	return _run_program("t/plus.den");
 }
 
+int test_profile() {
+	char path[PATH_MAX];
+	if (_temp_file(path) != 0)
+		return 1;
+	char *buf = NULL;
+	size_t buf_siz = 0;
+	const struct lair_options options = { .profile = 1, .profile_path = path };
+
+	buf = lair_load_file("t/functions_all_the_way_down.den", &buf_siz);
+	const int rc = lair_execute_with_options(buf, buf_siz, &options);
+	lair_unload_file(buf, buf_siz);
+
+	/* Every function in the chain ran once, and so did `print`. */
+	char *report = _read_report(path);
+	if (rc != 0 || report == NULL) {
+		free(report);
+		return 1;
+	}
+
+	const char *expected[] = { "\"a\"", "\"b\"", "\"c\"", "\"d\"", "\"print\"", "\"main\"" };
+	int failed = 0;
+	size_t i;
+	for (i = 0; i < sizeof(expected) / sizeof(expected[0]) && !failed; i++) {
+		const char *entry = strstr(report, expected[i]);
+		const char *calls = entry != NULL ? strstr(entry, "\"calls\": ") : NULL;
+		failed = calls == NULL || strncmp(calls, "\"calls\": 1,", 11) != 0;
+	}
+	free(report);
+	return failed;
+}
+
+int test_ropes() {
+	return _run_program("t/ropes.den");
+}
+
+int test_sample() {
+	char path[PATH_MAX];
+	if (_temp_file(path) != 0)
+		return 1;
+	char *buf = NULL;
+	size_t buf_siz = 0;
+	const struct lair_options options = { .sample = 1, .sample_hz = 1000, .sample_path = path };
+
+	buf = lair_load_file("bench/fib.den", &buf_siz);
+	const int rc = lair_execute_with_options(buf, buf_siz, &options);
+	lair_unload_file(buf, buf_siz);
+
+	/* That's long enough to catch fib calling itself more than once. */
+	char *report = _read_report(path);
+	if (rc != 0 || report == NULL) {
+		free(report);
+		return 1;
+	}
+	const int failed = strstr(report, "main;fib;fib;fib") == NULL;
+	free(report);
+	return failed;
+}
+
 int test_shadow() {
 	return _expect_failure("t/shadow.den");
 }
@@ -99,6 +491,163 @@ int test_string_range() {
 	return _run_program("t/string_range.den");
 }
 
+int test_stats() {
+	char path[PATH_MAX];
+	if (_temp_file(path) != 0)
+		return 1;
+	char *buf = NULL;
+	size_t buf_siz = 0;
+	const struct lair_options options = { .stats = 1, .stats_path = path };
+
+	buf = lair_load_file("t/tail_call.den", &buf_siz);
+	const int rc = lair_execute_with_options(buf, buf_siz, &options);
+	lair_unload_file(buf, buf_siz);
+
+	char *report = _read_report(path);
+	if (rc != 0 || report == NULL) {
+		free(report);
+		return 1;
+	}
+
+	/* The tail calls got counted, and so did something else. */
+	const char *tail_calls = strstr(report, "tail calls");
+	const char *instructions = strstr(report, "instructions");
+	const int failed = tail_calls == NULL || strtoul(tail_calls + strlen("tail calls"), NULL, 10) == 0 ||
+		instructions == NULL || strtoul(instructions + strlen("instructions"), NULL, 10) == 0;
+	free(report);
+	return failed;
+}
+
+int test_str_map() {
+	/* Short keys live in the table, long ones don't. Enough of them to make
+	 * it grow a few times.
+	 */
+	struct _str_map map = {0};
+	char key[64] = {0};
+	int i;
+	for (i = 0; i < 1000; i++) {
+		const size_t klen = snprintf(key, sizeof(key), i % 2 ? "k%i" : "a_much_longer_key_%i", i);
+		if (_str_map_insert(&map, key, klen, &i, sizeof(i)) != 0)
+			return 1;
+	}
+	if (_str_map_insert(&map, "k1", strlen("k1"), &i, sizeof(i)) != 1)
+		return 1;
+
+	for (i = 0; i < 1000; i++) {
+		const size_t klen = snprintf(key, sizeof(key), i % 2 ? "k%i" : "a_much_longer_key_%i", i);
+		const int *value = _str_map_get(&map, key, klen);
+		if (value == NULL || *value != i)
+			return 1;
+		if (i % 3 == 0 && _str_map_delete(&map, key, klen) != 0)
+			return 1;
+	}
+
+	/* Deleted keys are gone, and can come back. */
+	if (_str_map_get(&map, "k3", strlen("k3")) != NULL || _str_map_get(&map, "k5", strlen("k5")) == NULL)
+		return 1;
+	if (_str_map_delete(&map, "k3", strlen("k3")) != 1)
+		return 1;
+	if (_str_map_insert(&map, "k3", strlen("k3"), &i, sizeof(i)) != 0)
+		return 1;
+	if (map.count != 1000 - 334 + 1)
+		return 1;
+
+	_str_map_clear(&map, NULL);
+	return map.count != 0;
+}
+
+int test_symbols() {
+	return _run_program("t/symbols.den");
+}
+
+int test_tail_call() {
+	return _run_program("t/tail_call.den");
+}
+
+#define THREADS_COUNT 8
+#define THREADS_ROUNDS 2
+
+struct _threads_program {
+	const char *path;
+	char *source;
+	size_t len;
+	int rc; /* What it returned when it ran on its own. */
+	char *output; /* What it printed when it ran on its own. */
+	size_t output_len;
+};
+
+static struct _threads_program _threads_programs[] = {
+	{ .path = "t/collections.den" },
+	{ .path = "t/garbage.den" },
+	{ .path = "t/ropes.den" },
+	{ .path = "t/loop.den" },
+	{ .path = "t/minus_fail.den" },
+	{ .path = "t/test_assignment.den" },
+};
+#define THREADS_NPROGRAMS (sizeof(_threads_programs) / sizeof(_threads_programs[0]))
+
+/* Runs a program and hands back what it printed. */
+static int _run_captured(const struct _threads_program *p, char **output, size_t *output_len) {
+	FILE *out = open_memstream(output, output_len);
+	if (out == NULL)
+		return -1;
+	const struct lair_options options = { .out = out };
+	const int rc = lair_execute_with_options(p->source, p->len, &options);
+	fclose(out);
+	return rc;
+}
+
+static void *_threads_worker(void *arg) {
+	const size_t start = (size_t)arg;
+	size_t round, i;
+	for (round = 0; round < THREADS_ROUNDS; round++) {
+		for (i = 0; i < THREADS_NPROGRAMS; i++) {
+			/* Everyone starts somewhere different, so different programs overlap. */
+			const struct _threads_program *p = &_threads_programs[(start + i) % THREADS_NPROGRAMS];
+			char *output = NULL;
+			size_t output_len = 0;
+			const int rc = _run_captured(p, &output, &output_len);
+			const int same = rc == p->rc && output_len == p->output_len && memcmp(output, p->output, output_len) == 0;
+			free(output);
+			if (!same)
+				return (void *)1;
+		}
+	}
+	return NULL;
+}
+
+int test_threads() {
+	int failed = 0;
+	size_t i;
+	for (i = 0; i < THREADS_NPROGRAMS; i++) {
+		struct _threads_program *p = &_threads_programs[i];
+		p->source = lair_load_file(p->path, &p->len);
+		if (p->source == NULL)
+			return 1;
+		p->rc = _run_captured(p, &p->output, &p->output_len);
+	}
+
+	pthread_t threads[THREADS_COUNT];
+	size_t started = 0;
+	for (started = 0; started < THREADS_COUNT; started++) {
+		if (pthread_create(&threads[started], NULL, _threads_worker, (void *)started) != 0) {
+			failed = 1;
+			break;
+		}
+	}
+	for (i = 0; i < started; i++) {
+		void *result = NULL;
+		pthread_join(threads[i], &result);
+		failed |= result != NULL;
+	}
+
+	for (i = 0; i < THREADS_NPROGRAMS; i++) {
+		lair_unload_file(_threads_programs[i].source, _threads_programs[i].len);
+		free(_threads_programs[i].output);
+	}
+	return failed;
+}
+
 int test_thingIThoughtOfThisMorning() {
 	return _run_program("t/thingIThoughtOfThisMorning.den");
 }
@@ -116,19 +665,40 @@ int main(int argc, char *argv[]) {
 	run_test(test_assignment);
 	run_test(test_assignment_no_function);
 	run_test(test_basic);
+	run_test(test_builtins);
+	run_test(test_cache);
+	run_test(test_collections);
 	run_test(test_equality);
 	run_test(test_equality_disparate);
+	run_test(test_escapes);
+	run_test(test_folding);
 	run_test(test_functions_all_the_way_down);
+	run_test(test_garbage);
 	run_test(test_id_function);
+	run_test(test_immediates);
+	run_test(test_locals);
 	run_test(test_loop);
+	run_test(test_memo);
+	run_test(test_memory);
 	run_test(test_multilinefunction);
+	run_test(test_number_too_big);
 	run_test(test_objects);
+	run_test(test_parallel);
 	run_test(test_plus);
+	run_test(test_pmap);
+	run_test(test_profile);
+	run_test(test_ropes);
+	run_test(test_sample);
 	run_test(test_shadow);
 	run_test(test_minus);
 	run_test(test_minus_fail);
 	run_test(test_string_append);
 	run_test(test_string_range);
+	run_test(test_stats);
+	run_test(test_str_map);
+	run_test(test_symbols);
+	run_test(test_tail_call);
+	run_test(test_threads);
 	run_test(test_thingIThoughtOfThisMorning);
 
 	printf("Tests passed: (%i/%i).\n", tests_run, tests_run + tests_failed);
@@ -0,0 +1,583 @@
+// vim: noet ts=4 sw=4
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "compile.h"
+#include "error.h"
+#include "eval.h"
+#include "lair.h"
+#include "map.h"
+#include "memo.h"
+#include "memory.h"
+#include "parallel.h"
+#include "parse.h"
+#include "profile.h"
+#include "stats.h"
+#include "symbol.h"
+#include "vector.h"
+#include "vm.h"
+
+/* Labels-as-values are a GNU extension. Everyone else gets a switch. */
+#if defined(__GNUC__) && !defined(LAIR_NO_COMPUTED_GOTO)
+#define LAIR_COMPUTED_GOTO
+#endif
+
+/* When we're counting instructions, the computed goto version dispatches
+ * through a table that sends everything to do_count first. The switch version
+ * has to check.
+ */
+#ifdef LAIR_COMPUTED_GOTO
+#define VM_DISPATCH()	i = *pc++; goto *dispatch[LR_OP(i)]
+#define VM_CASE(op)		do_##op:
+#define VM_LOOP			VM_DISPATCH();
+#define VM_END			do_count: counts[LR_OP(i)]++; goto *_dispatch[LR_OP(i)];
+#else
+#define VM_DISPATCH()	continue
+#define VM_CASE(op)		case op:
+#define VM_LOOP			for (;;) { i = *pc++; if (counts != NULL) counts[LR_OP(i)]++; switch (LR_OP(i)) {
+#define VM_END			default: throw_exception(r, ERR_RUNTIME, "Bad instruction."); } }
+#endif
+
+/* Builtins can call back into Den, which can move the stacks out from under
+ * us, so anything pointing into them is looked up again after one returns.
+ */
+#define VM_RELOAD()		frame = &vm->frames[vm->depth - 1]; R = vm->regs + frame->base
+
+#define VM_INITIAL_REGS		256
+#define VM_INITIAL_FRAMES	64
+#define VM_INITIAL_FORKS	16
+
+static void _vm_grew(struct _lair_runtime *r, struct _lair_vm *vm, const size_t bytes) {
+	vm->bytes += bytes;
+	_lair_mem_alloc(r->memory, LR_MEM_VM, bytes);
+}
+
+static void _vm_reserve(struct _lair_runtime *r, struct _lair_vm *vm, const size_t needed) {
+	if (needed <= vm->regs_size)
+		return;
+
+	size_t new_size = vm->regs_size == 0 ? VM_INITIAL_REGS : vm->regs_size;
+	while (new_size < needed)
+		new_size *= 2;
+
+	_lair_val *regs = realloc(vm->regs, new_size * sizeof(_lair_val));
+	check(r, regs != NULL, ERR_RUNTIME, "Out of memory growing the register stack.");
+	memset(regs + vm->regs_size, 0, (new_size - vm->regs_size) * sizeof(_lair_val));
+	_vm_grew(r, vm, (new_size - vm->regs_size) * sizeof(_lair_val));
+	vm->regs = regs;
+	vm->regs_size = new_size;
+}
+
+static struct _lair_frame *_vm_push_frame(
+		struct _lair_runtime *r,
+		struct _lair_vm *vm,
+		const struct _lair_proto *proto,
+		const size_t base) {
+	if (vm->depth == vm->frames_size) {
+		const size_t new_size = vm->frames_size == 0 ? VM_INITIAL_FRAMES : vm->frames_size * 2;
+		struct _lair_frame *frames = realloc(vm->frames, new_size * sizeof(struct _lair_frame));
+		check(r, frames != NULL, ERR_RUNTIME, "Out of memory growing the call stack.");
+		_vm_grew(r, vm, (new_size - vm->frames_size) * sizeof(struct _lair_frame));
+		vm->frames = frames;
+		vm->frames_size = new_size;
+	}
+	_vm_reserve(r, vm, base + proto->nregs);
+
+	/* Locals start out unbound, and anything a returned call left behind in
+	 * our registers shouldn't be chased by the garbage collector. The
+	 * arguments stay.
+	 */
+	if (proto->nregs > proto->argc)
+		memset(vm->regs + base + proto->argc, 0, (proto->nregs - proto->argc) * sizeof(_lair_val));
+
+	struct _lair_frame *frame = &vm->frames[vm->depth++];
+	frame->proto = proto;
+	frame->pc = proto->entry;
+	frame->base = base;
+	frame->memo = 0;
+	frame->returns = 0;
+	return frame;
+}
+
+/* Makes room for one more fork, before we fork it, so the fork can't get lost
+ * if there isn't any.
+ */
+static void _vm_reserve_fork(struct _lair_runtime *r, struct _lair_vm *vm) {
+	if (vm->nforks < vm->forks_size)
+		return;
+
+	const size_t new_size = vm->forks_size == 0 ? VM_INITIAL_FORKS : vm->forks_size * 2;
+	struct _lair_fork *forks = realloc(vm->forks, new_size * sizeof(struct _lair_fork));
+	check(r, forks != NULL, ERR_RUNTIME, "Out of memory forking a call.");
+	_vm_grew(r, vm, (new_size - vm->forks_size) * sizeof(struct _lair_fork));
+	vm->forks = forks;
+	vm->forks_size = new_size;
+}
+
+static void _undefined(struct _lair_runtime *r, const _lair_sym sym) {
+	char buf[256] = {0};
+	snprintf(buf, sizeof(buf), "Atom is undefined: %s", _lair_symbol_name(r, sym));
+	throw_exception(r, ERR_RUNTIME, buf);
+}
+
+static void _rebound(struct _lair_runtime *r, const _lair_sym sym) {
+	char buf[256] = {0};
+	snprintf(buf, sizeof(buf), "Cannot rebind: %s", _lair_symbol_name(r, sym));
+	throw_exception(r, ERR_RUNTIME, buf);
+}
+
+/* Finds the prototype a function value refers to. */
+static const struct _lair_proto *_resolve_callee(
+		struct _lair_runtime *r,
+		const struct _lair_proto *protos,
+		const _lair_val callee) {
+	if (_lair_type_of(callee) != LR_FUNCTION_DEF) {
+		char buf[512] = {0};
+		snprintf(buf, sizeof(buf), "Cannot call a non-function: %s",
+				callee == LR_NIL ? "(null)" : _friendly_enum(_lair_type_of(callee)));
+		throw_exception(r, ERR_RUNTIME, buf);
+	}
+
+	const int proto = LR_UNBOX(callee)->proto;
+	if (proto < 0) {
+		char buf[512] = {0};
+		snprintf(buf, sizeof(buf), "No such function: %s", _lair_str_of(callee));
+		throw_exception(r, ERR_RUNTIME, buf);
+	}
+	return &protos[proto];
+}
+
+static inline void _check_argc(struct _lair_runtime *r, const struct _lair_proto *proto, const int argc) {
+	if (argc != proto->argc) {
+		char buf[512] = {0};
+		snprintf(buf, sizeof(buf), "Incorrect number of arguments to function: %s", proto->name);
+		throw_exception(r, ERR_RUNTIME, buf);
+	}
+}
+
+/* A copy of the program's code with every call and return swapped for its
+ * profiled twin. Only the opcodes change, so every offset stays the same.
+ * Forks become plain calls, since the profiler only sees this thread.
+ */
+static const uint32_t *_profiled_code(struct _lair_runtime *r, struct _lair_vm *vm, const struct _lair_program *program) {
+	const uint32_t *code = (const uint32_t *)program->code->items;
+	vm->code = malloc((program->code->count + 1) * sizeof(uint32_t));
+	check(r, vm->code != NULL, ERR_RUNTIME, "Out of memory starting the profiler.");
+	_vm_grew(r, vm, (program->code->count + 1) * sizeof(uint32_t));
+
+	size_t pc;
+	for (pc = 0; pc < program->code->count; pc++) {
+		const uint32_t i = code[pc];
+		LAIR_OPCODE op = LR_OP(i);
+		switch (op) {
+			case OP_CALL:		op = OP_PCALL; break;
+			case OP_TAILCALL:	op = OP_PTAILCALL; break;
+			case OP_CALLK:		op = OP_PCALLK; break;
+			case OP_FORKK:		op = OP_PCALLK; break;
+			case OP_TAILCALLK:	op = OP_PTAILCALLK; break;
+			case OP_RET:		op = OP_PRET; break;
+			case OP_RETNIL:		op = OP_PRETNIL; break;
+			default:			break;
+		}
+		vm->code[pc] = (i & ~(uint32_t)0xFF) | op;
+	}
+	return vm->code;
+}
+
+void _lair_vm_free(struct _lair_vm *vm) {
+	if (vm == NULL)
+		return;
+
+	/* Whatever's running them needs the program, so we can't go first. */
+	size_t f;
+	for (f = 0; f < vm->nforks; f++)
+		_lair_fork_drop(vm->forks[f].task);
+	free(vm->forks);
+	free(vm->regs);
+	free(vm->frames);
+	free(vm->constants);
+	free(vm->globals);
+	free(vm->code);
+	free(vm);
+}
+
+struct _lair_vm *_lair_vm_new(struct _lair_runtime *r, const struct _lair_program *program) {
+	struct _lair_vm *vm = calloc(1, sizeof(struct _lair_vm));
+	check(r, vm != NULL, ERR_RUNTIME, "Out of memory loading the program.");
+	r->vm = vm;
+
+	/* Numbers in the pool get unboxed once here instead of on every load. */
+	const struct _lair_type *k = (const struct _lair_type *)program->constants->items;
+	vm->constants = calloc(program->constants->count + 1, sizeof(_lair_val));
+	vm->nglobals = program->globals->count;
+	vm->globals = calloc(vm->nglobals + 1, sizeof(_lair_val));
+	check(r, vm->constants != NULL && vm->globals != NULL, ERR_RUNTIME, "Out of memory loading the program.");
+	_vm_grew(r, vm, (program->constants->count + vm->nglobals + 2) * sizeof(_lair_val));
+	vm->protos = (const struct _lair_proto *)program->protos->items;
+	size_t c;
+	for (c = 0; c < program->constants->count; c++)
+		vm->constants[c] = _lair_val_of(&k[c]);
+
+	if (r->profile != NULL)
+		_profiled_code(r, vm, program);
+	return vm;
+}
+
+void _lair_vm_end(struct _lair_runtime *r) {
+	_lair_mem_free(r->memory, LR_MEM_VM, r->vm->bytes);
+	_lair_vm_free(r->vm);
+	r->vm = NULL;
+}
+
+static _lair_val _vm_run(
+		struct _lair_runtime *r,
+		const struct _lair_program *program,
+		const size_t entry,
+		const _lair_val *args) {
+#ifdef LAIR_COMPUTED_GOTO
+	static const void *_dispatch[OP_MAX] = {
+		[OP_LOADK] = &&do_OP_LOADK,
+		[OP_GETLOCAL] = &&do_OP_GETLOCAL,
+		[OP_SETLOCAL] = &&do_OP_SETLOCAL,
+		[OP_GETGLOBAL] = &&do_OP_GETGLOBAL,
+		[OP_SETGLOBAL] = &&do_OP_SETGLOBAL,
+		[OP_CALL] = &&do_OP_CALL,
+		[OP_TAILCALL] = &&do_OP_TAILCALL,
+		[OP_CALLK] = &&do_OP_CALLK,
+		[OP_TAILCALLK] = &&do_OP_TAILCALLK,
+		[OP_JMPF] = &&do_OP_JMPF,
+		[OP_RET] = &&do_OP_RET,
+		[OP_RETNIL] = &&do_OP_RETNIL,
+		[OP_FORKK] = &&do_OP_FORKK,
+		[OP_JOIN] = &&do_OP_JOIN,
+		[OP_PCALL] = &&do_OP_PCALL,
+		[OP_PTAILCALL] = &&do_OP_PTAILCALL,
+		[OP_PCALLK] = &&do_OP_PCALLK,
+		[OP_PTAILCALLK] = &&do_OP_PTAILCALLK,
+		[OP_PRET] = &&do_OP_PRET,
+		[OP_PRETNIL] = &&do_OP_PRETNIL,
+	};
+	static const void *_counting[OP_MAX] = {
+		[0 ... OP_MAX - 1] = &&do_count,
+	};
+#endif
+	struct _lair_vm *vm = r->vm;
+	const int own = vm == NULL;
+	if (own)
+		vm = _lair_vm_new(r, program);
+
+	const uint32_t *code = vm->code != NULL ? vm->code : (const uint32_t *)program->code->items;
+	const struct _lair_proto *protos = vm->protos;
+	const _lair_sym *local_names = (const _lair_sym *)program->locals->items;
+	const _lair_sym *global_names = (const _lair_sym *)program->globals->items;
+	const _lair_val *K = vm->constants;
+	_lair_val *G = vm->globals;
+
+	/* If something's already running, we're being called from a builtin it
+	 * called, and the call goes on top of it.
+	 */
+	size_t base = 0;
+	if (vm->depth > 0) {
+		const struct _lair_frame *top = &vm->frames[vm->depth - 1];
+		base = top->base + top->proto->nregs;
+	}
+	struct _lair_frame *frame = _vm_push_frame(r, vm, &protos[entry], base);
+	frame->returns = !own;
+	if (protos[entry].argc > 0)
+		memcpy(vm->regs + base, args, protos[entry].argc * sizeof(_lair_val));
+	_lair_val *R = vm->regs + base;
+	const uint32_t *pc = code + frame->pc;
+	_lair_val ret_val = LR_NIL;
+	uint32_t i = 0;
+
+	/* Set up by the call instructions for the shared code that makes the call. */
+	const struct _lair_proto *proto = NULL;
+	int a = 0;
+	int argc = 0;
+
+	struct _lair_profile *profile = r->profile;
+	if (profile != NULL)
+		_lair_profile_enter(r, profile, entry);
+
+	struct _lair_memo *memo = r->memo;
+	struct _lair_parallel *parallel = r->parallel;
+	size_t *counts = r->stats != NULL ? r->stats->ops : NULL;
+#ifdef LAIR_COMPUTED_GOTO
+	const void *const *dispatch = counts != NULL ? _counting : _dispatch;
+#endif
+
+	VM_LOOP
+	VM_CASE(OP_LOADK) {
+		R[LR_A(i)] = K[LR_BX(i)];
+		VM_DISPATCH();
+	}
+	VM_CASE(OP_GETLOCAL) {
+		const _lair_val value = R[LR_B(i)];
+		if (value == LR_NIL)
+			_undefined(r, local_names[frame->proto->locals + LR_B(i)]);
+		R[LR_A(i)] = value;
+		VM_DISPATCH();
+	}
+	VM_CASE(OP_SETLOCAL) {
+		if (R[LR_A(i)] != LR_NIL)
+			_rebound(r, local_names[frame->proto->locals + LR_A(i)]);
+		R[LR_A(i)] = R[LR_B(i)];
+		VM_DISPATCH();
+	}
+	VM_CASE(OP_GETGLOBAL) {
+		const _lair_val value = G[LR_BX(i)];
+		if (value == LR_NIL)
+			_undefined(r, global_names[LR_BX(i)]);
+		R[LR_A(i)] = value;
+		VM_DISPATCH();
+	}
+	VM_CASE(OP_SETGLOBAL) {
+		if (G[LR_BX(i)] != LR_NIL)
+			_rebound(r, global_names[LR_BX(i)]);
+		G[LR_BX(i)] = R[LR_A(i)];
+		VM_DISPATCH();
+	}
+	VM_CASE(OP_CALL) {
+		a = LR_A(i);
+		argc = LR_C(i);
+		proto = _resolve_callee(r, protos, R[a]);
+		if (proto->builtin == NULL)
+			_check_argc(r, proto, argc);
+		goto do_call;
+	}
+	VM_CASE(OP_CALLK) {
+		/* The compiler already made sure we've got the right number of
+		 * arguments.
+		 */
+		a = LR_A(i);
+		proto = &protos[LR_BX(i)];
+		argc = proto->argc;
+do_call:
+		if (proto->builtin != NULL) {
+			const _lair_val result = proto->builtin->function_ptr(r, argc, &R[a + 1]);
+			VM_RELOAD();
+			R[a] = result;
+			VM_DISPATCH();
+		}
+
+do_push:
+		if (memo != NULL && memo->memoizable[proto - protos]) {
+			/* Already made this call, so the answer's all we need. */
+			switch (_lair_memo_call(r, memo, proto - protos, &R[a + 1], &R[a], 1)) {
+				case LR_MEMO_HIT:
+					if (profile != NULL)
+						_lair_profile_exit(r, profile);
+					VM_DISPATCH();
+				case LR_MEMO_MISS:
+					frame->pc = pc - code;
+					frame = _vm_push_frame(r, vm, proto, frame->base + a + 1);
+					frame->memo = memo->npending;
+					R = vm->regs + frame->base;
+					pc = code + frame->pc;
+					VM_DISPATCH();
+				case LR_MEMO_SKIP:
+					break;
+			}
+		}
+
+		/* The arguments are already sitting where the callee's registers
+		 * start, so there's nothing to copy.
+		 */
+		frame->pc = pc - code;
+		frame = _vm_push_frame(r, vm, proto, frame->base + a + 1);
+		R = vm->regs + frame->base;
+		pc = code + frame->pc;
+		VM_DISPATCH();
+	}
+	VM_CASE(OP_TAILCALL) {
+		a = LR_A(i);
+		argc = LR_C(i);
+		proto = _resolve_callee(r, protos, R[a]);
+		if (proto->builtin == NULL)
+			_check_argc(r, proto, argc);
+		goto do_tailcall;
+	}
+	VM_CASE(OP_TAILCALLK) {
+		a = LR_A(i);
+		proto = &protos[LR_BX(i)];
+		argc = proto->argc;
+do_tailcall:
+		if (proto->builtin != NULL) {
+			ret_val = proto->builtin->function_ptr(r, argc, &R[a + 1]);
+			VM_RELOAD();
+			goto do_return;
+		}
+
+do_replace:
+		if (memo != NULL && memo->memoizable[proto - protos]) {
+			/* If this frame is already waiting on a result, this call's
+			 * result is that one, so there's nothing more to remember.
+			 */
+			const int remember = frame->memo == 0;
+			switch (_lair_memo_call(r, memo, proto - protos, &R[a + 1], &ret_val, remember)) {
+				case LR_MEMO_HIT:
+					if (profile != NULL)
+						goto do_preturn;
+					goto do_return;
+				case LR_MEMO_MISS:
+					if (remember)
+						frame->memo = memo->npending;
+					break;
+				case LR_MEMO_SKIP:
+					break;
+			}
+		}
+
+		/* Nothing in this frame is needed anymore, so the callee gets it:
+		 * the arguments slide down to the bottom of our registers and every
+		 * local is unbound.
+		 */
+		memmove(R, &R[a + 1], argc * sizeof(_lair_val));
+		_vm_reserve(r, vm, frame->base + proto->nregs);
+		R = vm->regs + frame->base;
+		if (proto->nregs > argc)
+			memset(R + argc, 0, (proto->nregs - argc) * sizeof(_lair_val));
+		frame->proto = proto;
+		pc = code + proto->entry;
+		VM_DISPATCH();
+	}
+	VM_CASE(OP_JMPF) {
+		if (R[LR_A(i)] != LR_TRUE)
+			pc += LR_SBX(i);
+		VM_DISPATCH();
+	}
+	VM_CASE(OP_RET) {
+		ret_val = R[LR_A(i)];
+		goto do_return;
+	}
+	VM_CASE(OP_RETNIL) {
+		ret_val = LR_NIL;
+do_return:
+		if (frame->memo != 0)
+			_lair_memo_return(r, memo, frame->memo, ret_val);
+		vm->depth--;
+		if (frame->returns)
+			return ret_val;
+		if (vm->depth == 0) {
+			_lair_vm_end(r);
+			return ret_val;
+		}
+
+		/* The caller wants the result where the callee used to be. */
+		vm->regs[frame->base - 1] = ret_val;
+		frame = &vm->frames[vm->depth - 1];
+		R = vm->regs + frame->base;
+		pc = code + frame->pc;
+		VM_DISPATCH();
+	}
+	VM_CASE(OP_FORKK) {
+		a = LR_A(i);
+		proto = &protos[LR_BX(i)];
+		argc = proto->argc;
+		/* The memo table belongs to this runtime, so memoizable calls get
+		 * made here where they can use it.
+		 */
+		if (parallel != NULL && (memo == NULL || !memo->memoizable[proto - protos])) {
+			_vm_reserve_fork(r, vm);
+			struct _lair_task *task = _lair_fork(r, parallel, proto - protos, &R[a + 1]);
+			if (task != NULL) {
+				vm->forks[vm->nforks].reg = frame->base + a;
+				vm->forks[vm->nforks].task = task;
+				vm->nforks++;
+				VM_DISPATCH();
+			}
+		}
+		goto do_call;
+	}
+	VM_CASE(OP_JOIN) {
+		/* Anything forked by a call this one's waiting on was joined before
+		 * that call was made, so ours are the ones on top.
+		 */
+		const size_t from = frame->base + LR_A(i);
+		size_t first = vm->nforks;
+		while (first > 0 && vm->forks[first - 1].reg >= from)
+			first--;
+		if (first < vm->nforks) {
+			const size_t nforks = vm->nforks - first;
+			vm->nforks = first;
+			_lair_join(r, &vm->forks[first], nforks, vm->regs);
+		}
+		VM_DISPATCH();
+	}
+
+	/* The profiled twins. They tell the profiler what's happening and then
+	 * do whatever the instruction they replaced would have.
+	 */
+	VM_CASE(OP_PCALL) {
+		a = LR_A(i);
+		argc = LR_C(i);
+		proto = _resolve_callee(r, protos, R[a]);
+		if (proto->builtin == NULL)
+			_check_argc(r, proto, argc);
+		goto do_pcall;
+	}
+	VM_CASE(OP_PCALLK) {
+		a = LR_A(i);
+		proto = &protos[LR_BX(i)];
+		argc = proto->argc;
+do_pcall:
+		_lair_profile_enter(r, profile, proto - protos);
+		if (proto->builtin == NULL)
+			goto do_push;
+		const _lair_val result = proto->builtin->function_ptr(r, argc, &R[a + 1]);
+		VM_RELOAD();
+		R[a] = result;
+		_lair_profile_exit(r, profile);
+		VM_DISPATCH();
+	}
+	VM_CASE(OP_PTAILCALL) {
+		a = LR_A(i);
+		argc = LR_C(i);
+		proto = _resolve_callee(r, protos, R[a]);
+		if (proto->builtin == NULL)
+			_check_argc(r, proto, argc);
+		goto do_ptailcall;
+	}
+	VM_CASE(OP_PTAILCALLK) {
+		a = LR_A(i);
+		proto = &protos[LR_BX(i)];
+		argc = proto->argc;
+do_ptailcall:
+		if (proto->builtin != NULL) {
+			/* The builtin runs as part of the function that called it. */
+			_lair_profile_enter(r, profile, proto - protos);
+			ret_val = proto->builtin->function_ptr(r, argc, &R[a + 1]);
+			VM_RELOAD();
+			_lair_profile_exit(r, profile);
+			goto do_preturn;
+		}
+		_lair_profile_replace(r, profile, proto - protos);
+		goto do_replace;
+	}
+	VM_CASE(OP_PRET) {
+		ret_val = R[LR_A(i)];
+		goto do_preturn;
+	}
+	VM_CASE(OP_PRETNIL) {
+		ret_val = LR_NIL;
+do_preturn:
+		_lair_profile_exit(r, profile);
+		goto do_return;
+	}
+	VM_END
+
+	return LR_NIL;
+}
+
+_lair_val _lair_vm_run(struct _lair_runtime *r, const struct _lair_program *program) {
+	return _vm_run(r, program, program->main, NULL);
+}
+
+_lair_val _lair_vm_call(
+		struct _lair_runtime *r,
+		const struct _lair_program *program,
+		const size_t proto,
+		const _lair_val *args) {
+	return _vm_run(r, program, proto, args);
+}